@@ -68,24 +68,41 @@ bool master_found_and_paired = false;
 bool slave_received_first_message = false;
 bool boost_enable_on = false;
 byte slave_canid = 0;
+byte master_wire_version = 0;
 char mdnsname[32];
 uint8_t mac_master[6] = {0, 0, 0, 0, 0, 0};
+const uint8_t net_broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 unsigned long slave_last_net_msg_received_time = 0UL, slave_last_can_frame_received_time = 0UL;
 config_t config_data;
 peer_state_t peers[MAX_NET_PEERS];
+portMUX_TYPE peer_mux = portMUX_INITIALIZER_UNLOCKED;   // the peer table, see peer_find_locked
 stats_t stats, errors;
+net_batch_stats_t net_batch_stats;
+net_rx_stats_t net_rx_stats;
+TaskHandle_t net_rx_task_handle = NULL;
 
 // variables declared in other source files
 extern byte num_gc_clients, num_wi_clients, node;
 extern bool wsserver_running;
 extern byte proxy_canids[MAX_NET_PEERS];
+extern frame_pool_stats_t frame_pool_stats;
+extern router_stats_t router_stats;
+extern tx_sched_stats_t tx_sched_stats[TX_SCHED_NUM_PRIORITIES];
+extern tx_sched_drops_t tx_sched_drops;
+extern net_rel_stats_t net_rel_stats;
+extern bool boot_resumed;
+extern can_alert_stats_t can_alert_stats;
 
 // forward function declarations
 void IRAM_ATTR touch_callback(void);
+void net_rx_process(const uint8_t *mac_addr, const uint8_t *data, int data_len);
 
 // task functions
 void CAN_task(void *params);
+void CAN_tx_task(void *params);
+void CAN_alert_task(void *params);
 void net_send_task(void *params);
+void net_rx_task(void *params);
 void gc_task(void *params);
 void led_task(void *params);
 void logger_task(void *params);
@@ -104,7 +121,10 @@ task_info_t task_list[] = {
   { led_task, "LED task", 1500, 0, 0, 13, NULL, true, tskNO_AFFINITY },
   { logger_task, "Logger task", 2500, 0, 0, 13, NULL, true, 1 },
   { CAN_task, "CAN task", 2500, 0, 0, 15, NULL, true, 0 },
+  { CAN_tx_task, "CAN TX task", 2500, 0, 0, 15, NULL, true, 0 },
+  { CAN_alert_task, "CAN alert task", 2500, 0, 0, 11, NULL, true, 0 },
   { net_send_task, "Net send task", 2500, 0, 0, 15, NULL, true, 1 },
+  { net_rx_task, "Net receive task", 3000, 0, 0, 15, NULL, true, 1 },
   { gc_task, "GC task", 3000, 0, 0, 15, NULL, true, 1 },
   { battery_monitor_task, "Battery monitor task", 1500, 0, 0, 12, NULL, true, 1 },
   { display_task, "Display task", 1500, 0, 0, 10, NULL, true, tskNO_AFFINITY },
@@ -122,21 +142,21 @@ withrottle_queue, CAN_out_from_withrottle_queue, wsserver_out_queue, cmdproxy_qu
 QueueHandle_t queues[14];
 
 queue_t queue_tab[] = {
-  { "Logger", logger_in_queue, 50, sizeof(log_message_t) },
-  { "LED", led_cmd_queue, 10, sizeof(led_command_t) },
-  { "CAN from net", CAN_out_from_net_queue, 200, sizeof(twai_message_t) },
-  { "CAN from GC", CAN_out_from_GC_queue, 200, sizeof(twai_message_t) },
-  { "CAN from Withrottle", CAN_out_from_withrottle_queue, 50, sizeof(twai_message_t) },
-  { "ESP-NOW out", net_out_queue, 200, sizeof(twai_message_t) },
-  { "Net to net", net_to_net_queue, 100, sizeof(wrapped_frame_t) },
-  { "GC out", gc_out_queue, 200, sizeof(twai_message_t) },
-  { "GC to GC", gc_to_gc_queue, 200, sizeof(wrapped_gc_t) },
-  { "Withrottle", withrottle_queue, 50, sizeof(twai_message_t) },
-  { "Battery monitor", battery_monitor_queue, 20, 16 },
-  { "Websocket", wsserver_out_queue, 20, sizeof(twai_message_t) },
-  { "CMD proxy", cmdproxy_queue, 50, sizeof(twai_message_t) },
-  { "CBUS ext", cbus_in_queue, 200, sizeof(twai_message_t) },
-  { "CBUS int", cbus_internal, 50, sizeof(twai_message_t) }
+  { "Logger", logger_in_queue, 1, sizeof(log_message_t), false },         // unused, log records go through the rings in logger.cpp
+  { "LED", led_cmd_queue, 10, sizeof(led_command_t), false },
+  { "CAN from net", CAN_out_from_net_queue, 200, sizeof(frame_handle_t), true },
+  { "CAN from GC", CAN_out_from_GC_queue, 200, sizeof(frame_handle_t), true },
+  { "CAN from Withrottle", CAN_out_from_withrottle_queue, 50, sizeof(frame_handle_t), true },
+  { "ESP-NOW out", net_out_queue, 200, sizeof(frame_handle_t), true },
+  { "Net to net", net_to_net_queue, 100, sizeof(wrapped_frame_t), false },
+  { "GC out", gc_out_queue, 200, sizeof(frame_handle_t), true },
+  { "GC to GC", gc_to_gc_queue, 200, sizeof(wrapped_gc_t), false },
+  { "Withrottle", withrottle_queue, 50, sizeof(frame_handle_t), true },
+  { "Battery monitor", battery_monitor_queue, 20, 16, false },
+  { "Websocket", wsserver_out_queue, 20, sizeof(frame_handle_t), true },
+  { "CMD proxy", cmdproxy_queue, 50, sizeof(frame_handle_t), true },
+  { "CBUS ext", cbus_in_queue, 200, sizeof(frame_handle_t), true },
+  { "CBUS int", cbus_internal, 50, sizeof(frame_handle_t), true }
 };
 
 can_status_desc_t can_status_desc[4] = {
@@ -156,6 +176,12 @@ void on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) {
 
   // VLOG("on_data_sent, MAC = %s, status = %d", mac_to_char(mac_addr), status);
 
+  // broadcasts are not acknowledged, and the broadcast address has no peer record
+  if (memcmp(mac_addr, net_broadcast_mac, sizeof(net_broadcast_mac)) == 0) {
+    stats.net_tx++;
+    return;
+  }
+
   if (status == ESP_NOW_SEND_SUCCESS) {
 
     if (config_data.role == ROLE_MASTER) {
@@ -174,6 +200,9 @@ void on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) {
       peer_record_op(mac_addr, PEER_INCR_ERR);
     }
 
+    // retransmit any reliable packets this peer has not acknowledged
+    net_rel_send_failed(mac_addr);
+
     ++errors.net_tx;
     PULSE_LED(ERR_IND_LED);
   }
@@ -183,24 +212,96 @@ void on_data_sent(const uint8_t *mac_addr, esp_now_send_status_t status) {
 
 //
 /// this function is called by ESP-NOW when data has been received from an ESP-NOW peer
-/// note that it runs in the wifi task context, so we need to be careful not to block for long, if at all
-/// ensuring that queues are never full should ensure that writers don't block
+/// it runs in the wifi task context, so it only copies the packet into the receive ring and wakes the net_rx task
 //
 
 void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
 
-  twai_message_t *frame;
-  wrapped_frame_t wframe;
-  byte tbuff[8];
+  unsigned long start = micros(), elapsed;
+
+  if (net_rx_ring_put(mac_addr, data, data_len)) {
+    if (net_rx_task_handle != NULL) {
+      xTaskNotifyGive(net_rx_task_handle);
+    }
+  }
+
+  elapsed = micros() - start;
+  net_rx_stats.cb_total_us += elapsed;
+
+  if (elapsed > net_rx_stats.cb_max_us) {
+    net_rx_stats.cb_max_us = elapsed;
+  }
+
+  return;
+}
+
+//
+/// task to process packets received from ESP-NOW peers
+/// runs on the opposite core to the wifi task, and does the work the receive callback used to do
+//
+
+void net_rx_task(void *params) {
+
+  net_rx_packet_t *p;
+
+  LOG("net_rx_task: task starting");
+
+  net_rx_task_handle = xTaskGetCurrentTaskHandle();
+
+  for (;;) {
+
+    // wait for the callback to signal that packets have been received
+    // the timeout picks up any packets received before this task started
+    ulTaskNotifyTake(pdTRUE, QUEUE_OP_TIMEOUT_LONG);
+
+    while ((p = net_rx_ring_peek()) != NULL) {
+      net_rx_process(p->mac_addr, p->data, p->len);
+      net_rx_ring_advance();
+    }
+
+    // send acknowledgements of reliable packets, and deal with any gaps in their sequence
+    net_rel_rx_poll();
+  }
+}
 
-  // check length of received data is that of a CAN frame
-  if (data_len != sizeof(twai_message_t)) {
-    VLOG("on_data_received: bytes expected = %d, got = %d", sizeof(twai_message_t), data_len);
+//
+/// process a packet received from an ESP-NOW peer, in the net_rx task context
+/// we classify the message, register new peers and pass the message to its handler
+/// ensuring that queues are never full should ensure that writers don't block
+//
+
+void net_rx_process(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+#if NET_SIM_LOSS_PCT
+  // simulate packet loss, for testing reliable delivery
+  if (esp_random() % 100 < NET_SIM_LOSS_PCT) {
+    ++net_rel_stats.sim_dropped;
+    return;
+  }
+#endif
+
+  const uint8_t *msg = data;
+  int msg_len = data_len;
+  uint8_t tbuff[sizeof(twai_message_t)];
+  byte type;
+
+  // identify the message type from its first byte
+  // messages from nodes with older firmware are translated to the equivalent typed message
+  type = net_msg_classify(&msg, &msg_len, tbuff);
+
+  if (type == NET_MSG_INVALID) {
+    LOGW(LOG_MOD_NET, "net_rx_process: unknown message, type = 0x%02x, len = %d", data[0], data_len);
     ++errors.net_rx;
     PULSE_LED(ERR_IND_LED);
     return;
   }
 
+  // reflected frames are only sent by a master, so another master on the same channel may hear them
+  // they must not cause the sender to be registered as a peer
+  if (type == NET_MSG_CAN_REFLECT && config_data.role == ROLE_MASTER) {
+    return;
+  }
+
   // update stats
   ++stats.net_rx;
 
@@ -224,28 +325,28 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
       // the first message from an unknown connecting slave should be the network password
       // if we are using this functionality
 
-      VLOG("on_data_rcvd: received message from unknown peer %s", mac_to_char(mac_addr));
+      VLOG("net_rx_process: received message from unknown peer %s", mac_to_char(mac_addr));
 
       if (config_data.use_network_password) {
-        if (memcmp(data, "PW", 2) == 0) {
-          VLOG("on_data_rcvd: received message is a network password");
+        if (type == NET_MSG_JOIN) {
+          VLOG("net_rx_process: received message is a network password");
 
-          char tmppwd[16];
-          memcpy(tmppwd, (void *)&data[2], 14);
-          tmppwd[15] = 0;
+          char tmppwd[NET_PASSWORD_LEN + 2];
+          bzero(tmppwd, sizeof(tmppwd));
+          memcpy(tmppwd, (void *)&msg[2], NET_PASSWORD_LEN);
 
-          VLOG("on_data_rcvd: checking password, |%s| against |%s|", tmppwd, config_data.network_password);
+          VLOG("net_rx_process: checking password, |%s| against |%s|", tmppwd, config_data.network_password);
 
           // compare passwords
           if (strncmp(tmppwd, config_data.network_password, strlen(config_data.network_password)) != 0) {
             // passwords do not match - don't add the slave as a peer and don't respond
-            VLOG("on_data_rcvd: incorrect password, peer will not be paired");
+            VLOG("net_rx_process: incorrect password, peer will not be paired");
             return;
           } else {
-            VLOG("on_data_rcvd: password matched ok, peer will be paired");
+            VLOG("net_rx_process: password matched ok, peer will be paired");
           }
         } else {
-          VLOG("on_data_rcvd: sender is unknown and message is not a password");
+          VLOG("net_rx_process: sender is unknown and message is not a password");
           return;
         }
       }
@@ -254,7 +355,7 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
       // or we are not using the layout password facility
 
       // add slave node as a peer
-      VLOG("on_data_rcvd: registering new peer");
+      VLOG("net_rx_process: registering new peer");
 
       // new peer info record
       esp_now_peer_info_t peer;
@@ -269,11 +370,11 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
       esp_err_t ret = esp_now_add_peer(&peer);
 
       if (ret == ESP_OK) {
-        VLOG("on_data_rcvd: new satellite has been paired ok");
+        VLOG("net_rx_process: new satellite has been paired ok");
         // create a peer state record for collecting stats, etc
         add_peer(mac_addr);
       } else {
-        VLOG("on_data_rcvd: error pairing satellite, err = %d", ret);
+        VLOG("net_rx_process: error pairing satellite, err = %d", ret);
         log_esp_now_err(ret);
       }
     }   // is already peered
@@ -288,56 +389,30 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
 
   if (config_data.role == ROLE_SLAVE && !slave_received_first_message) {
     slave_received_first_message = true;
-    VLOG("on_data_rcvd: satellite has received first message from master; network joined ok");
-  }
-
-  // is this a heartbeat message or a superfluous password message ?
-  // we do nothing more than increment the stats counters above
-
-  if (memcmp(data, "HB", 2) == 0 || memcmp(data, "PW", 2) == 0) {
-    VLOG("on_data_rcvd: message: %c%c", data[0], data[1]);
-    return;
+    VLOG("net_rx_process: satellite has received first message from master; network joined ok");
   }
 
-  // capture messages from the slave's battery monitor task
+  //
+  /// pass the message to the handler for its type
+  //
 
-  if (config_data.role == ROLE_MASTER) {
-    // battery voltage measurement -> 0-9999mV
-    if (memcmp("MV", data, 2) == 0) {
-      memcpy(tbuff, &data[2], 4);
-      tbuff[4] = 0;
-      peer_record_op(mac_addr, PEER_SET_BATT_MV, atoi((char *)&tbuff[2]));
-      VLOG("on_data_received: satellite battery voltage = %d", atoi((char *)&tbuff[2]));
-      return;
-    }
+  net_msg_dispatch(mac_addr, type, msg, msg_len, (msg != data));
+  return;
+}
 
-    // battery state_of_charge measurement -> 0-100%
-    if (memcmp("SO", data, 2) == 0) {
-      memcpy(tbuff, &data[2], 3);
-      tbuff[3] = 0;
-      peer_record_op(mac_addr, PEER_SET_BATT_SOC, atoi((char *)&tbuff[2]));
-      VLOG("on_data_received: satellite battery soc = %d", atoi((char *)&tbuff[2]));
-      return;
-    }
-  }
+//
+/// process a CAN frame received from an ESP-NOW peer
+/// runs in the net_rx task context, called from the message handlers
+//
 
-  if (config_data.role == ROLE_SLAVE) {
-    // proxy CANID
-    if (memcmp("CA", data, 2) == 0) {
-      slave_canid = atoi((char *)&tbuff[2]);
-      VLOG("on_data_received: satellite CANID = %d", slave_canid);
-    }
-  }
+void handle_net_frame(const uint8_t *mac_addr, twai_message_t *frame) {
 
-  //
-  /// otherwise, this data is a CAN message
-  //
+  wrapped_frame_t wframe;
 
-  // get a pointer to the frame data
-  frame = (twai_message_t *)data;
+  boot_mark(BOOT_FIRST_FRAME);
 
-  // VLOG("on_data_rcvd: data received from = %s, len = %d", mac_to_char(mac_addr), data_len);
-  // LOG(format_CAN_frame(&frame));
+  // VLOG("handle_net_frame: frame received from = %s", mac_to_char(mac_addr));
+  // LOG(format_CAN_frame(frame));
 
   //
   /// capture info about attached CAB and CANCMD session
@@ -356,21 +431,27 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
     }
   } else {
     peer_record_op(mac_addr, PEER_SET_CANID, frame->identifier & 0x7f);
+    split_learn(mac_addr, frame);
+    keepalive_peer_frame(mac_addr, frame);
   }
 
   //
   /// all nodes forward the frame to CAN output queue for transmission to local CAN bus
   /// this is either the attached CAB or the layout
+  /// master node also forwards data on to other task queues if tasks are configured to run
+  /// a single call means the frame is copied into the frame pool only once
   //
 
-  if (!send_message_to_queues(QUEUE_CAN_OUT_FROM_NET, frame, "on_data_rcvd", QUEUE_OP_TIMEOUT_SHORT)) {
-    LOG("on_data_rcvd: error queuing message");
-    PULSE_LED(ERR_IND_LED);
+  uint16_t queues = QUEUE_CAN_OUT_FROM_NET;
+
+  if (config_data.role == ROLE_MASTER) {
+    queues |= QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL;
   }
 
-  //
-  /// master node forwards data on to other task queues
-  //
+  if (!send_message_to_queues(queues, frame, "on_data_rcvd", QUEUE_OP_TIMEOUT_SHORT)) {
+    LOGE(LOG_MOD_NET, "on_data_rcvd: error queuing message");
+    PULSE_LED(ERR_IND_LED);
+  }
 
   if (config_data.role == ROLE_MASTER) {
 
@@ -385,22 +466,11 @@ void on_data_rcvd(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
       memcpy(&wframe.mac_addr, mac_addr, sizeof(uint8_t[6]));
       memcpy(&wframe.frame, frame, sizeof(twai_message_t));
 
-      if (!send_message_to_queues(QUEUE_NET_TO_NET, &wframe, "on_data_rcvd", QUEUE_OP_TIMEOUT_SHORT)) {
-        LOG("on_data_rcvd: error queuing message");
+      if (!send_message_to_queues(QUEUE_NET_TO_NET, &wframe, "on_data_rcvd", QUEUE_OP_TIMEOUT_SHORT, false)) {
+        LOGE(LOG_MOD_NET, "on_data_rcvd: error queuing message");
         PULSE_LED(ERR_IND_LED);
       }
     }
-
-    //
-    /// master forwards frame to other task queues if tasks are configured to run
-    //
-
-    uint16_t queues = QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL;
-
-    if (!send_message_to_queues(queues, frame, "on_data_rcvd", QUEUE_OP_TIMEOUT_SHORT)) {
-      LOG("on_data_rcvd: error queuing message");
-      PULSE_LED(ERR_IND_LED);
-    }
   }
 
   return;
@@ -443,48 +513,88 @@ void create_soft_AP(int channel) {
 
 //
 /// slave attempts to locate and pair with the master node for this network
-/// it looks for the master's soft AP, the name of which contains the master's MAC address
+/// it first pairs the master it last joined directly, then tries a passive scan of that master's channel,
+/// and then a full scan, see rejoin.cpp
 /// returns true if the master has been successfully found and paired
 //
 
 bool find_and_pair_master(void) {
 
-  byte mac[6];
+  uint8_t mac[6];
+  byte method, chan;
   signed int apchannel = -1;
-  bool peer_ok = false;
-  esp_now_peer_info_t master = {};
+  bool peer_ok;
 
   if (master_found_and_paired) {
     LOG("find_and_pair_master: master already found and paired");
     return true;
   }
 
+  method = rejoin_next_stage(mac, &chan);
+
+  if (method == REJOIN_DIRECT) {
+    apchannel = chan;
+  } else {
+    apchannel = find_master_ap(method == REJOIN_PASSIVE_SCAN, chan, mac);
+  }
+
+  if (apchannel < 0) {
+    rejoin_paired(method, false);
+    return false;
+  }
+
+  // ESP-NOW uses the channel of our soft AP, which must be the same as the master's
+  if (apchannel != channel) {
+    VLOG("find_and_pair_master: master is on channel = %d, moving soft AP from channel = %d", apchannel, channel);
+    channel = apchannel;
+    create_soft_AP(channel);
+  }
+
+  peer_ok = pair_master(mac, apchannel);
+  rejoin_paired(method, peer_ok);
+  return peer_ok;
+}
+
+//
+/// look for the master's soft AP, on all channels or just the given channel
+/// returns the master's channel and MAC address, or -1 if it was not found
+//
+
+signed int find_master_ap(bool passive, byte chan, uint8_t *mac) {
+
+  signed int apchannel = -1;
+  int16_t num_aps;
+
   // construct the SSID prefix we are looking for
   String prefix = "Master" + String(config_data.network_number);
 
-  VLOG("find_and_pair_master: satellite looking for master node with prefix = %s", prefix.c_str());
+  VLOG("find_master_ap: satellite looking for master node with prefix = %s", prefix.c_str());
 
   // scan for the visible WiFi APs
   // int16_t WiFiScanClass::scanNetworks(bool async, bool show_hidden, bool passive, uint32_t max_ms_per_chan, uint8_t channel)
-  int16_t num_aps = WiFi.scanNetworks(false, true, false, (uint32_t)WIFI_SCAN_MS);   // 350mS/channel by default
+  if (passive) {
+    num_aps = WiFi.scanNetworks(false, true, true, (uint32_t)REJOIN_PASSIVE_SCAN_MS, chan);
+  } else {
+    num_aps = WiFi.scanNetworks(false, true, false, (uint32_t)WIFI_SCAN_MS);   // 350mS/channel by default
+  }
 
   // return if scan error
   switch (num_aps) {
     case WIFI_SCAN_RUNNING:
-      LOG("find_and_pair_master: WiFi scan is already running");
+      LOG("find_master_ap: WiFi scan is already running");
       WiFi.scanDelete();
-      return false;
+      return -1;
       break;
     case WIFI_SCAN_FAILED:
-      LOG("find_and_pair_master: WiFi scan failed");
+      LOG("find_master_ap: WiFi scan failed");
       WiFi.scanDelete();
-      return false;
+      return -1;
       break;
     default:
       break;
   }
 
-  VLOG("find_and_pair_master: number of APs found = %d", num_aps);
+  VLOG("find_master_ap: number of APs found = %d", num_aps);
 
   // iterate through discovered APs
   for (int i = 0 ; i < num_aps; i++) {
@@ -494,57 +604,56 @@ bool find_and_pair_master(void) {
     // if the AP name begins with the word Master and the configured network number, e.g. Master0
     if (SSID.indexOf(prefix) == 0) {
       String BSSIDstr = WiFi.BSSIDstr(i);
-      char *SSID_mac = strchr(WiFi.SSID(i).c_str(), ':') + 1;
       apchannel = WiFi.channel(i);
 
-      VLOG("find_and_pair_master: found master AP for network = %d, channel = %d", config_data.network_number, channel);
+      VLOG("find_master_ap: found master AP for network = %d, channel = %d", config_data.network_number, apchannel);
       VLOG("SSID = %s", SSID.c_str());
-      VLOG("SSID MAC = %s", SSID_mac);
       VLOG("BSSID = %s", BSSIDstr.c_str());
-      VLOG("channel = %d", apchannel);
-
-      bzero(&master, sizeof(esp_now_peer_info_t));
 
-      // VLOG("find_and_pair_master: scanning BSSID for MAC address");
       sscanf(BSSIDstr.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",  &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]);
+      break;
+    }     // does prefix match
+  }     // for each AP
 
-      for (int j = 0; j < 6; j++) {
-        master.peer_addr[j] = mac[j];
-      }
+  WiFi.scanDelete();
+  return apchannel;
+}
 
-      // check whether master is already peered, otherwise add it
-      if (esp_now_is_peer_exist(master.peer_addr)) {
-        LOG("find_and_pair_master: master node already peered");
-        peer_ok = true;
-      } else {
-        // master.ifidx = ESP_IF_WIFI_AP;      // use the AP interface as the STA interface may not be up
-        master.ifidx = WIFI_IF_AP;      // use the AP interface as the STA interface may not be up
-        master.channel = apchannel;
-        master.encrypt = 0;
+//
+/// add the master as an ESP-NOW peer
+//
 
-        esp_err_t ret = esp_now_add_peer(&master);
+bool pair_master(const uint8_t *mac, signed int apchannel) {
 
-        if (ret == ESP_OK) {
-          VLOG("find_and_pair_master: peered with master node = %s", mac_to_char(master.peer_addr));
+  esp_now_peer_info_t master = {};
 
-          // save master MAC address
-          memcpy(&mac_master, &master.peer_addr, sizeof(uint8_t[6]));
+  memcpy(master.peer_addr, mac, sizeof(uint8_t[6]));
 
-          // set return value
-          peer_ok = true;
+  // check whether master is already peered, otherwise add it
+  if (esp_now_is_peer_exist(master.peer_addr)) {
+    LOG("pair_master: master node already peered");
+    memcpy(&mac_master, &master.peer_addr, sizeof(uint8_t[6]));
+    return true;
+  }
 
-        } else {
-          VLOG("find_and_pair_master: error peering master node, ret = %d", ret);
-          log_esp_now_err(ret);
-        }
-      }     // peer already exists
+  // master.ifidx = ESP_IF_WIFI_AP;      // use the AP interface as the STA interface may not be up
+  master.ifidx = WIFI_IF_AP;      // use the AP interface as the STA interface may not be up
+  master.channel = apchannel;
+  master.encrypt = 0;
 
-      break;
-    }     // does prefix match
-  }     // for each AP
+  esp_err_t ret = esp_now_add_peer(&master);
 
-  WiFi.scanDelete();
-  return peer_ok;
+  if (ret != ESP_OK) {
+    VLOG("pair_master: error peering master node, ret = %d", ret);
+    log_esp_now_err(ret);
+    return false;
+  }
+
+  VLOG("pair_master: peered with master node = %s", mac_to_char(master.peer_addr));
+
+  // save master MAC address
+  memcpy(&mac_master, &master.peer_addr, sizeof(uint8_t[6]));
+  return true;
 }
 
 //
@@ -607,9 +716,10 @@ signed int get_wifi_ap_channel(char *ssid_to_match) {
 }
 
 //
-/// task to manage communications to and from the local CAN bus
+/// task to manage communications from the local CAN bus
 /// either a CAB for a slave node, or the layout for the master node
 /// also distributes CAN messages to other optional tasks
+/// frames for the local CAN bus are sent by CAN_tx_task
 //
 /// this task does not interpret the CBUS protocol at all
 /// this is done by the CBUS task which receives CAN messaages from this task
@@ -619,7 +729,7 @@ void CAN_task(void *params) {
 
   bool got_slave_canid = false;
   unsigned long stimer = millis();
-  twai_message_t rx_frame, tx_frame;
+  twai_message_t rx_frame;
   esp_err_t cret;
 
   LOG("CAN_task: task starting");
@@ -629,7 +739,7 @@ void CAN_task(void *params) {
     // display slave CANID once it has been learnt
     if (config_data.role == ROLE_SLAVE && !got_slave_canid && slave_canid > 0) {
       got_slave_canid = true;
-      VLOG("CAN_task: satellite: got CAB identity, CANID = %d", slave_canid);
+      LOGI(LOG_MOD_CAN, "CAN_task: satellite: got CAB identity, CANID = %d", slave_canid);
     }
 
     //
@@ -643,9 +753,11 @@ void CAN_task(void *params) {
 
     //
     /// get next incoming frame from the local CAN bus
+    /// we block until a frame arrives, waking periodically for housekeeping
+    /// frames for transmission to the local bus are handled by CAN_tx_task
     //
 
-    cret = twai_receive(&rx_frame, QUEUE_OP_TIMEOUT);
+    cret = twai_receive(&rx_frame, QUEUE_OP_TIMEOUT_CAN_RX);
 
     switch (cret) {
 
@@ -656,11 +768,19 @@ void CAN_task(void *params) {
       case ESP_OK:
         // VLOG("CAN_task: local CAN frame received, %s", format_CAN_frame(&rx_frame));
 
+        busload_frame(&rx_frame);
+
+        // frames that got past the acceptance filter but which nothing wants
+        if (!can_filter_account(&rx_frame)) {
+          ++stats.can_rx;
+          break;
+        }
+
         // capture CANID and DCC session data from outgoing messages from cab
         if (config_data.role == ROLE_SLAVE) {
 
           if (slave_canid != (rx_frame.identifier & 0x7f)) {
-            VLOG("CAN_task: satellite CANID changed");
+            LOGI(LOG_MOD_CAN, "CAN_task: satellite CANID changed");
             slave_canid = rx_frame.identifier & 0x7f;
             got_slave_canid = false;
           }
@@ -679,32 +799,31 @@ void CAN_task(void *params) {
             case OPC_PCON:
               // etc ??
               CANCMD_session_num = rx_frame.data[1];
-              VLOG("CAN_task: satellite, CANCMD session = %d", CANCMD_session_num);
+              LOGD(LOG_MOD_CAN, "CAN_task: satellite, CANCMD session = %d", CANCMD_session_num);
               break;
 
             case OPC_KLOC:
               CANCMD_session_num = -1;
-              LOG("CAN_task: satellite, CANCMD session num cleared");
+              LOGD(LOG_MOD_CAN, "CAN_task: satellite, CANCMD session num cleared");
               break;
           }
+
+          // the master keeps the session alive on the layout, so DKEEPs from the cab need not cross the network
+          if (keepalive_local_frame(&rx_frame)) {
+            PULSE_LED(CAN_ACT_LED);
+            ++stats.can_rx;
+            break;
+          }
         }
 
         // all nodes forward the frame to net output queue for onward transmission to peer(s)
-        if (!send_message_to_queues(QUEUE_NET_OUT, &rx_frame, "CAN_task", QUEUE_OP_TIMEOUT_SHORT)) {
-          LOG("CAN_task: error queuing message");
+        // master also forwards incoming CAN message to other task queues
+        // a single call means the frame is copied into the frame pool only once
+        if (!send_message_to_queues(can_rx_queues(), &rx_frame, "CAN_task", QUEUE_OP_TIMEOUT_SHORT)) {
+          LOGE(LOG_MOD_CAN, "CAN_task: error queuing message");
           PULSE_LED(ERR_IND_LED);
         }
 
-        // master forwards incoming CAN message to other task queues
-        if (config_data.role == ROLE_MASTER) {
-          uint16_t queues = QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL;
-
-          if (!send_message_to_queues(queues, &rx_frame, "CAN_task", QUEUE_OP_TIMEOUT_SHORT)) {
-            LOG("CAN_task: error queuing message");
-            PULSE_LED(ERR_IND_LED);
-          }
-        }
-
         // pulse the activity LED
         PULSE_LED(CAN_ACT_LED);
 
@@ -713,185 +832,23 @@ void CAN_task(void *params) {
         break;
 
       default:
-        LOG("CAN_task: error receiving frame from local bus");
+        LOGE(LOG_MOD_CAN, "CAN_task: error receiving frame from local bus");
         log_esp_now_err(cret);
         PULSE_LED(ERR_IND_LED);
+        vTaskDelay(QUEUE_OP_TIMEOUT);      // the driver may be stopped, don't spin
         break;
 
     }   // switch can receive result
 
     //
-    /// process the output queues, for messages to be sent to the local CAN bus
-    ///
-
-    //
-    /// get the next outgoing frame from the ESP-NOW receive callback and other tasks
-    //
-
-    if (xQueueReceive(CAN_out_from_net_queue, &tx_frame, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
-      // VLOG("CAN_task: received frame from net output queue: %s", format_CAN_frame(&tx_frame));
-
-      // forward frame to local CAN bus
-      cret = twai_transmit(&tx_frame, QUEUE_OP_TIMEOUT);
-
-      if (cret == ESP_OK) {
-        // VLOG("CAN_task: forwarded frame to local CAN bus, ret = %d, %s", cret, format_CAN_frame(&tx_frame));
-        PULSE_LED(CAN_ACT_LED);
-        ++stats.can_tx;
-      } else {
-        LOG("CAN_task: error writing CAN frame fron net task to driver queue");
-        log_esp_now_err(cret);
-        PULSE_LED(ERR_IND_LED);
-        ++errors.can_tx;
-      }
-    }
-
-    //
-    /// get next outgoing CAN frame from GC task
-    //
-
-    if (config_data.role == ROLE_MASTER && config_data.gc_server_on) {
-      if (xQueueReceive(CAN_out_from_GC_queue, &tx_frame, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
-        // LOG("CAN_task: output frame received from GC task");
-
-        // forward frame to local CAN bus
-        cret = twai_transmit(&tx_frame, QUEUE_OP_TIMEOUT);
-
-        if (cret == ESP_OK) {
-          // VLOG("CAN_task: forwarded frame to local CAN bus, ret = %d, %s", cret, format_CAN_frame(&tx_frame));
-          // VLOG("CAN_task: source CANID = %d", tx_frame.identifier & 0x7);
-          PULSE_LED(CAN_ACT_LED);
-          ++stats.can_tx;
-        } else {
-          LOG("CAN_task: error writing CAN frame from GC task to driver queue");
-          log_esp_now_err(cret);
-          PULSE_LED(ERR_IND_LED);
-          ++errors.can_tx;
-        }
-      }
-    }
-
-    //
-    /// get next outgoing CAN frame from withrottle task
-    //
-
-    if (config_data.role == ROLE_MASTER && config_data.withrottle_on) {
-      if (xQueueReceive(CAN_out_from_withrottle_queue, &tx_frame, QUEUE_OP_TIMEOUT_NONE) == pdTRUE) {
-        // LOG("CAN_task: output frame received from withrottle task");
-
-        // forward frame to local CAN bus
-        cret = twai_transmit(&tx_frame, QUEUE_OP_TIMEOUT);
-
-        if (cret == ESP_OK) {
-          // VLOG("CAN_task: forwarded frame to CAN driver queue, ret = %d, %s", cret, format_CAN_frame(&tx_frame));
-          PULSE_LED(CAN_ACT_LED);
-          ++stats.can_tx;
-        } else {
-          LOG("CAN_task: error writing CAN frame from withrottle task to driver queue");
-          log_esp_now_err(cret);
-          PULSE_LED(ERR_IND_LED);
-          ++errors.can_tx;
-        }
-      }
-    }
-
-    //
-    /// read CAN driver alerts and display any error
+    /// reprogram the acceptance filter if the frames wanted have changed
     //
 
-    uint32_t can_alerts;
-    static uint32_t prev_can_alerts = 0;
-    esp_err_t ret;
-
-    if (millis() - stimer % 250) {
-
-      ret  = twai_read_alerts(&can_alerts, QUEUE_OP_TIMEOUT_SHORT);
-
-      if (ret == ESP_OK) {
-
-        if (can_alerts != prev_can_alerts) {
-          if ((can_alerts == 3 && prev_can_alerts == 2) || (can_alerts == 2 && prev_can_alerts == 3)) {
-            // reduce the noise
-          } else {
-            VLOG("CAN_task: CAN alert status has changed, from %d to %d", prev_can_alerts, can_alerts);
-            prev_can_alerts = can_alerts;
-
-            if (can_alerts & TWAI_ALERT_TX_IDLE) {
-              LOG("CAN_task: TWAI_ALERT_TX_IDLE");
-            }
-
-            if (can_alerts && TWAI_ALERT_BELOW_ERR_WARN) {
-              LOG("CAN_task: TWAI_ALERT_BELOW_ERR_WARN");
-            }
-
-            if (can_alerts & TWAI_ALERT_TX_SUCCESS) {
-              LOG("CAN_task: TWAI_ALERT_TX_SUCCESS");
-            }
-
-            if (can_alerts & TWAI_ALERT_ERR_ACTIVE) {
-              LOG("CAN_task: TWAI_ALERT_ERR_ACTIVE");
-            }
-
-            if (can_alerts & TWAI_ALERT_RECOVERY_IN_PROGRESS) {
-              LOG("CAN_task: TWAI_ALERT_RECOVERY_IN_PROGRESS");
-            }
-
-            if (can_alerts & TWAI_ALERT_BUS_RECOVERED) {
-              LOG("CAN_task: TWAI_ALERT_BUS_RECOVERED");
-            }
-
-            if (can_alerts & TWAI_ALERT_ARB_LOST) {
-              LOG("CAN_task: TWAI_ALERT_ARB_LOST");
-            }
-
-            if (can_alerts & TWAI_ALERT_ABOVE_ERR_WARN) {
-              LOG("CAN_task: TWAI_ALERT_ABOVE_ERR_WARN");
-            }
-
-            if (can_alerts & TWAI_ALERT_BUS_ERROR) {
-              LOG("CAN_task: TWAI_ALERT_BUS_ERROR");
-            }
-
-            if (can_alerts & TWAI_ALERT_TX_FAILED) {
-              LOG("CAN_task: TWAI_ALERT_TX_FAILED");
-            }
-
-            if (can_alerts & TWAI_ALERT_RX_QUEUE_FULL) {
-              LOG("CAN_task: TWAI_ALERT_RX_QUEUE_FULL");
-            }
-
-            if (can_alerts & TWAI_ALERT_ERR_PASS) {
-              LOG("CAN_task: TWAI_ALERT_ERR_PASS");
-            }
-
-            if (can_alerts & TWAI_ALERT_BUS_OFF) {
-              LOG("CAN_task: TWAI_ALERT_BUS_OFF, initiating recovery");
-              ret = twai_initiate_recovery();
-              VLOG("CAN_task: bus recovery returns %d", ret);
-              log_esp_now_err(ret);
-            }
-          }
-        }
-
-        /// blink error LED on CAN error states
-
-        /*
-          led_command_t cmd;
-
-          if ((can_alerts & TWAI_ALERT_BUS_ERROR) || (can_alerts & TWAI_ALERT_TX_FAILED) || (can_alerts & TWAI_ALERT_ARB_LOST)) {
-          cmd = { ERR_IND_LED, LED_BLINK, 0 };
-          } else {
-          cmd = { ERR_IND_LED, LED_OFF, 0 };
-          }
-
-          xQueueSend(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT);
-        */
-
-      }
-    }
+    can_filter_poll();
 
     //
     /// periodically display CAN state and stats
+    /// driver alerts are handled by CAN_alert_task
     //
 
     if (millis() - stimer >= 1000) {
@@ -899,19 +856,22 @@ void CAN_task(void *params) {
       twai_status_info_t can_status;
       twai_get_status_info(&can_status);
       led_command_t cmd;
+      esp_err_t ret;
       static int scount = 1;
 
       if (scount == 10) {      // every 10 secs
-        VLOG("CAN_task: [%d] %s, txq = %d, rxq = %d, tec = %d, rec = %d, tx fail = %d, rx drop = %d, lost arb = %d, bus error = %d, alert = %d", \
+        LOGI(LOG_MOD_CAN, "CAN_task: [%d] %s, txq = %d, rxq = %d, tec = %d, rec = %d, tx fail = %d, rx drop = %d, lost arb = %d, bus error = %d, alert = %d", \
              config_data.CANID, can_status_desc[can_status.state].desc, can_status.msgs_to_tx, can_status.msgs_to_rx, can_status.tx_error_counter, \
-             can_status.rx_error_counter, can_status.tx_failed_count, can_status.rx_missed_count, can_status.arb_lost_count, can_status.bus_error_count, can_alerts);
+             can_status.rx_error_counter, can_status.tx_failed_count, can_status.rx_missed_count, can_status.arb_lost_count, can_status.bus_error_count, can_alert_stats.last);
+        LOGI(LOG_MOD_CAN, "CAN_task: bus load, 1s = %u.%u%%, 10s = %u.%u%%, 60s = %u.%u%%", busload_pct10(1) / 10, busload_pct10(1) % 10, \
+             busload_pct10(10) / 10, busload_pct10(10) % 10, busload_pct10(60) / 10, busload_pct10(60) % 10);
         scount = 1;
       } else {
         ++scount;
       }
 
       //
-      /// attempt driver restart
+      /// attempt driver restart, if the alert task has not already done so after bus recovery
       //
 
       if (can_status.state == TWAI_STATE_STOPPED) {
@@ -925,9 +885,9 @@ void CAN_task(void *params) {
         } else {
           cmd = { ERR_IND_LED, LED_FAST_BLINK, 0 };
         }
-      }
 
-      xQueueSend(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT);
+        xQueueSend(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT);
+      }
       stimer = millis();
     }
 
@@ -935,51 +895,712 @@ void CAN_task(void *params) {
 }
 
 //
-/// task to send messages to connected ESP-NOW peers
-/// also sends heartbeat and password messages
+/// task to send frames to the local CAN bus
+/// blocks on a queue set of the CAN output queues, so a frame is passed to the driver as soon as it is queued
+/// frames from all sources are merged by the transmit scheduler, in CBUS priority order, with fairness between sources
+/// only a few frames are allowed in the driver transmit queue at a time, so that a later high priority frame
+/// does not wait behind a backlog of lower priority frames already handed to the driver
 //
 
-void net_send_task(void *params) {
+void CAN_tx_task(void *params) {
 
-  unsigned long ptimer = 0UL, heartbeat_timer = 0UL;
-  char hbdata[sizeof(twai_message_t)] = {'H', 'B'};
-  char pwdata[sizeof(twai_message_t)] = {'P', 'W'};
-  twai_message_t frame;
-  wrapped_frame_t wframe;
-  esp_now_peer_num_t peer_num;
+  QueueSetHandle_t tx_queue_set;
+  QueueSetMemberHandle_t active_queue;
+  twai_message_t *tx_frame;
+  twai_status_info_t can_status;
+  frame_handle_t fh;
+  esp_err_t cret;
+  byte source;
+  unsigned long stimer = millis();
+  static const char *source_names[TX_SRC_NUM] = { "net", "GC", "withrottle" };
 
-  LOG("net_send_task: task starting");
+  LOG("CAN_tx_task: task starting");
 
-  // init peers table
-  peer_record_op(NULL, PEER_INIT_ALL);
+  tx_sched_init();
 
-  // network password message
-  memcpy((void *)&pwdata[2], config_data.network_password, strlen(config_data.network_password));
+  // queues must be empty when added to the set, so we add them before subscribing
+  tx_queue_set = xQueueCreateSet(CAN_TX_QUEUE_SET_SIZE);
+  xQueueAddToSet(CAN_out_from_net_queue, tx_queue_set);
+  router_subscribe(QUEUE_CAN_OUT_FROM_NET, NULL, 0, ROUTE_FRAME_ALL, NULL);
 
-  //
-  /// main loop
-  //
+  if (config_data.role == ROLE_MASTER && config_data.gc_server_on) {
+    xQueueAddToSet(CAN_out_from_GC_queue, tx_queue_set);
+    router_subscribe(QUEUE_CAN_OUT_FROM_GC, NULL, 0, ROUTE_FRAME_ALL, NULL);
+  }
+
+  if (config_data.role == ROLE_MASTER && config_data.withrottle_on) {
+    xQueueAddToSet(CAN_out_from_withrottle_queue, tx_queue_set);
+    router_subscribe(QUEUE_CAN_OUT_FROM_WI, NULL, 0, ROUTE_FRAME_ALL, NULL);
+  }
 
   for (;;) {
 
     //
-    /// master sends a regular heartbeat message to all slaves
-    /// slaves send just initial message to introduce themselves to the master, repeated until the first message is received
+    /// move all waiting frames from the net_rx task, GC and withrottle tasks into the scheduler
+    /// we block only if the scheduler is empty; otherwise we wait briefly for the driver to make progress
     //
 
-    if (millis() - heartbeat_timer >= HBFREQ) {
-      heartbeat_timer = millis();
+    TickType_t wait = (tx_sched_pending() == 0) ? QUEUE_OP_TIMEOUT_INFINITE : (TickType_t)1;
 
-      if (config_data.role == ROLE_SLAVE) {
+    while ((active_queue = xQueueSelectFromSet(tx_queue_set, wait)) != NULL) {
+      wait = QUEUE_OP_TIMEOUT_NONE;
 
-        // need to restablish contact with master if not heard from recently
-        // we may have moved out of range and been unpaired by the master
-        // or the master may have restarted
+      if (xQueueReceive(active_queue, &fh, QUEUE_OP_TIMEOUT_NONE) == pdTRUE) {
+        source = (active_queue == CAN_out_from_net_queue) ? TX_SRC_NET : (active_queue == CAN_out_from_GC_queue) ? TX_SRC_GC : TX_SRC_WI;
+        tx_sched_put(fh, source);
+      }
+    }
 
-        if (slave_received_first_message && (millis() - slave_last_net_msg_received_time > 10000)) {
-          LOG("net_send_task: satellite: no contact from master for 10 secs");
-          slave_received_first_message = false;
-        }
+    //
+    /// pass frames to the driver in priority order, up to the in-flight limit
+    /// frames are dropped while the bus isn't running, or if they have waited too long, so they don't fill the frame pool
+    //
+
+    can_driver_lock();
+    twai_get_status_info(&can_status);
+
+    if (can_status.state != TWAI_STATE_RUNNING) {
+      tx_sched_flush();
+    } else {
+      tx_sched_expire();
+    }
+
+    while (can_status.msgs_to_tx < CAN_TX_MAX_IN_FLIGHT && (fh = tx_sched_get(&source)) != FRAME_HANDLE_NONE) {
+
+      tx_frame = frame_pool_get(fh);
+      // VLOG("CAN_tx_task: sending frame from %s, priority = %d, %s", source_names[source], tx_sched_priority(tx_frame), format_CAN_frame(tx_frame));
+
+      // forward frame to local CAN bus
+      cret = twai_transmit(tx_frame, QUEUE_OP_TIMEOUT);
+
+      if (cret == ESP_OK) {
+        // VLOG("CAN_tx_task: forwarded frame to local CAN bus, ret = %d, %s", cret, format_CAN_frame(tx_frame));
+        PULSE_LED(CAN_ACT_LED);
+        ++stats.can_tx;
+        ++can_status.msgs_to_tx;
+        busload_frame(tx_frame);
+
+#if LATENCY_BENCHMARK
+        latency_record(LAT_NET_TO_CAN + source, frame_pool_age(fh));
+#endif
+
+      } else {
+        LOGE(LOG_MOD_CAN, "CAN_tx_task: error writing CAN frame from %s to driver queue", source_names[source]);
+        log_esp_now_err(cret);
+        PULSE_LED(ERR_IND_LED);
+        ++errors.can_tx;
+      }
+
+      frame_pool_release(fh);
+    }
+
+    can_driver_unlock();
+
+    //
+    /// periodically log per-priority queueing delay
+    //
+
+    if (millis() - stimer >= 10000UL) {
+      stimer = millis();
+
+      for (byte p = 0; p < TX_SCHED_NUM_PRIORITIES; p++) {
+        if (tx_sched_stats[p].frames > 0) {
+          LOGI(LOG_MOD_CAN, "CAN_tx_task: priority %2d, frames = %lu, avg delay = %lu us, max delay = %lu us", p, tx_sched_stats[p].frames, \
+               tx_sched_stats[p].total_us / tx_sched_stats[p].frames, tx_sched_stats[p].max_us);
+        }
+      }
+
+      if (tx_sched_drops.full + tx_sched_drops.expired + tx_sched_drops.bus_down > 0) {
+        LOGW(LOG_MOD_CAN, "CAN_tx_task: frames dropped, source full = %lu, too old = %lu, bus not running = %lu", tx_sched_drops.full, \
+             tx_sched_drops.expired, tx_sched_drops.bus_down);
+      }
+    }
+
+  }  // for (;;)
+}
+
+//
+/// router enable predicates for the network output queues
+//
+
+bool net_out_enabled(void) {
+  return (num_peers > 0);
+}
+
+bool net_to_net_enabled(void) {
+  return (num_peers > 1);
+}
+
+//
+/// returns true if a message on the net output queue is a CAN frame, rather than a control message
+/// control messages start with a message type byte, which is never a valid set of frame flags
+//
+
+bool net_msg_is_frame(const twai_message_t *msg) {
+  return ((msg->flags & ~NET_FRAME_FLAGS_MASK) == 0 && msg->data_length_code <= 8);
+}
+
+//
+/// send a packet to the network
+/// a slave sends to the master; the master sends to all currently paired peers
+//
+
+bool net_send_packet(const uint8_t *data, size_t len) {
+
+  esp_err_t result;
+  uint8_t macs[MAX_NET_PEERS][6];
+  byte n;
+  bool ok = true;
+
+  if (config_data.role == ROLE_SLAVE) {
+    result = esp_now_send(mac_master, data, len);
+
+    if (result != ESP_OK) {
+      LOGE(LOG_MOD_NET, "net_send_task: error sending to master, err = %d", result);
+      log_esp_now_err(result);
+      PULSE_LED(ERR_IND_LED);
+      return false;
+    }
+  } else {
+
+    // send to each of the currently paired peers, from the cached peer list
+    // we don't use the NULL MAC address, as the ESP-NOW peer list may also contain the broadcast address
+    // we don't retry as there may be multiple slaves and we don't want to send duplicate messages
+    n = peer_list_copy(macs);
+
+    if (n == 0) {
+      return false;
+    }
+
+    for (byte i = 0; i < n; i++) {
+      result = esp_now_send(macs[i], data, len);
+
+      if (result != ESP_OK) {
+        LOGE(LOG_MOD_NET, "net_send_task: master: error sending to network peer %s, err = %d", mac_to_char(macs[i]), result);
+        log_esp_now_err(result);
+        ok = false;
+      }
+    }
+
+    if (!ok) {
+      PULSE_LED(ERR_IND_LED);
+      return false;
+    }
+
+    peer_record_op(NULL, PEER_INCR_TX_ALL);
+  }
+
+  PULSE_LED(NET_ACT_LED);
+  ++net_batch_stats.packets_tx;
+  return true;
+}
+
+//
+/// returns true if the receiving node(s) understand the given wire format version
+/// the master sends each packet to all peers, so all must support it
+//
+
+bool net_peers_support(byte version) {
+
+  bool found = false;
+
+  if (config_data.role == ROLE_SLAVE) {
+    return (master_wire_version >= version);
+  }
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    if (peers[i].mac_addr[0] != 0) {
+      if (peers[i].wire_version < version) {
+        return false;
+      }
+
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+//
+/// the peers a packet is sent to, as a bitmap of peer table indexes
+/// a slave has only one peer, the master, which uses index 0
+//
+
+uint32_t net_peer_mask(void) {
+
+  uint32_t mask = 0;
+
+  if (config_data.role == ROLE_SLAVE) {
+    return 1;
+  }
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    if (peers[i].mac_addr[0] != 0) {
+      mask |= (1UL << i);
+    }
+  }
+
+  return mask;
+}
+
+//
+/// send a typed control message
+/// if a receiving node has older firmware, the message is translated to the original format
+//
+
+bool net_send_control(const uint8_t *msg) {
+
+  char legacy[2][sizeof(twai_message_t)];
+  byte n;
+  bool ret = true;
+
+  net_msg_count_tx(msg[0]);
+
+  if (net_peers_support(NET_WIRE_VERSION_TYPED)) {
+    return net_send_packet(msg, net_msg_len(msg));
+  }
+
+  n = net_msg_to_legacy(msg, legacy);
+
+  for (byte i = 0; i < n; i++) {
+    ret &= net_send_packet((const uint8_t *)legacy[i], sizeof(twai_message_t));
+  }
+
+  return ret;
+}
+
+//
+/// send the collected packet and release the frames it contains
+/// a single frame is sent as a CAN message, more than one as a CAN batch message
+/// if any frame needs reliable delivery, the packet is sent with a sequence number and held until acknowledged
+/// the packet buffer has room for the sequence header
+//
+
+void net_flush_batch(byte *packet, size_t len, frame_handle_t handles[], byte num_frames, bool reliable) {
+
+  bool sent;
+
+  if (num_frames == 0) {
+    return;
+  }
+
+  if (split_enabled()) {
+    net_send_split(handles, num_frames);
+  } else {
+
+    if (num_frames == 1 && net_peers_support(NET_WIRE_VERSION_TYPED)) {
+      packet[0] = NET_MSG_CAN;
+    }
+
+    // a reliable packet is counted as such by net_rel_send
+    if (reliable && net_peers_support(NET_WIRE_VERSION_RELIABLE)) {
+      uint32_t wanted = net_peer_mask();
+      uint32_t accepted = net_rel_send(packet, len, wanted);
+      len += NET_REL_HDR_LEN;
+      sent = (accepted != 0);
+
+      if (accepted == wanted) {
+        peer_record_op(NULL, PEER_INCR_TX_ALL);
+      } else {
+        portENTER_CRITICAL(&peer_mux);
+
+        for (byte p = 0; p < MAX_NET_PEERS; p++) {
+          if ((accepted & (1UL << p)) && peers[p].mac_addr[0] != 0) {
+            __atomic_add_fetch(&peers[p].tx, 1, __ATOMIC_RELAXED);
+          }
+        }
+
+        portEXIT_CRITICAL(&peer_mux);
+      }
+
+      if (sent) {
+        PULSE_LED(NET_ACT_LED);
+        ++net_batch_stats.packets_tx;
+      }
+    } else {
+      net_msg_count_tx(packet[0]);
+      sent = net_send_packet(packet, len);
+    }
+
+    if (sent) {
+      boot_mark(BOOT_FIRST_FRAME);
+      net_batch_stats.frames_tx += num_frames;
+      net_batch_stats.wire_bytes_tx += len;
+
+      if (num_frames > 1) {
+        ++net_batch_stats.batches_tx;
+      }
+    }
+  }
+
+  for (byte i = 0; i < num_frames; i++) {
+#if LATENCY_BENCHMARK
+    latency_record(LAT_NET_OUT, frame_pool_age(handles[i]));
+#endif
+    frame_pool_release(handles[i]);
+  }
+
+  return;
+}
+
+//
+/// split bus mode: send each slave just the frames it can act on
+/// a packet is built for each slave from the frames collected, and unicast to it
+/// a slave with older firmware is sent each of its frames on its own, in the original format
+//
+
+void net_send_split(frame_handle_t handles[], byte num_frames) {
+
+  byte packet[ESP_NOW_MAX_DATA_LEN];
+  uint32_t masks[NET_BATCH_MAX_FRAMES];
+  twai_message_t *frame;
+  size_t len;
+  byte n, version;
+  bool reliable, sent;
+  esp_err_t result;
+
+  for (byte i = 0; i < num_frames; i++) {
+    masks[i] = split_peer_mask(frame_pool_get(handles[i]));
+  }
+
+  for (byte p = 0; p < MAX_NET_PEERS; p++) {
+
+    if (peers[p].mac_addr[0] == 0) {
+      continue;
+    }
+
+    version = peers[p].wire_version;
+    packet[0] = NET_MSG_CAN_BATCH;
+    len = 1;
+    n = 0;
+    reliable = false;
+
+    for (byte i = 0; i < num_frames; i++) {
+
+      if (!(masks[i] & (1UL << p))) {
+        ++net_batch_stats.split_filtered;
+        continue;
+      }
+
+      frame = frame_pool_get(handles[i]);
+
+      if (version < NET_WIRE_VERSION_COMPACT) {
+        net_msg_count_tx(NET_MSG_LEGACY_CAN);
+        result = esp_now_send(peers[p].mac_addr, (const uint8_t *)frame, sizeof(twai_message_t));
+
+        if (result == ESP_OK) {
+          ++net_batch_stats.packets_tx;
+          ++net_batch_stats.frames_tx;
+          net_batch_stats.wire_bytes_tx += sizeof(twai_message_t);
+          peer_record_op(peers[p].mac_addr, PEER_INCR_TX);
+        } else {
+          log_esp_now_err(result);
+        }
+
+        continue;
+      }
+
+      len += net_encode_frame(frame, &packet[len]);
+      reliable |= net_rel_needed(frame);
+      ++n;
+    }
+
+    if (n == 0) {
+      continue;
+    }
+
+    if (n == 1 && version >= NET_WIRE_VERSION_TYPED) {
+      packet[0] = NET_MSG_CAN;
+    }
+
+    // a reliable packet is counted as such by net_rel_send
+    if (reliable && version >= NET_WIRE_VERSION_RELIABLE) {
+      sent = (net_rel_send(packet, len, 1UL << p) != 0);
+      len += NET_REL_HDR_LEN;
+    } else {
+      net_msg_count_tx(packet[0]);
+      result = esp_now_send(peers[p].mac_addr, packet, len);
+      sent = (result == ESP_OK);
+
+      if (!sent) {
+        LOGE(LOG_MOD_NET, "net_send_task: master: error sending to network peer %s, err = %d", mac_to_char(peers[p].mac_addr), result);
+        log_esp_now_err(result);
+      }
+    }
+
+    if (sent) {
+      ++net_batch_stats.packets_tx;
+      net_batch_stats.frames_tx += n;
+      net_batch_stats.wire_bytes_tx += len;
+      peer_record_op(peers[p].mac_addr, PEER_INCR_TX);
+
+      if (n > 1) {
+        ++net_batch_stats.batches_tx;
+      }
+
+      PULSE_LED(NET_ACT_LED);
+    } else {
+      PULSE_LED(ERR_IND_LED);
+    }
+  }
+
+  return;
+}
+
+//
+/// coalesce the given frame and any others waiting on the net output queue into a single compact packet
+/// the packet is sent when it is full, or when no more frames have arrived within the batch deadline
+/// control messages are never batched; any frames collected so far are sent first, to preserve message order
+/// if a receiving node has older firmware, each frame is sent on its own in the original format
+//
+
+void net_send_batch(frame_handle_t fh) {
+
+  byte packet[ESP_NOW_MAX_DATA_LEN];
+  size_t len = 1;
+  frame_handle_t handles[NET_BATCH_MAX_FRAMES];
+  byte num_frames = 0;
+  bool reliable = false;
+  unsigned long start = micros();
+  twai_message_t *msg = frame_pool_get(fh);
+
+  if (!net_msg_is_frame(msg)) {
+    net_send_control((const uint8_t *)msg);
+    frame_pool_release(fh);
+    return;
+  }
+
+  if (!split_enabled() && !net_peers_support(NET_WIRE_VERSION_COMPACT)) {
+    net_msg_count_tx(NET_MSG_LEGACY_CAN);
+
+    if (net_send_packet((const uint8_t *)msg, sizeof(twai_message_t))) {
+      ++net_batch_stats.frames_tx;
+      net_batch_stats.wire_bytes_tx += sizeof(twai_message_t);
+    }
+
+#if LATENCY_BENCHMARK
+    latency_record(LAT_NET_OUT, frame_pool_age(fh));
+#endif
+    frame_pool_release(fh);
+    return;
+  }
+
+  packet[0] = NET_MSG_CAN_BATCH;
+
+  for (;;) {
+
+    msg = frame_pool_get(fh);
+
+    if (net_msg_is_frame(msg)) {
+      len += net_encode_frame(msg, &packet[len]);
+      handles[num_frames++] = fh;
+      reliable |= net_rel_needed(msg);
+
+      // leave room for the reliable delivery header
+      if (len + NET_COMPACT_MAX_FRAME_LEN + NET_REL_HDR_LEN > ESP_NOW_MAX_DATA_LEN || num_frames == NET_BATCH_MAX_FRAMES) {
+        break;
+      }
+    } else {
+      net_flush_batch(packet, len, handles, num_frames, reliable);
+      packet[0] = NET_MSG_CAN_BATCH;
+      len = 1;
+      num_frames = 0;
+      reliable = false;
+      net_send_control((const uint8_t *)msg);
+      frame_pool_release(fh);
+    }
+
+    // get the next waiting message, blocking on the queue until the deadline if a batch has been started
+    // the wait is in whole ticks, so other tasks on this core can run; a frame arriving ends it at once
+    while (xQueueReceive(net_out_queue, &fh, QUEUE_OP_TIMEOUT_NONE) != pdTRUE) {
+      unsigned long elapsed = micros() - start;
+
+      if (num_frames == 0 || elapsed >= NET_BATCH_DEADLINE_US) {
+        fh = FRAME_HANDLE_NONE;
+        break;
+      }
+
+      TickType_t ticks = (NET_BATCH_DEADLINE_US - elapsed + (portTICK_PERIOD_MS * 1000UL) - 1) / (portTICK_PERIOD_MS * 1000UL);
+
+      if (xQueueReceive(net_out_queue, &fh, ticks) == pdTRUE) {
+        break;
+      }
+    }
+
+    if (fh == FRAME_HANDLE_NONE) {
+      break;
+    }
+  }
+
+  net_flush_batch(packet, len, handles, num_frames, reliable);
+  return;
+}
+
+//
+/// master reflects a frame received from one slave to all the other slaves
+/// if all slaves understand it, the frame is sent once as a broadcast, tagged with the MAC address of the originating slave
+/// which discards it on receipt; this takes one airtime slot rather than one per slave, but broadcasts are not acknowledged
+/// otherwise, the frame is sent to each slave except the originator, using the cached peer list
+/// in split bus mode, the frame is sent only to the slaves that can act on it
+//
+
+void net_reflect_frame(wrapped_frame_t *wframe) {
+
+  uint8_t macs[MAX_NET_PEERS][6];
+  byte packet[NET_MSG_REFLECT_HDR_LEN + NET_COMPACT_MAX_FRAME_LEN];
+  const uint8_t *data;
+  size_t len;
+  byte n, type;
+  uint32_t mask = 0;
+  int idx;
+  bool split = split_enabled();
+  esp_err_t result;
+
+  if (split) {
+    mask = split_peer_mask(&wframe->frame);
+  }
+
+#if NET_REFLECT_BROADCAST
+  if (!split && net_peers_support(NET_WIRE_VERSION_REFLECT)) {
+    packet[0] = NET_MSG_CAN_REFLECT;
+    memcpy(&packet[1], wframe->mac_addr, sizeof(uint8_t[6]));
+    len = NET_MSG_REFLECT_HDR_LEN + net_encode_frame(&wframe->frame, &packet[NET_MSG_REFLECT_HDR_LEN]);
+    net_msg_count_tx(NET_MSG_CAN_REFLECT);
+
+    result = esp_now_send(net_broadcast_mac, packet, len);
+
+    if (result == ESP_OK) {
+      ++net_batch_stats.reflect_broadcast;
+      PULSE_LED(NET_ACT_LED);
+    } else {
+      LOGE(LOG_MOD_NET, "net_send_task: master: error broadcasting frame from net-to-net queue, err = %d", result);
+      log_esp_now_err(result);
+      PULSE_LED(ERR_IND_LED);
+    }
+
+    return;
+  }
+#endif
+
+  // older slaves understand only the original format
+  if (net_peers_support(NET_WIRE_VERSION_TYPED)) {
+    type = NET_MSG_CAN;
+    packet[0] = type;
+    len = 1 + net_encode_frame(&wframe->frame, &packet[1]);
+    data = packet;
+  } else {
+    type = NET_MSG_LEGACY_CAN;
+    len = sizeof(twai_message_t);
+    data = (const uint8_t *)&wframe->frame;
+  }
+
+  n = peer_list_copy(macs);
+
+  for (byte i = 0; i < n; i++) {
+    if (memcmp(macs[i], wframe->mac_addr, sizeof(uint8_t[6])) == 0) {
+      continue;
+    }
+
+    if (split && ((idx = peer_find(macs[i])) < 0 || !(mask & (1UL << idx)))) {
+      ++net_batch_stats.split_filtered;
+      continue;
+    }
+
+    net_msg_count_tx(type);
+    result = esp_now_send(macs[i], data, len);
+
+    if (result == ESP_OK) {
+      // VLOG("net_send_task: master: sent frame from net-to-net queue to network peer, MAC = %s", mac_to_char(macs[i]));
+      ++net_batch_stats.reflect_unicast;
+      PULSE_LED(NET_ACT_LED);
+    } else {
+      LOGE(LOG_MOD_NET, "net_send_task: master: error sending frame from net-to-net queue to network peer %s, err = %d", mac_to_char(macs[i]), result);
+      log_esp_now_err(result);
+      PULSE_LED(ERR_IND_LED);
+    }
+  }
+
+  return;
+}
+
+//
+/// task to send messages to connected ESP-NOW peers
+/// also sends heartbeat and password messages
+//
+
+void net_send_task(void *params) {
+
+  unsigned long ptimer = 0UL, heartbeat_timer = 0UL;
+  uint8_t hbdata[NET_MSG_HEARTBEAT_LEN] = { NET_MSG_HEARTBEAT, NET_WIRE_VERSION };
+  uint8_t pwdata[NET_MSG_JOIN_LEN] = { NET_MSG_JOIN, NET_WIRE_VERSION };
+  frame_handle_t fh;
+  wrapped_frame_t wframe;
+
+  LOG("net_send_task: task starting");
+
+  // init peers table
+  peer_record_op(NULL, PEER_INIT_ALL);
+
+  // subscribe to messages for onward transmission to peers
+  // in split bus mode, slaves are only sent standard frames with a payload
+  router_subscribe(QUEUE_NET_OUT, NULL, 0, split_enabled() ? ROUTE_FRAME_STD : ROUTE_FRAME_ALL, net_out_enabled);
+
+  if (config_data.role == ROLE_MASTER) {
+    router_subscribe(QUEUE_NET_TO_NET, NULL, 0, ROUTE_FRAME_ALL, net_to_net_enabled);
+
+#if NET_REFLECT_BROADCAST
+    // the broadcast address must be registered as a peer before we can send to it
+    // it takes one of ESP-NOW's peer slots, so MAX_NET_PEERS leaves one free for it
+    esp_now_peer_info_t bcast;
+    bzero(&bcast, sizeof(esp_now_peer_info_t));
+    memcpy(bcast.peer_addr, net_broadcast_mac, sizeof(uint8_t[6]));
+    bcast.ifidx = WIFI_IF_AP;
+    bcast.channel = channel;
+    bcast.encrypt = false;
+
+    esp_err_t ret = esp_now_add_peer(&bcast);
+
+    if (ret != ESP_OK) {
+      VLOG("net_send_task: master: error registering broadcast peer, err = %d", ret);
+      log_esp_now_err(ret);
+    }
+#endif
+  }
+
+  // network password message
+  // heartbeat and password messages also advertise our wire format version
+  memcpy((void *)&pwdata[2], config_data.network_password, strnlen(config_data.network_password, NET_PASSWORD_LEN));
+
+  //
+  /// main loop
+  //
+
+  for (;;) {
+
+    //
+    /// master sends a regular heartbeat message to all slaves
+    /// slaves send just initial message to introduce themselves to the master, repeated until the first message is received
+    //
+
+    if (millis() - heartbeat_timer >= HBFREQ) {
+      heartbeat_timer = millis();
+
+      if (config_data.role == ROLE_SLAVE) {
+
+        // need to restablish contact with master if not heard from recently
+        // we may have moved out of range and been unpaired by the master
+        // or the master may have restarted
+
+        if (slave_received_first_message && (millis() - slave_last_net_msg_received_time > 10000)) {
+          LOG("net_send_task: satellite: no contact from master for 10 secs");
+          slave_received_first_message = false;
+        }
+
+        // remember the master once it has responded, or if a remembered master has not, look for it again
+        if (master_found_and_paired && !rejoin_check(mac_master, channel, slave_received_first_message)) {
+          esp_now_del_peer(mac_master);
+          master_found_and_paired = false;
+        }
 
         // slaves need to find and pair the MAC address of the master for the configured network
         if (!master_found_and_paired) {
@@ -999,12 +1620,8 @@ void net_send_task(void *params) {
           if (config_data.use_network_password) {
 
             VLOG("net_send_task: satellite: sending password to join layout network %d", config_data.network_number);
-            esp_err_t result = esp_now_send(mac_master, (const uint8_t *)pwdata, sizeof(twai_message_t));
-
-            if (result != ESP_OK) {
+            if (!net_send_control(pwdata)) {
               VLOG("net_send_task: satellite: error sending password to master %s", mac_to_char(mac_master));
-              log_esp_now_err(result);
-              PULSE_LED(ERR_IND_LED);
             } else {
               // LOG("net_send_task: slave: sent password to master");
             }
@@ -1014,14 +1631,10 @@ void net_send_task(void *params) {
             // until they have received the first message
 
             VLOG("net_send_task: satellite: introducing self to master on network %d", config_data.network_number);
-            esp_err_t result = esp_now_send(mac_master, (const uint8_t *)hbdata, sizeof(twai_message_t));
-
-            if (result != ESP_OK) {
+            if (!net_send_control(hbdata)) {
               VLOG("net_send_task: satellite: error sending hello to master %s", mac_to_char(mac_master));
-              log_esp_now_err(result);
-              PULSE_LED(ERR_IND_LED);
             } else {
-              LOG("net_send_task: satellite: sent heartbeat to master");
+              LOGD(LOG_MOD_NET, "net_send_task: satellite: sent heartbeat to master");
             }
           }
         }
@@ -1031,22 +1644,11 @@ void net_send_task(void *params) {
       } else if (config_data.role == ROLE_MASTER) {
 
         // master sends heartbeat to all peers, if any
-        esp_now_get_peer_num(&peer_num);
-        num_peers = peer_num.total_num;
-
         if (num_peers > 0) {
-
-          // MAC address NULL means broadcast to all known peers
-          esp_err_t result = esp_now_send(NULL, (const uint8_t *)hbdata, sizeof(hbdata));
-
-          if (result != ESP_OK) {
-            LOG("net_send_task: master: error sending hearbeat to peers");
-            log_esp_now_err(result);
-            PULSE_LED(ERR_IND_LED);
+          if (!net_send_control(hbdata)) {
+            LOGE(LOG_MOD_NET, "net_send_task: master: error sending hearbeat to peers");
           } else {
             // LOG("net_send_task: master: sent heartbeat to slaves");
-            peer_record_op(NULL, PEER_INCR_TX_ALL);
-            PULSE_LED(NET_ACT_LED);
           }
         }   // num peers > 0
       }   // is master
@@ -1057,7 +1659,13 @@ void net_send_task(void *params) {
     /// this contains messages destined for all ESP-NOW peers
     //
 
-    if (xQueueReceive(net_out_queue, &frame, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
+    // retransmit any reliable packets whose acknowledgement is overdue
+    net_rel_tx_poll();
+
+    // keep CANCMD sessions alive without sending DKEEPs over the network
+    keepalive_poll();
+
+    if (xQueueReceive(net_out_queue, &fh, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
       // VLOG("net_send_task: forwarding received frame to network");
 
       // slaves need to find and pair the MAC address of the master for the configured network
@@ -1068,58 +1676,23 @@ void net_send_task(void *params) {
       }
 
       // if slave, there is only one possible peer - the master - so we send to its MAC address explicitly
-
-      if (config_data.role == ROLE_SLAVE) {
-        // VLOG("net_send_task: sending frame to network master");
-
-        if (!master_found_and_paired) {
-          LOG("net_send_task: the master cannot be paired yet, placing frame back on input queue");
-
-          // place the frame back on the queue, so we can try again shortly
-          // it is placed at the front of the queue to preserve message ordering
-          if (xQueueSendToFront(net_out_queue, &frame, QUEUE_OP_TIMEOUT) != pdTRUE) {
-            LOG("net_send_task: error placing frame back on input queue");
-            PULSE_LED(ERR_IND_LED);
-          }
-        } else {
-
-          esp_err_t result = esp_now_send(mac_master, (const uint8_t *)&frame, sizeof(twai_message_t));
-
-          if (result == ESP_OK) {
-            // LOG("net_send_task: sent frame to master");
-            PULSE_LED(NET_ACT_LED);
-          } else {
-            VLOG("net_send_task: error sending frame to master, err = %d", result);
-            log_esp_now_err(result);
-            PULSE_LED(ERR_IND_LED);
-          }
-        }   // master paired
-      }   // is slave
-
       // if master, forward to all slaves; sending to NULL MAC address means all currently paired peers
-      // we don't retry as there may be multiple slaves and we don't want to send duplicate messages
 
-      if (config_data.role == ROLE_MASTER) {
-
-        // get number of currently paired peers
-        esp_now_get_peer_num(&peer_num);
-        num_peers = peer_num.total_num;
-        // VLOG("net_send_task: master: peers currently paired = %d", peer_num.total_num);
-
-        if (num_peers > 0) {
-          esp_err_t result = esp_now_send(NULL, (const uint8_t *)&frame, sizeof(twai_message_t));
+      if (config_data.role == ROLE_SLAVE && !master_found_and_paired) {
+        LOG("net_send_task: the master cannot be paired yet, placing frame back on input queue");
 
-          if (result == ESP_OK) {
-            // VLOG("net_send_task: master: sent frame to network peers");
-            peer_record_op(NULL, PEER_INCR_TX_ALL);
-            PULSE_LED(NET_ACT_LED);
-          } else {
-            VLOG("net_send_task: master: error sending frame to network peers, err = %d", result);
-            log_esp_now_err(result);
-            PULSE_LED(ERR_IND_LED);
-          }
-        }   // peers > 0
-      }   // is master
+        // place the frame back on the queue, so we can try again shortly
+        // it is placed at the front of the queue to preserve message ordering
+        // the queue keeps our reference to the pool slot
+        if (xQueueSendToFront(net_out_queue, &fh, QUEUE_OP_TIMEOUT) != pdTRUE) {
+          LOG("net_send_task: error placing frame back on input queue");
+          PULSE_LED(ERR_IND_LED);
+          frame_pool_release(fh);
+        }
+      } else {
+        // send this frame, together with any others waiting in the queue
+        net_send_batch(fh);
+      }
     }   // get next message from output queue
 
     //
@@ -1134,36 +1707,7 @@ void net_send_task(void *params) {
       if (xQueueReceive(net_to_net_queue, &wframe, QUEUE_OP_TIMEOUT_NONE) == pdTRUE) {
         // VLOG("net_send_task: master: received wrapped frame from net-to-net queue, source MAC = %s", mac_to_char(wframe.mac));
 
-        // enumerate currently paired peers, sending frame if MAC addresses do not match
-        esp_now_peer_info_t peer;
-        esp_err_t e;
-
-        // fetch first known peer
-        e = esp_now_fetch_peer(true, &peer);
-
-        while (e == ESP_OK) {
-
-          // VLOG("net_send_task: master: comparing MAC, peer = %s, source = %s", mac_to_char(peer.peer_addr), mac_to_char(wframe.mac));
-
-          if (mac_is_equal(peer.peer_addr, wframe.mac_addr)) {
-            // VLOG("net_send_task: master: MAC addresses are equal, frame not sent");
-          } else {
-            // VLOG("net_send_task: master: MAC addresses are not equal, will send frame to peer");
-
-            esp_err_t result = esp_now_send(peer.peer_addr, (const uint8_t *)&wframe.frame, sizeof(twai_message_t));
-
-            if (result == ESP_OK) {
-              // VLOG("net_send_task: master: sent frame from net-to-net queue to network peer, MAC = %s", mac_to_char(peer.peer_addr));
-              PULSE_LED(NET_ACT_LED);
-            } else {
-              VLOG("net_send_task: master: error sending frame from net-to-net queue to network peer %s, err = %d", mac_to_char(peer.peer_addr), result);
-              log_esp_now_err(result);
-              PULSE_LED(ERR_IND_LED);
-            }   // sent ok ?
-          }   // MAC is equal ?
-
-          e = esp_now_fetch_peer(false, &peer);
-        }   // for each peer
+        net_reflect_frame(&wframe);
       }   // got net-to-net queue message
     }   // if master
 
@@ -1171,11 +1715,11 @@ void net_send_task(void *params) {
     if ((millis() - ptimer >= 10000)) {
       ptimer = millis();
 
-      VLOG("net_send_task: [%c] num peers = %d", (config_data.role == ROLE_MASTER) ? 'M' : 'S', num_peers);
+      LOGI(LOG_MOD_NET, "net_send_task: [%c] num peers = %d", (config_data.role == ROLE_MASTER) ? 'M' : 'S', num_peers);
 
       for (byte i = 0; i < MAX_NET_PEERS; i++) {
         if (peers[i].mac_addr[0] != 0) {
-          VLOG("net_send_task: [%d], MAC = %s, tx = %d, rx = %d, errs = %d, batt = %ld", i, mac_to_char(peers[i].mac_addr), peers[i].tx, peers[i].rx, peers[i].num_errs, peers[i].battery_mv);
+          LOGI(LOG_MOD_NET, "net_send_task: [%d], MAC = %s, tx = %d, rx = %d, errs = %d, batt = %ld", i, mac_to_char(peers[i].mac_addr), peers[i].tx, peers[i].rx, peers[i].num_errs, peers[i].battery_mv);
         }
       }
     }
@@ -1237,6 +1781,12 @@ void setup() {
     }
   }
 
+  // a satellite woken by its touch pad or switch resumes, restoring its state from before sleeping
+  // and deferring services that are not needed to bridge frames
+  if (resume_begin(wakeup_cause)) {
+    LOG("setup: resuming from deep sleep");
+  }
+
   //
   /// emergency reset - set configuration to defaults
   /// connect SCL pin to 0V for at least 5 seconds
@@ -1287,52 +1837,39 @@ void setup() {
     xQueueSend(led_cmd_queue, &lc, QUEUE_OP_TIMEOUT);
   }
 
-  // mount the local filesystem - format it first if required
-  if (SPIFFS.begin(true)) {
-    VLOG("setup: mounted SPIFFS filesystem, free space = %d", (SPIFFS.totalBytes() - SPIFFS.usedBytes()));
-  } else {
-    LOG("setup: error mounting SPIFFS filesystem");
+  // mount the local filesystem
+  if (!boot_resumed) {
+    mount_filesystem();
   }
 
   // start I2C peripheral as bus master
   Wire.begin(SDA_PIN, SCL_PIN);
 
-  LOG("setup: scanning the I2C bus");
-  byte device_count = 0;
+  // on resume, the devices present are known from before sleeping
+  if (!boot_resumed) {
+    scan_i2c_bus();
 
-  // I2C bus scan
-  for (byte i = 0; i < 128; i++) {
-    Wire.beginTransmission(i);
-    byte ret = Wire.endTransmission();
+    // check for display
+    Wire.beginTransmission(I2C_DISPLAY_ADDR);
 
-    if (ret == 0) {
-      ++ device_count;
-      VLOG("setup: detected device at 0x%hx", i);
+    if (Wire.endTransmission() == 0) {
+      display_present = true;
+      LOG("setup: display is present");
+    } else {
+      display_present = false;
+      LOG("setup: display is not present");
     }
-  }
-
-  VLOG("setup: detected %d devices", device_count);
-
-  // check for display
-  Wire.beginTransmission(I2C_DISPLAY_ADDR);
-
-  if (Wire.endTransmission() == 0) {
-    display_present = true;
-    LOG("setup: display is present");
-  } else {
-    display_present = false;
-    LOG("setup: display is not present");
-  }
 
-  // check for GPIO expander
-  Wire.beginTransmission(I2C_GPIO_ADDR);
+    // check for GPIO expander
+    Wire.beginTransmission(I2C_GPIO_ADDR);
 
-  if (Wire.endTransmission() == 0) {
-    switches_present = true;
-    LOG("setup: GPIO expander is present");
-  } else {
-    switches_present = false;
-    LOG("setup: GPIO expander is not present");
+    if (Wire.endTransmission() == 0) {
+      switches_present = true;
+      LOG("setup: GPIO expander is present");
+    } else {
+      switches_present = false;
+      LOG("setup: GPIO expander is not present");
+    }
   }
 
   if (switches_present) {
@@ -1356,6 +1893,7 @@ void setup() {
   //
 
   load_config();
+  boot_mark(BOOT_CONFIG);
 
   // display this node's configured role
   VLOG("setup: role = %s", (config_data.role == ROLE_MASTER ? "MASTER" : "SATELLITE"));
@@ -1369,6 +1907,11 @@ void setup() {
   channel = -1;
   int retries = 0;
 
+  // a slave uses the channel of the master it last joined, if any, without scanning
+  if (config_data.role == ROLE_SLAVE) {
+    channel = rejoin_init();
+  }
+
   LOG("setup: looking for wifi channel");
 
   // try a few times
@@ -1393,6 +1936,11 @@ void setup() {
     }
   }
 
+  // a slave that has found the master's channel then needs to scan only that channel to pair it
+  if (config_data.role == ROLE_SLAVE) {
+    rejoin_set_channel(channel);
+  }
+
   // if failed after several attempts, use the default channel
   if (channel == -1) {
     channel = config_data.default_wifi_channel;
@@ -1400,6 +1948,7 @@ void setup() {
   }
 
   VLOG("setup: wifi channel = %d", channel);
+  boot_mark(BOOT_CHANNEL);
 
   // connect to wifi if so configured
   WiFi.disconnect();
@@ -1419,6 +1968,7 @@ void setup() {
   // this advertises our ESP-NOW MAC address as well as providing access for web-based configuration
   // using the channel number selected above
   create_soft_AP(channel);
+  boot_mark(BOOT_SOFT_AP);
 
   // display MAC address
   VLOG("setup: station MAC address = %s", WiFi.macAddress().c_str());
@@ -1431,9 +1981,7 @@ void setup() {
   btStop();
 
   // initialise peer state table
-  for (byte i = 0; i < MAX_NET_PEERS; i++) {
-    bzero((void *)&peers[i], sizeof(peer_state_t));
-  }
+  peer_table_init();
 
   // initialise traffic stats data
   bzero(&stats, sizeof(stats_t));
@@ -1457,28 +2005,20 @@ void setup() {
     VLOG("setup: find_and_pair_master returns %d, num peers = %d", master_found_and_paired, num_peers);
   }
 
-  // construct mDNS name (accessed as xyz.local)
-  if (config_data.role == ROLE_MASTER) {
-    sprintf(mdnsname, "mergwifi-m-%d", config_data.network_number);
-  } else {
-    sprintf(mdnsname, "mergwifi-s-%d-%d", config_data.network_number, config_data.slave_number);
-  }
+  boot_mark(BOOT_ESPNOW);
 
-  // start mDNS responder
-  if (!MDNS.begin(mdnsname)) {
-    LOG("setup: error starting mDNS server");
-  } else {
-    VLOG("setup: mDNS server started, name = %s", mdnsname);
+  // start mDNS and the webserver
+  if (!boot_resumed) {
+    start_network_services();
   }
 
-  // start webserver
-  start_webserver();
-
-  // add webserver service to mDNS-SD
-  MDNS.addService("_http", "_tcp", 80);
+  // initialise the frame pool used by the CAN frame queues
+  frame_pool_init();
 
-  // set hostname, same as mDNS name
-  WiFi.setHostname(mdnsname);
+  // initialise ESP-NOW reliable delivery state
+  net_rel_init();
+  keepalive_init();
+  split_init();
 
   // create remaining queues
   for (byte j = 2; j < (sizeof(queue_tab) / sizeof(queue_t)); j++) {
@@ -1501,47 +2041,15 @@ void setup() {
 
   for (byte i = 0; i < (sizeof(queue_tab) / sizeof(queue_t)); i++) {
     if (queue_tab[i].handle == NULL) {
-      VLOG("setup: ERROR: NULL queue at pos = %d, %s", i, queue_tab[i].name);
-    }
-  }
-
-  // configure CAN bus driver
-  twai_general_config_t g_config;
-
-  g_config.mode = TWAI_MODE_NORMAL;
-  g_config.tx_io = (gpio_num_t)CAN_TX_PIN;
-  g_config.rx_io = (gpio_num_t)CAN_RX_PIN;
-  g_config.clkout_io = (gpio_num_t)TWAI_IO_UNUSED;
-  g_config.bus_off_io = (gpio_num_t)TWAI_IO_UNUSED;
-  g_config.tx_queue_len = CAN_QUEUE_DEPTH;
-  g_config.rx_queue_len = CAN_QUEUE_DEPTH;
-  g_config.alerts_enabled = TWAI_ALERT_ALL;
-  g_config.clkout_divider = 0;
-
-  VLOG("setup: TWAI queue depth = %d\n", CAN_QUEUE_DEPTH);
-
-  const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_125KBITS();
-  const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
-
-  // install TWAI driver
-  esp_err_t iret = twai_driver_install(&g_config, &t_config, &f_config);
-
-  if (iret == ESP_OK) {
-    LOG("setup: TWAI driver installed ok");
-  } else {
-    LOG("setup: error installing TWAI driver");
-    log_esp_now_err(iret);
+      VLOG("setup: ERROR: NULL queue at pos = %d, %s", i, queue_tab[i].name);
+    }
   }
 
-  // start CAN driver
-  iret = twai_start();
+  // configure, install and start the CAN bus driver
+  can_driver_install();
+  busload_init();
 
-  if (iret == ESP_OK) {
-    LOG("setup: TWAI driver started ok");
-  } else {
-    LOG("setup: error starting TWAI driver");
-    log_esp_now_err(iret);
-  }
+  boot_mark(BOOT_CAN);
 
   // register ESP-NOW send and receive callbacks
   // after queues have been created but before tasks are started
@@ -1560,6 +2068,8 @@ void setup() {
     }
   }
 
+  boot_mark(BOOT_TASKS);
+
   // misc system/task info
   VLOG("setup: ESP32 IDF version = %s", esp_get_idf_version());
   VLOG("setup: CPU frequency = %d MHz", getCpuFrequencyMhz());
@@ -1606,12 +2116,106 @@ void setup() {
   }
 
   // end of setup
+  boot_mark(BOOT_SETUP_DONE);
+
+  if (!boot_resumed) {
+    boot_report();
+  }
+
   VLOG("setup: free heap size = %d bytes", xPortGetFreeHeapSize());
   LOG("setup complete");
 
   return;
 }
 
+//
+/// mount the local filesystem - format it first if required
+//
+
+void mount_filesystem(void) {
+
+  if (SPIFFS.begin(true)) {
+    VLOG("setup: mounted SPIFFS filesystem, free space = %d", (SPIFFS.totalBytes() - SPIFFS.usedBytes()));
+  } else {
+    LOG("setup: error mounting SPIFFS filesystem");
+  }
+
+  boot_mark(BOOT_FILESYSTEM);
+  return;
+}
+
+//
+/// scan the I2C bus and log the devices found
+//
+
+void scan_i2c_bus(void) {
+
+  LOG("setup: scanning the I2C bus");
+  byte device_count = 0;
+
+  for (byte i = 0; i < 128; i++) {
+    Wire.beginTransmission(i);
+    byte ret = Wire.endTransmission();
+
+    if (ret == 0) {
+      ++ device_count;
+      VLOG("setup: detected device at 0x%hx", i);
+    }
+  }
+
+  VLOG("setup: detected %d devices", device_count);
+  boot_mark(BOOT_I2C);
+  return;
+}
+
+//
+/// start the mDNS responder and the webserver
+//
+
+void start_network_services(void) {
+
+  // construct mDNS name (accessed as xyz.local)
+  if (config_data.role == ROLE_MASTER) {
+    sprintf(mdnsname, "mergwifi-m-%d", config_data.network_number);
+  } else {
+    sprintf(mdnsname, "mergwifi-s-%d-%d", config_data.network_number, config_data.slave_number);
+  }
+
+  // start mDNS responder
+  if (!MDNS.begin(mdnsname)) {
+    LOG("setup: error starting mDNS server");
+  } else {
+    VLOG("setup: mDNS server started, name = %s", mdnsname);
+  }
+
+  // start webserver
+  start_webserver();
+
+  // add webserver service to mDNS-SD
+  MDNS.addService("_http", "_tcp", 80);
+
+  // set hostname, same as mDNS name
+  WiFi.setHostname(mdnsname);
+
+  boot_mark(BOOT_SERVICES);
+  return;
+}
+
+//
+/// start the services deferred on resume from deep sleep, once the bridge is passing frames
+//
+
+void start_deferred_services(void) {
+
+  LOG("loop: starting deferred services");
+  mount_filesystem();
+  scan_i2c_bus();
+  start_network_services();
+  boot_mark(BOOT_DEFERRED);
+  boot_report();
+  return;
+}
+
 //
 /// loop
 //
@@ -1623,6 +2227,11 @@ void loop() {
   static unsigned long ptimer = millis();
   led_command_t lc;
 
+  // on resume from deep sleep, start the remaining services once the bridge is up
+  if (resume_deferred_due()) {
+    start_deferred_services();
+  }
+
   // allow webserver some processor time
   webserver.handleClient();
 
@@ -1631,6 +2240,7 @@ void loop() {
 
     // restart once the timer expires
     if (restart_timer - millis() <= 0L) {
+      logsink_sync();
       ESP.restart();        // calls shutdown handler
     }
 
@@ -1685,6 +2295,20 @@ void loop() {
     VLOG("%c: errors   - net: tx = %lu rx = %lu, CAN: tx = %lu rx = %lu, GC: tx = %lu, rx = %lu", role, errors.net_tx, errors.net_rx, errors.can_tx, errors.can_rx, errors.gc_tx, errors.gc_rx);
 
     VLOG("loop: free heap size = %u bytes", xPortGetFreeHeapSize());
+    VLOG("loop: frame pool - size = %d, in use = %u, hwm = %u, allocs = %lu, exhausted = %lu", FRAME_POOL_SIZE, frame_pool_stats.in_use, frame_pool_stats.hwm, frame_pool_stats.allocs, frame_pool_stats.exhausted);
+#if LATENCY_BENCHMARK
+    latency_report();
+#endif
+    VLOG("loop: ESP-NOW - packets = %lu, frames = %lu, batches = %lu", net_batch_stats.packets_tx, net_batch_stats.frames_tx, net_batch_stats.batches_tx);
+    VLOG("loop: router - messages = %lu, deliveries = %lu, filtered = %lu", router_stats.messages, router_stats.deliveries, router_stats.filtered);
+
+    VLOG("loop: reliable - sent = %lu, retransmits = %lu, abandoned = %lu, acks tx = %lu, rx = %lu, dups = %lu, reordered = %lu, lost = %lu", net_rel_stats.sent, \
+         net_rel_stats.retransmits, net_rel_stats.abandoned, net_rel_stats.acks_tx, net_rel_stats.acks_rx, net_rel_stats.duplicates, net_rel_stats.reordered, net_rel_stats.lost);
+
+    if (net_rx_stats.packets + net_rx_stats.dropped > 0) {
+      VLOG("loop: ESP-NOW rx ring - packets = %lu, dropped = %lu, hwm = %u/%d, callback avg = %lu us, max = %lu us", net_rx_stats.packets, net_rx_stats.dropped, \
+           net_rx_stats.hwm, NET_RX_RING_SIZE, net_rx_stats.cb_total_us / (net_rx_stats.packets + net_rx_stats.dropped), net_rx_stats.cb_max_us);
+    }
 
     // task stack hwm
     for (byte i = 0; i < (sizeof(task_list) / sizeof(task_info_t)); i++) {
@@ -1744,6 +2368,24 @@ void load_config(void) {
     default_config();
   }
 
+  // split bus opcodes; a config saved before they were added reads whatever was in EEPROM, e.g. 0xff, so clear them
+  if (config_data.split_opcodes_guard != SPLIT_OPCODES_GUARD) {
+    bzero(config_data.split_opcodes, sizeof(config_data.split_opcodes));
+    config_data.split_opcodes_guard = SPLIT_OPCODES_GUARD;
+  }
+
+  // saved log levels; a config saved before they were added keeps the defaults
+  if (config_data.log_levels_guard != LOG_LEVELS_GUARD) {
+    memcpy(config_data.log_levels, log_levels, sizeof(config_data.log_levels));
+    config_data.log_levels_guard = LOG_LEVELS_GUARD;
+  }
+
+  for (byte i = 0; i < LOG_NUM_MODULES; i++) {
+    if (config_data.log_levels[i] <= LOG_LEVEL_MAX) {
+      log_levels[i] = config_data.log_levels[i];
+    }
+  }
+
   // overlay soft/default config with settings from physical switches
   if (config_data.config_mode == CONFIG_USES_HW && switches_present) {
 
@@ -1771,6 +2413,7 @@ void load_config(void) {
   VLOG("  - gc server = %d", config_data.gc_server_on);
   VLOG("  - gc server port = %d", config_data.gc_server_port);
   VLOG("  - gc serial on = %d", config_data.gc_serial_on);
+  VLOG("  - gc overflow policy = %d, serial = %d", config_data.gc_overflow_policy, config_data.gc_serial_overflow_policy);
   VLOG("  - bridge mode = %d", config_data.bridge_mode);
   VLOG("  - debug = %d", config_data.debug);
   VLOG("  - guard val = %d", config_data.guard_val);
@@ -1806,6 +2449,22 @@ void load_config(void) {
   }
 
   VLOG("  - CBUS node variables = %s", nvs.c_str());
+
+  String ops = "";
+
+  for (byte i = 0; i < NUM_SPLIT_OPCODES; i++) {
+    ops += String(config_data.split_opcodes[i], HEX) + " ";
+  }
+
+  VLOG("  - split bus opcodes = %s", ops.c_str());
+
+  String levels = "";
+
+  for (byte i = 0; i < LOG_NUM_MODULES; i++) {
+    levels += String(log_module_names[i]) + "=" + log_level_names[log_levels[i]] + " ";
+  }
+
+  VLOG("  - log levels = %s", levels.c_str());
   return;
 }
 
@@ -1874,6 +2533,22 @@ void default_config(void) {
     config_data.node_variables[i] = 0;
   }
 
+  bzero(config_data.split_opcodes, sizeof(config_data.split_opcodes));
+  config_data.split_opcodes_guard = SPLIT_OPCODES_GUARD;
+
+  for (byte i = 0; i < LOG_NUM_MODULES; i++) {
+    config_data.log_levels[i] = LOG_LVL_INFO;
+  }
+
+  config_data.log_levels_guard = LOG_LEVELS_GUARD;
+  config_data.gc_overflow_policy = GC_OVERFLOW_DROP_OLDEST;
+  config_data.gc_serial_overflow_policy = GC_OVERFLOW_DROP_OLDEST;
+
+  for (byte i = 0; i < GC_OVERFLOW_IPS; i++) {
+    config_data.gc_overflow_ip[i] = 0;
+    config_data.gc_overflow_ip_policy[i] = GC_OVERFLOW_DROP_OLDEST;
+  }
+
   save_config();
   delay(5);
 
@@ -1918,27 +2593,202 @@ bool mac_is_equal(const uint8_t *mac1, const uint8_t *mac2) {
   return is_equal;
 }
 
+//
+/// peer state table
+/// peer records are held in a compact array, and located by a hash index keyed on the low bytes of the MAC address
+/// MAC addresses of nearby ESP32s often share the vendor prefix, so only the device-specific bytes are hashed
+/// the index uses linear probing, and is rebuilt when a peer is removed, which is rare
+/// counters are updated atomically, as the wifi task, net_rx task and net_send_task all update them
+/// a peer can be removed at any time, from the ESP-NOW send callback, and its slot reused; so code that looks up a peer
+/// and then uses its index, e.g. for its own per-peer state, must hold peer_mux for both, with peer_find_locked
+/// peers are reset in the other modules under peer_mux too, so the lock order is peer_mux, then the module's own
+//
+
+byte peer_index[PEER_INDEX_SIZE];
+
+// cached MAC addresses of the active peers, refreshed only when a peer is added or removed
+uint8_t peer_list[MAX_NET_PEERS][6];
+byte peer_list_len = 0;
+
+byte peer_hash(const uint8_t *mac_addr) {
+  return (mac_addr[5] ^ (mac_addr[4] << 3) ^ (mac_addr[3] >> 2)) & (PEER_INDEX_SIZE - 1);
+}
+
+//
+/// insert a peer record into the hash index; the caller must hold the peer mutex
+//
+
+void peer_index_insert(byte idx) {
+
+  byte h = peer_hash(peers[idx].mac_addr);
+
+  while (peer_index[h] != PEER_INDEX_NONE) {
+    h = (h + 1) & (PEER_INDEX_SIZE - 1);
+  }
+
+  peer_index[h] = idx;
+  return;
+}
+
+//
+/// rebuild the hash index from the peer table; the caller must hold the peer mutex
+//
+
+void peer_index_rebuild(void) {
+
+  memset(peer_index, PEER_INDEX_NONE, sizeof(peer_index));
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    if (peers[i].mac_addr[0] != 0) {
+      peer_index_insert(i);
+    }
+  }
+
+  return;
+}
+
+//
+/// refresh the cached list of active peers; the caller must hold the peer mutex
+//
+
+void peer_list_refresh(void) {
+
+  peer_list_len = 0;
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    if (peers[i].mac_addr[0] != 0) {
+      memcpy(peer_list[peer_list_len++], peers[i].mac_addr, sizeof(uint8_t[6]));
+    }
+  }
+
+  if (config_data.role == ROLE_MASTER) {
+    num_peers = peer_list_len;
+  }
+
+  return;
+}
+
+//
+/// take a copy of the cached list of active peers, returning the number of peers
+//
+
+byte peer_list_copy(uint8_t macs[MAX_NET_PEERS][6]) {
+
+  byte n;
+
+  portENTER_CRITICAL(&peer_mux);
+  n = peer_list_len;
+  memcpy(macs, peer_list, n * sizeof(uint8_t[6]));
+  portEXIT_CRITICAL(&peer_mux);
+  return n;
+}
+
+//
+/// clear the peer table and its index
+//
+
+void peer_table_init(void) {
+
+  portENTER_CRITICAL(&peer_mux);
+  bzero((void *)peers, sizeof(peers));
+  memset(peer_index, PEER_INDEX_NONE, sizeof(peer_index));
+  peer_list_len = 0;
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// return the table index of a peer, or -1 if not found; the caller must hold the peer mutex
+//
+
+int peer_find_locked(const uint8_t *mac_addr) {
+
+  byte h = peer_hash(mac_addr);
+
+  for (byte n = 0; n < PEER_INDEX_SIZE && peer_index[h] != PEER_INDEX_NONE; n++) {
+    if (memcmp(peers[peer_index[h]].mac_addr, mac_addr, sizeof(uint8_t[6])) == 0) {
+      return peer_index[h];
+    }
+
+    h = (h + 1) & (PEER_INDEX_SIZE - 1);
+  }
+
+  return -1;
+}
+
+//
+/// return the table index of a peer, or -1 if not found
+/// the peer may be removed as soon as this returns; see peer_find_locked
+//
+
+int peer_find(const uint8_t *mac_addr) {
+
+  int idx;
+
+  portENTER_CRITICAL(&peer_mux);
+  idx = peer_find_locked(mac_addr);
+  portEXIT_CRITICAL(&peer_mux);
+  return idx;
+}
+
 //
 /// add a new peer to the table
 //
 
 void add_peer(const uint8_t *mac_addr) {
 
-  byte i;
+  int i;
+
+  portENTER_CRITICAL(&peer_mux);
+
+  if (peer_find_locked(mac_addr) >= 0) {
+    portEXIT_CRITICAL(&peer_mux);
+    return;
+  }
 
   for (i = 0; i < MAX_NET_PEERS; i++) {
     if (peers[i].mac_addr[0] == 0) {
+      bzero((void *)&peers[i], sizeof(peer_state_t));
       memcpy(peers[i].mac_addr, mac_addr, sizeof(uint8_t[6]));
-      peers[i].num_errs = 0;
-      VLOG("add_peer: added new peer at table index = %d", i);
+      peers[i].CANCMD_session = -1;
+      peer_index_insert(i);
+      peer_list_refresh();
+      net_rel_peer_reset(i);
+      keepalive_peer_reset(i);
       break;
     }
   }
 
+  portEXIT_CRITICAL(&peer_mux);
+
   if (i == MAX_NET_PEERS) {
     LOG("add_peer: table is full!!");
+  } else {
+    VLOG("add_peer: added new peer at table index = %d", i);
+  }
+
+  return;
+}
+
+//
+/// remove a peer from the table, if it is still there
+//
+
+void remove_peer(const uint8_t *mac_addr) {
+
+  int idx;
+
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = peer_find_locked(mac_addr)) >= 0) {
+    bzero((void *)&peers[idx], sizeof(peer_state_t));
+    peer_index_rebuild();
+    peer_list_refresh();
+    net_rel_peer_reset(idx);
+    keepalive_peer_reset(idx);
   }
 
+  portEXIT_CRITICAL(&peer_mux);
   return;
 }
 
@@ -1950,7 +2800,8 @@ void add_peer(const uint8_t *mac_addr) {
 
 void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val) {
 
-  byte i;
+  int i, errs;
+  bool unpair = false, unknown = false;
 
   // VLOG("peer_record_op: peer = %s, op = %d", mac_to_char(mac_addr), op);
 
@@ -1961,9 +2812,7 @@ void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val) {
 
   // init all
   if (op == PEER_INIT_ALL) {
-    for (i = 0; i < MAX_NET_PEERS; i++) {
-      bzero((void *)&peers[i], sizeof(peer_state_t));
-    }
+    peer_table_init();
     return;
   }
 
@@ -1971,20 +2820,19 @@ void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val) {
   if (op == PEER_INCR_TX_ALL) {
     for (i = 0; i < MAX_NET_PEERS; i++) {
       if (peers[i].mac_addr[0] != 0) {
-        ++peers[i].tx;
+        __atomic_add_fetch(&peers[i].tx, 1, __ATOMIC_RELAXED);
       }
     }
     return;
   }
 
   // for the following per-peer operations, find the peer record in the table by MAC address
-  for (i = 0; i < MAX_NET_PEERS; i++) {
-    if (mac_is_equal(mac_addr, peers[i].mac_addr)) {
-      break;
-    }
-  }
+  // hold the lock while the record is updated, so it can't be removed and its slot reused meanwhile
+  portENTER_CRITICAL(&peer_mux);
+  i = peer_find_locked(mac_addr);
 
-  if (i == MAX_NET_PEERS) {
+  if (i < 0) {
+    portEXIT_CRITICAL(&peer_mux);
     VLOG("peer_record_op: peer record not found for MAC addr = %s", mac_to_char(mac_addr));
     return;
   }
@@ -1992,42 +2840,28 @@ void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val) {
   switch (op) {
 
     case PEER_INCR_ERR:
-      ++peers[i].num_errs;
-
-      if (peers[i].num_errs >= config_data.peer_err_limit) {
-        VLOG("peer_record_op: error limit exceeded, unpairing peer = %s", mac_to_char(mac_addr));
-
-        esp_err_t e = esp_now_del_peer(mac_addr);
-
-        if (e == ESP_OK) {
-          LOG("peer_record_op: peer unpaired and record reset");
-        } else {
-          VLOG("peer_record_op: error unpairing, e = %d", e);
-          log_esp_now_err(e);
-        }
-
-        bzero((void *)&peers[i], sizeof(peer_state_t));
-      } else {
-        // VLOG("peer_record_op: peer new error count = %d", peers[i].num_errs);
-      }
+      errs = __atomic_add_fetch(&peers[i].num_errs, 1, __ATOMIC_RELAXED);
+      unpair = (errs >= config_data.peer_err_limit);
       break;
 
     case PEER_DECR_ERR:
-      if (peers[i].num_errs > 0) {
-        --peers[i].num_errs;
+      errs = __atomic_load_n(&peers[i].num_errs, __ATOMIC_RELAXED);
+
+      while (errs > 0 && !__atomic_compare_exchange_n(&peers[i].num_errs, &errs, errs - 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
       }
       break;
 
     case PEER_RESET_ERR:
-      peers[i].num_errs = 0;
+      __atomic_store_n(&peers[i].num_errs, 0, __ATOMIC_RELAXED);
       break;
 
     case PEER_INCR_TX:
-      peers[i].tx += 1;
+      __atomic_add_fetch(&peers[i].tx, 1, __ATOMIC_RELAXED);
       break;
 
     case PEER_INCR_RX:
-      peers[i].rx += 1;
+      __atomic_add_fetch(&peers[i].rx, 1, __ATOMIC_RELAXED);
       break;
 
     case PEER_SET_BATT_MV:
@@ -2042,11 +2876,43 @@ void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val) {
       peers[i].CANID = val & 0xff;
       break;
 
+    case PEER_SET_VERSION:
+      peers[i].wire_version = val & 0xff;
+      break;
+
+    case PEER_RAISE_VERSION:
+      if (peers[i].wire_version < val) {
+        peers[i].wire_version = val & 0xff;
+      }
+      break;
+
     default:
-      VLOG("peer_record_op: unknown operation = %d", op);
+      unknown = true;
       break;
   }
 
+  portEXIT_CRITICAL(&peer_mux);
+
+  if (unknown) {
+    VLOG("peer_record_op: unknown operation = %d", op);
+  }
+
+  // unpair outside the lock; the peer is looked up again, in case it has already gone
+  if (unpair) {
+    VLOG("peer_record_op: error limit exceeded, unpairing peer = %s", mac_to_char(mac_addr));
+
+    esp_err_t e = esp_now_del_peer(mac_addr);
+
+    if (e == ESP_OK) {
+      LOG("peer_record_op: peer unpaired and record reset");
+    } else {
+      VLOG("peer_record_op: error unpairing, e = %d", e);
+      log_esp_now_err(e);
+    }
+
+    remove_peer(mac_addr);
+  }
+
   return;
 }
 
@@ -2068,7 +2934,7 @@ void log_esp_now_err(int err_num) {
 
 void device_sleep(void) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   VLOG("device_sleep: device sleep initiated");
 
@@ -2119,8 +2985,12 @@ void device_sleep(void) {
       break;
   }
 
+  // save the state needed to resume quickly on wakeup
+  resume_save();
+
   LOG("device_sleep: sleeping now");
   vTaskDelay(100);
+  logsink_sync();
   esp_deep_sleep_start();
 
   /// does not return
@@ -2132,9 +3002,8 @@ void device_sleep(void) {
 
 void IRAM_ATTR touch_callback(void) {
 
-  led_command_t lc = { ERR_IND_LED, LED_PULSE, 0 };
   LOG("touch callback runs");
-  xQueueSend(led_cmd_queue, &lc, 0);
+  PULSE_LED(ERR_IND_LED);
   return;
 }
 
@@ -2142,55 +3011,68 @@ void IRAM_ATTR touch_callback(void) {
 /// covenience function to send a message to multiple queues
 /// pass target queue list as an or'd bit field in a 16 bit integer
 /// e.g. uint16_t queues = QUEUE_CAN_OUT_FROM_GC | QUEUE_NET_OUT;
+/// the message is only delivered to those target queues whose consumer has subscribed to it - see router.cpp
+/// CAN frames are copied once into the frame pool and each pooled queue receives a handle to the shared slot
+/// the remaining queues receive a copy of the message as before
+/// is_frame is false for messages that are not CAN frames, e.g. wrapped frames and GC strings, so the router doesn't
+/// read a frame type or opcode from them
 //
 
-bool send_message_to_queues(uint16_t target_queues, void *msg, const char *source_task, TickType_t time_to_wait) {
+bool send_message_to_queues(uint16_t target_queues, void *msg, const char *source_task, TickType_t time_to_wait, bool is_frame) {
 
   bool ret = true;
+  uint16_t send_to = 0;
+  byte num_pooled = 0;
+  frame_handle_t fh = FRAME_HANDLE_NONE;
 
   // VLOG("send_message_to_queues: targets = %d, source = %s", target_queues, source_task);
 
+  // ask the router which of the target queues have subscribed to this message
+  send_to = router_select(target_queues, msg, is_frame);
+
   for (byte i = 0; i < sizeof(queue_tab) / sizeof(queue_t); i++) {
+    if ((send_to & (1 << i)) && queue_tab[i].pooled) {
+      ++num_pooled;
+    }
+  }
 
-    // iterate through target bits
-
-    if (target_queues & (1 << i)) {
-
-      // apply per-queue constraints
-      if ((i < 5) || \
-          (i == 5 && num_peers > 0) || \
-          (i == 6 && num_peers > 1) || \
-          (i == 7 && num_gc_clients > 0) || \
-          (i == 8 && num_gc_clients > 1) || \
-          (i == 9 && num_wi_clients > 0 && config_data.dcc_type == DCC_MERG) || \
-          (i == 10) || \
-          (i == 11 && false) || \
-          (i == 12 && config_data.cmdproxy_on) || \
-          (i == 13 && config_data.role == ROLE_MASTER) || \
-          (i == 14 && config_data.role == ROLE_MASTER)
-         ) {
-
-        // VLOG("send_message_to_queues: sending to queue %d/%s, from source = %s", i, queue_tab[i].name, source_task);
-
-        /*
-          if (i == 13) {
-            LOG("send_message_to_queues: sending to QUEUE_CBUS_EXTERNAL");
-          }
+  // take a single pool slot, with one reference for each pooled queue
 
-          if (i == 14) {
-            LOG("send_message_to_queues: sending to QUEUE_CBUS_INTERNAL");
-          }
-        */
+  if (num_pooled > 0) {
+    fh = frame_pool_alloc(msg, num_pooled);
 
-        if (xQueueSend(queue_tab[i].handle, msg, time_to_wait) != pdTRUE) {
+    if (fh == FRAME_HANDLE_NONE) {
+      VLOG("send_message_to_queues: frame pool exhausted, from source = %s", source_task);
+      ret = false;
+    }
+  }
+
+  // send the handle or a copy of the message to each selected queue
+
+  for (byte i = 0; i < sizeof(queue_tab) / sizeof(queue_t); i++) {
+
+    if (send_to & (1 << i)) {
+
+      // VLOG("send_message_to_queues: sending to queue %d/%s, from source = %s", i, queue_tab[i].name, source_task);
+
+      if (queue_tab[i].pooled) {
+        if (fh == FRAME_HANDLE_NONE) {
+          continue;
+        }
+
+        if (xQueueSend(queue_tab[i].handle, &fh, time_to_wait) != pdTRUE) {
           VLOG("send_message_to_queues: error sending message to queue = %d/%s, from source = %s", i, queue_tab[i].name, source_task);
+          frame_pool_release(fh);
           ret = false;
         }
       } else {
-        // VLOG("send_message_to_queues: not sending to queue = %d/%s, from source = %s", i, queue_tab[i].name, source_task);
-      }   // per-queue test
-    }   // each target queue
-  }   // loop
+        if (xQueueSend(queue_tab[i].handle, msg, time_to_wait) != pdTRUE) {
+          VLOG("send_message_to_queues: error sending message to queue = %d/%s, from source = %s", i, queue_tab[i].name, source_task);
+          ret = false;
+        }
+      }
+    }
+  }
 
   return ret;
 }
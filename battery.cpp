@@ -66,6 +66,7 @@ extern peer_state_t peers[MAX_NET_PEERS];
 double read_adc_voltage(byte pin);
 unsigned int read_fg_soc(void);
 unsigned int read_fg_voltage(void);
+void make_battery_message(char *buffer, unsigned int mv, byte soc);
 void send_cbus_battery_message(int i);
 void do_low_battery_check(unsigned int battery_mv);
 
@@ -181,8 +182,8 @@ void battery_monitor_task(void *params) {
         VLOG("battery_monitor_task: slave: moving average mV = %d", average_voltage);
 
         // send message for onward transmission to master
-        sprintf(tbuff, "MV%4d", average_voltage);
-        send_message_to_queues(QUEUE_NET_OUT, tbuff, "battery_monitor_task", QUEUE_OP_TIMEOUT_LONG);
+        make_battery_message(tbuff, average_voltage, NET_BATTERY_NONE & 0xff);
+        send_message_to_queues(QUEUE_NET_OUT, tbuff, "battery_monitor_task", QUEUE_OP_TIMEOUT_LONG, false);
 
         do_low_battery_check(average_voltage);
 
@@ -193,13 +194,13 @@ void battery_monitor_task(void *params) {
 
         average_voltage = read_fg_voltage();
         VLOG("battery_monitor_task: fg voltage = %d", average_voltage);
-        snprintf(tbuff, sizeof(tbuff), "MV%4d", average_voltage);
-        send_message_to_queues(QUEUE_NET_OUT, tbuff, "battery_monitor_task", QUEUE_OP_TIMEOUT_LONG);
 
         soc = read_fg_soc();
         VLOG("battery_monitor_task: fg soc = %d", soc);
-        snprintf(tbuff, sizeof(tbuff), "SO%3d", soc);
-        send_message_to_queues(QUEUE_NET_OUT, tbuff, "battery_monitor_task", QUEUE_OP_TIMEOUT_LONG);
+
+        // voltage and state of charge are sent together in one message
+        make_battery_message(tbuff, average_voltage, soc);
+        send_message_to_queues(QUEUE_NET_OUT, tbuff, "battery_monitor_task", QUEUE_OP_TIMEOUT_LONG, false);
 
         do_low_battery_check(average_voltage);
       }   // fuel gauge present
@@ -207,6 +208,21 @@ void battery_monitor_task(void *params) {
   }   // for (;;)
 }
 
+//
+/// build a typed battery message for the net output queue
+/// the buffer is the size of a CAN frame, as the queue is shared with CAN frames
+//
+
+void make_battery_message(char *buffer, unsigned int mv, byte soc) {
+
+  bzero(buffer, sizeof(twai_message_t));
+  buffer[0] = NET_MSG_BATTERY;
+  buffer[1] = highByte(mv);
+  buffer[2] = lowByte(mv);
+  buffer[3] = soc;
+  return;
+}
+
 // read battery voltage from fuel gauge, register VCELL 0x02
 
 unsigned int read_fg_voltage(void) {
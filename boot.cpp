@@ -0,0 +1,191 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// boot timeline and deep sleep resume
+///
+/// the time at which each phase of startup completes is recorded, up to the first frame bridged, and published
+/// in the log and on the stats page
+///
+/// a slave woken from deep sleep by its touch pad or switch resumes rather than starting from scratch
+/// the state it had learnt before sleeping is kept in RTC memory, together with the master's MAC address and channel,
+/// see rejoin.cpp, and services not needed to bridge frames - the I2C bus scan, the filesystem, mDNS and the webserver
+/// - are started only once the bridge is passing frames, or after RESUME_DEFER_MAX_MS
+//
+
+// variables declared in other source files
+extern config_t config_data;
+extern bool display_present, switches_present;
+extern byte slave_canid, master_wire_version;
+extern signed int CANCMD_session_num;
+
+// state kept over deep sleep
+typedef struct {
+  uint32_t magic;
+  byte role;
+  bool display_present, switches_present;
+  byte slave_canid, master_wire_version;
+  int CANCMD_session;
+} resume_state_t;
+
+RTC_DATA_ATTR static resume_state_t resume_state;
+
+static unsigned long boot_times[BOOT_NUM_PHASES];
+static bool deferred_pending = false;
+bool boot_resumed = false;
+
+static const char *boot_phase_names[BOOT_NUM_PHASES] = {
+  "filesystem mounted", "I2C bus scanned", "config loaded", "channel found", "soft AP started", "ESP-NOW started",
+  "mDNS and webserver started", "CAN driver started", "tasks started", "setup complete", "master joined",
+  "first frame bridged", "deferred services started"
+};
+
+//
+/// record the time a startup phase completed, the first time only
+//
+
+void boot_mark(byte phase) {
+
+  if (phase < BOOT_NUM_PHASES && boot_times[phase] == 0) {
+    boot_times[phase] = millis();
+
+    if (boot_times[phase] == 0) {
+      boot_times[phase] = 1;
+    }
+  }
+
+  return;
+}
+
+//
+/// format a phase of the boot timeline; returns false if the phase has not completed
+//
+
+bool boot_format(byte phase, char *buffer, size_t len) {
+
+  if (phase >= BOOT_NUM_PHASES || boot_times[phase] == 0) {
+    return false;
+  }
+
+  snprintf(buffer, len, "%s at %lu ms", boot_phase_names[phase], boot_times[phase]);
+  return true;
+}
+
+//
+/// log the boot timeline
+//
+
+void boot_report(void) {
+
+  char tbuff[64];
+
+  VLOG("boot_report: %s start", boot_resumed ? "resume" : "cold");
+
+  for (byte i = 0; i < BOOT_NUM_PHASES; i++) {
+    if (boot_format(i, tbuff, sizeof(tbuff))) {
+      VLOG("boot_report: %s", tbuff);
+    }
+  }
+
+  return;
+}
+
+//
+/// decide whether to resume, and if so restore the state saved before sleeping
+/// the saved state is used once only, so any later restart is a full startup
+//
+
+bool resume_begin(esp_sleep_wakeup_cause_t cause) {
+
+  boot_resumed = (resume_state.magic == RESUME_MAGIC && resume_state.role == ROLE_SLAVE &&
+                  (cause == ESP_SLEEP_WAKEUP_TOUCHPAD || cause == ESP_SLEEP_WAKEUP_EXT0));
+
+  if (boot_resumed) {
+    display_present = resume_state.display_present;
+    switches_present = resume_state.switches_present;
+    slave_canid = resume_state.slave_canid;
+    master_wire_version = resume_state.master_wire_version;
+    CANCMD_session_num = resume_state.CANCMD_session;
+    deferred_pending = true;
+    VLOG("resume_begin: resuming, CANID = %d, session = %d, master version = %d", slave_canid, CANCMD_session_num, master_wire_version);
+  }
+
+  resume_state.magic = 0;
+  return boot_resumed;
+}
+
+//
+/// save the state needed to resume, before deep sleep
+//
+
+void resume_save(void) {
+
+  resume_state.role = config_data.role;
+  resume_state.display_present = display_present;
+  resume_state.switches_present = switches_present;
+  resume_state.slave_canid = slave_canid;
+  resume_state.master_wire_version = master_wire_version;
+  resume_state.CANCMD_session = CANCMD_session_num;
+  resume_state.magic = RESUME_MAGIC;
+  return;
+}
+
+//
+/// returns true, once, when the services deferred by a resume should be started
+//
+
+bool resume_deferred_due(void) {
+
+  if (!deferred_pending) {
+    return false;
+  }
+
+  if (boot_times[BOOT_FIRST_FRAME] != 0 || millis() >= RESUME_DEFER_MAX_MS) {
+    deferred_pending = false;
+    return true;
+  }
+
+  return false;
+}
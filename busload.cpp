@@ -0,0 +1,311 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// CAN bus load meter and traffic accounting
+///
+/// every frame received from, or sent to, the local bus is counted towards the bus time it occupies, worked out
+/// from its length, including the stuff bits the controller inserts, which depend on the frame content;
+/// bit times are summed per second in a ring of BUSLOAD_HISTORY_SECS, giving utilisation over 1, 10 and 60 seconds
+///
+/// frames are also counted by source CANID and opcode, in fixed tables for the current and previous minute,
+/// from which the busiest are picked when the stats page asks for them
+///
+/// frames rejected by the acceptance filter are not seen, so the load is understated while it is narrowed
+//
+
+// variables declared in other source files
+extern config_t config_data;
+
+typedef struct {
+  uint16_t crc;
+  byte last, run, stuffed;
+} can_bitstream_t;
+
+static uint32_t sec_bits[BUSLOAD_HISTORY_SECS];         // bit times in each of the last complete seconds
+static uint32_t cur_bits;                               // bit times in the current second
+static unsigned long cur_sec, start_sec, cur_min;
+static uint32_t canid_frames[2][128];                   // frames by source CANID, current and previous minute
+static uint32_t opcode_frames[2][256];                  // frames by opcode, current and previous minute
+static portMUX_TYPE busload_mux = portMUX_INITIALIZER_UNLOCKED;
+
+busload_stats_t busload_stats;
+
+void busload_init(void) {
+
+  start_sec = cur_sec = millis() / 1000;
+  cur_min = cur_sec / 60;
+  return;
+}
+
+//
+/// add a bit to the stream, updating the CRC and the count of stuff bits
+/// a stuff bit of the opposite value follows five equal bits, and itself counts towards the next run
+//
+
+static inline void put_bit(can_bitstream_t *bs, byte bit, bool crc) {
+
+  if (crc) {
+    byte nxt = bit ^ ((bs->crc >> 14) & 1);
+    bs->crc = (bs->crc << 1) & 0x7fff;
+
+    if (nxt) {
+      bs->crc ^= 0x4599;
+    }
+  }
+
+  if (bit == bs->last) {
+    if (++bs->run == 5) {
+      ++bs->stuffed;
+      bs->last = !bit;
+      bs->run = 1;
+    }
+  } else {
+    bs->last = bit;
+    bs->run = 1;
+  }
+
+  return;
+}
+
+static void put_bits(can_bitstream_t *bs, uint32_t value, byte num_bits, bool crc) {
+
+  while (num_bits-- > 0) {
+    put_bit(bs, (value >> num_bits) & 1, crc);
+  }
+
+  return;
+}
+
+//
+/// the number of bit times a frame occupies on the bus, including stuff bits and the interframe space
+//
+
+unsigned int busload_frame_bits(const twai_message_t *frame) {
+
+  can_bitstream_t bs = { 0, 2, 0, 0 };
+  bool rtr = (frame->flags & TWAI_MSG_FLAG_RTR);
+  byte dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+  byte num_data = rtr ? 0 : dlc;
+  unsigned int bits;
+
+  // start of frame and arbitration and control fields
+  put_bit(&bs, 0, true);
+
+  if (frame->flags & TWAI_MSG_FLAG_EXTD) {
+    put_bits(&bs, frame->identifier >> 18, 11, true);
+    put_bits(&bs, 0x03, 2, true);                        // SRR, IDE
+    put_bits(&bs, frame->identifier & 0x3ffff, 18, true);
+    put_bit(&bs, rtr, true);
+    put_bits(&bs, 0, 2, true);                           // r1, r0
+    bits = 39;
+  } else {
+    put_bits(&bs, frame->identifier, 11, true);
+    put_bit(&bs, rtr, true);
+    put_bits(&bs, 0, 2, true);                           // IDE, r0
+    bits = 19;
+  }
+
+  put_bits(&bs, dlc, 4, true);
+
+  // data field and CRC sequence, which is also subject to stuffing
+  for (byte i = 0; i < num_data; i++) {
+    put_bits(&bs, frame->data[i], 8, true);
+  }
+
+  put_bits(&bs, bs.crc, 15, false);
+
+  // CRC delimiter, ACK slot and delimiter, end of frame and interframe space are not stuffed
+  bits += (8 * num_data) + 15 + bs.stuffed + 13;
+
+  return bits;
+}
+
+//
+/// move the window on to the current second and minute, clearing any that passed with no traffic
+/// must be called with the lock held
+//
+
+static void advance(unsigned long now_sec) {
+
+  unsigned long now_min = now_sec / 60;
+
+  if (now_sec - cur_sec > BUSLOAD_HISTORY_SECS) {
+    bzero(sec_bits, sizeof(sec_bits));
+    cur_bits = 0;
+    cur_sec = now_sec;
+  }
+
+  while (cur_sec < now_sec) {
+    sec_bits[cur_sec % BUSLOAD_HISTORY_SECS] = cur_bits;
+
+    if (cur_bits > busload_stats.peak_bits) {
+      busload_stats.peak_bits = cur_bits;
+    }
+
+    cur_bits = 0;
+    ++cur_sec;
+  }
+
+  if (now_min != cur_min) {
+    if (now_min - cur_min > 1) {
+      bzero(canid_frames[(now_min + 1) & 1], sizeof(canid_frames[0]));
+      bzero(opcode_frames[(now_min + 1) & 1], sizeof(opcode_frames[0]));
+    }
+
+    bzero(canid_frames[now_min & 1], sizeof(canid_frames[0]));
+    bzero(opcode_frames[now_min & 1], sizeof(opcode_frames[0]));
+    cur_min = now_min;
+  }
+
+  return;
+}
+
+//
+/// account for a frame seen on the local bus
+//
+
+void busload_frame(const twai_message_t *frame) {
+
+  unsigned int bits = busload_frame_bits(frame);
+  byte m;
+
+  portENTER_CRITICAL(&busload_mux);
+
+  advance(millis() / 1000);
+  m = cur_min & 1;
+  cur_bits += bits;
+  ++busload_stats.frames;
+
+  if (frame->flags & TWAI_MSG_FLAG_EXTD) {
+    ++busload_stats.ext_frames;
+  } else {
+    ++canid_frames[m][frame->identifier & 0x7f];
+
+    if (frame->data_length_code > 0 && !(frame->flags & TWAI_MSG_FLAG_RTR)) {
+      ++opcode_frames[m][frame->data[0]];
+    }
+  }
+
+  portEXIT_CRITICAL(&busload_mux);
+  return;
+}
+
+//
+/// bus utilisation over the last secs complete seconds, in tenths of a percent
+//
+
+unsigned int busload_pct10(byte secs) {
+
+  uint64_t bits = 0;
+  unsigned long span;
+
+  portENTER_CRITICAL(&busload_mux);
+
+  advance(millis() / 1000);
+
+  // don't average over time before we started
+  span = cur_sec - start_sec;
+
+  if (span > secs) {
+    span = secs;
+  }
+
+  for (unsigned long i = 1; i <= span; i++) {
+    bits += sec_bits[(cur_sec - i) % BUSLOAD_HISTORY_SECS];
+  }
+
+  portEXIT_CRITICAL(&busload_mux);
+
+  if (span == 0) {
+    return 0;
+  }
+
+  return (unsigned int)((bits * 1000) / ((uint64_t)span * CAN_BITRATE));
+}
+
+unsigned int busload_peak_pct10(void) {
+  return (unsigned int)(((uint64_t)busload_stats.peak_bits * 1000) / CAN_BITRATE);
+}
+
+//
+/// the busiest source CANIDs or opcodes over the current and previous minute, in descending order
+/// returns the number of entries filled, up to num
+//
+
+byte busload_top(bool by_opcode, byte *keys, unsigned long *counts, byte num) {
+
+  unsigned int size = by_opcode ? 256 : 128;
+  unsigned long c;
+  byte found = 0, j;
+
+  portENTER_CRITICAL(&busload_mux);
+  advance(millis() / 1000);
+  portEXIT_CRITICAL(&busload_mux);
+
+  // the tables are only read here, and word reads are atomic, so the lock is not held for the scan
+  for (unsigned int k = 0; k < size; k++) {
+    c = by_opcode ? (opcode_frames[0][k] + opcode_frames[1][k]) : (canid_frames[0][k] + canid_frames[1][k]);
+
+    if (c == 0 || (found == num && c <= counts[num - 1])) {
+      continue;
+    }
+
+    // insertion into the sorted list, dropping the last entry if it is full
+    j = (found < num) ? found++ : num - 1;
+
+    while (j > 0 && counts[j - 1] < c) {
+      keys[j] = keys[j - 1];
+      counts[j] = counts[j - 1];
+      --j;
+    }
+
+    keys[j] = k;
+    counts[j] = c;
+  }
+
+  return found;
+}
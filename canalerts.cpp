@@ -0,0 +1,210 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// CAN driver alert monitoring
+///
+/// a low priority task blocks waiting for driver alerts, so alerts are handled as they happen without adding work
+/// to the frame forwarding path in CAN_task; only the error and state change alerts are enabled, so the task
+/// doesn't wake for every frame sent or received
+///
+/// alerts are counted, and the time spent in the bus-off, recovering and error passive states accumulated;
+/// recovery is started as soon as the controller goes bus-off, and the driver restarted as soon as it has recovered
+///
+/// the wait is bounded, and made with the alert lock held, so the acceptance filter can reinstall the driver between waits
+//
+
+// variables declared in other source files
+extern QueueHandle_t led_cmd_queue;
+extern stats_t errors;
+
+can_alert_stats_t can_alert_stats;
+static unsigned long state_since[CAN_ALERT_NUM_STATES];      // 0 = not in this state
+static portMUX_TYPE alert_mux = portMUX_INITIALIZER_UNLOCKED;
+
+//
+/// note entering or leaving a timed state
+//
+
+static void state_enter(byte state) {
+
+  portENTER_CRITICAL(&alert_mux);
+
+  if (state_since[state] == 0) {
+    state_since[state] = millis() | 1;
+  }
+
+  portEXIT_CRITICAL(&alert_mux);
+  return;
+}
+
+static void state_leave(byte state) {
+
+  portENTER_CRITICAL(&alert_mux);
+
+  if (state_since[state] != 0) {
+    can_alert_stats.state_ms[state] += millis() - state_since[state];
+    state_since[state] = 0;
+  }
+
+  portEXIT_CRITICAL(&alert_mux);
+  return;
+}
+
+//
+/// total time spent in a state, including the time so far if it is the current state
+//
+
+unsigned long can_alert_state_ms(byte state) {
+
+  unsigned long ms;
+
+  portENTER_CRITICAL(&alert_mux);
+  ms = can_alert_stats.state_ms[state] + ((state_since[state] != 0) ? (millis() - state_since[state]) : 0);
+  portEXIT_CRITICAL(&alert_mux);
+
+  return ms;
+}
+
+void CAN_alert_task(void *params) {
+
+  uint32_t alerts;
+  esp_err_t ret;
+  led_command_t cmd;
+
+  LOG("CAN_alert_task: task starting");
+
+  for (;;) {
+
+    ret = can_driver_read_alerts(&alerts, CAN_ALERT_WAIT_TICKS);
+
+    if (ret != ESP_OK) {
+      if (ret != ESP_ERR_TIMEOUT) {
+        // the driver is not installed
+        vTaskDelay(CAN_ALERT_WAIT_TICKS);
+      }
+
+      continue;
+    }
+
+    can_alert_stats.last = alerts;
+
+    if (alerts & TWAI_ALERT_ABOVE_ERR_WARN) {
+      ++can_alert_stats.err_warn;
+      LOG("CAN_alert_task: TWAI_ALERT_ABOVE_ERR_WARN");
+    }
+
+    if (alerts & TWAI_ALERT_BELOW_ERR_WARN) {
+      LOG("CAN_alert_task: TWAI_ALERT_BELOW_ERR_WARN");
+    }
+
+    if (alerts & TWAI_ALERT_BUS_ERROR) {
+      ++can_alert_stats.bus_error;
+    }
+
+    if (alerts & TWAI_ALERT_TX_FAILED) {
+      ++can_alert_stats.tx_failed;
+    }
+
+    if (alerts & TWAI_ALERT_RX_QUEUE_FULL) {
+      ++can_alert_stats.rx_queue_full;
+      ++errors.can_rx;
+      LOG("CAN_alert_task: TWAI_ALERT_RX_QUEUE_FULL");
+      PULSE_LED(ERR_IND_LED);
+    }
+
+    if (alerts & TWAI_ALERT_ERR_PASS) {
+      ++can_alert_stats.err_passive;
+      state_enter(CAN_ALERT_ERR_PASSIVE);
+      LOG("CAN_alert_task: TWAI_ALERT_ERR_PASS");
+    }
+
+    if (alerts & TWAI_ALERT_ERR_ACTIVE) {
+      state_leave(CAN_ALERT_ERR_PASSIVE);
+      LOG("CAN_alert_task: TWAI_ALERT_ERR_ACTIVE");
+    }
+
+    if (alerts & TWAI_ALERT_BUS_OFF) {
+      ++can_alert_stats.bus_off;
+      state_leave(CAN_ALERT_ERR_PASSIVE);
+      state_enter(CAN_ALERT_BUS_OFF);
+      LOG("CAN_alert_task: TWAI_ALERT_BUS_OFF, initiating recovery");
+
+      cmd = { ERR_IND_LED, LED_FAST_BLINK, 0 };
+      xQueueSend(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT);
+
+      ret = twai_initiate_recovery();
+      VLOG("CAN_alert_task: bus recovery returns %d", ret);
+      log_esp_now_err(ret);
+    }
+
+    if (alerts & TWAI_ALERT_RECOVERY_IN_PROGRESS) {
+      state_leave(CAN_ALERT_BUS_OFF);
+      state_enter(CAN_ALERT_RECOVERING);
+      LOG("CAN_alert_task: TWAI_ALERT_RECOVERY_IN_PROGRESS");
+    }
+
+    if (alerts & TWAI_ALERT_BUS_RECOVERED) {
+      ++can_alert_stats.recovered;
+      state_leave(CAN_ALERT_BUS_OFF);
+      state_leave(CAN_ALERT_RECOVERING);
+      LOG("CAN_alert_task: TWAI_ALERT_BUS_RECOVERED, restarting CAN driver");
+
+      // the driver is stopped after recovery
+      ret = twai_start();
+      VLOG("CAN_alert_task: start returns %d", ret);
+      log_esp_now_err(ret);
+
+      if (ret == ESP_OK) {
+        cmd = { ERR_IND_LED, LED_OFF, 0 };
+      } else {
+        cmd = { ERR_IND_LED, LED_FAST_BLINK, 0 };
+      }
+
+      xQueueSend(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT);
+    }
+  }  // for (;;)
+}
@@ -0,0 +1,429 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// CAN acceptance filter
+///
+/// the controller has a single acceptance filter, a code and mask over the 11-bit ID, the RTR bit and the first two
+/// data bytes of a standard frame, or the 29-bit ID and RTR bit of an extended frame; frames it rejects never reach
+/// the driver, so cost no interrupt, receive queue slot or copy
+///
+/// the frame types and opcodes wanted are taken from the router subscriptions of the queues CAN_task sends to, with
+/// their enable predicates, plus the frames CAN_task itself uses on a slave; the filter is reprogrammed when these
+/// change, at once if it must accept more, and only after they have been stable for CAN_FILTER_HOLD_MS if it can
+/// accept less, so a GC client connecting and disconnecting doesn't restart the driver each time
+///
+/// in practice the CBUS task, and a slave's cab, want every standard frame, so the useful case is rejecting extended
+/// frames, e.g. a firmware upload from FCU, when nothing is listening for them
+///
+/// the filter can only be set when the driver is installed, so reprogramming stops, uninstalls and reinstalls it;
+/// CAN_task does this between frames, CAN_tx_task holds the driver lock while it is passing frames to the driver,
+/// and CAN_alert_task holds the alert lock while it waits for alerts
+//
+
+// variables declared in other source files
+extern config_t config_data;
+
+static twai_general_config_t g_config;
+static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_125KBITS();
+static const twai_filter_config_t accept_all = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+static twai_filter_config_t installed;          // the filter the driver is running with
+static twai_filter_config_t wanted;             // the filter last computed from the wanted frames
+static byte wanted_types, wanted_opcodes[32];
+static bool wanted_empty = true;
+static unsigned long wanted_since;
+static SemaphoreHandle_t can_driver_mutex, can_alert_mutex;
+
+can_filter_stats_t can_filter_stats;
+
+//
+/// the queues CAN_task sends received frames to
+//
+
+uint16_t can_rx_queues(void) {
+
+  uint16_t queues = QUEUE_NET_OUT;
+
+  if (config_data.role == ROLE_MASTER) {
+    queues |= QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL;
+  }
+
+  return queues;
+}
+
+//
+/// install and start the CAN driver, initially accepting all frames
+/// called from setup, before the tasks have subscribed to anything
+//
+
+void can_driver_install(void) {
+
+  esp_err_t iret;
+
+  can_driver_mutex = xSemaphoreCreateMutex();
+  can_alert_mutex = xSemaphoreCreateMutex();
+
+  g_config.mode = TWAI_MODE_NORMAL;
+  g_config.tx_io = (gpio_num_t)CAN_TX_PIN;
+  g_config.rx_io = (gpio_num_t)CAN_RX_PIN;
+  g_config.clkout_io = (gpio_num_t)TWAI_IO_UNUSED;
+  g_config.bus_off_io = (gpio_num_t)TWAI_IO_UNUSED;
+  g_config.tx_queue_len = CAN_QUEUE_DEPTH;
+  g_config.rx_queue_len = CAN_QUEUE_DEPTH;
+  g_config.alerts_enabled = CAN_ALERTS_ENABLED;
+  g_config.clkout_divider = 0;
+
+  VLOG("setup: TWAI queue depth = %d\n", CAN_QUEUE_DEPTH);
+
+  installed = accept_all;
+  wanted = accept_all;
+  wanted_since = millis();
+  memset(wanted_opcodes, 0xff, sizeof(wanted_opcodes));
+  wanted_types = 0x0f;
+
+  // install TWAI driver
+  iret = twai_driver_install(&g_config, &t_config, &installed);
+
+  if (iret == ESP_OK) {
+    LOG("setup: TWAI driver installed ok");
+  } else {
+    LOG("setup: error installing TWAI driver");
+    log_esp_now_err(iret);
+  }
+
+  // start CAN driver
+  iret = twai_start();
+
+  if (iret == ESP_OK) {
+    LOG("setup: TWAI driver started ok");
+  } else {
+    LOG("setup: error starting TWAI driver");
+    log_esp_now_err(iret);
+  }
+
+  return;
+}
+
+//
+/// serialise use of the driver with reprogramming the filter
+//
+
+void can_driver_lock(void) {
+  xSemaphoreTake(can_driver_mutex, QUEUE_OP_TIMEOUT_INFINITE);
+}
+
+void can_driver_unlock(void) {
+  xSemaphoreGive(can_driver_mutex);
+}
+
+//
+/// wait for driver alerts, holding the alert lock, so that the driver isn't uninstalled under the waiting task
+//
+
+esp_err_t can_driver_read_alerts(uint32_t *alerts, TickType_t ticks) {
+
+  esp_err_t ret;
+
+  xSemaphoreTake(can_alert_mutex, QUEUE_OP_TIMEOUT_INFINITE);
+  ret = twai_read_alerts(alerts, ticks);
+  xSemaphoreGive(can_alert_mutex);
+
+  return ret;
+}
+
+//
+/// returns true if the filter would pass this frame, as the controller does in single filter mode
+/// bits 19..16 are not used for standard frames, nor bits 1..0 for extended frames
+/// data bytes the frame doesn't have are not compared
+//
+
+static bool filter_match(const twai_filter_config_t *f, const twai_message_t *frame) {
+
+  uint32_t word, care = ~f->acceptance_mask;
+
+  if (frame->flags & TWAI_MSG_FLAG_EXTD) {
+    word = (frame->identifier << 3) | ((frame->flags & TWAI_MSG_FLAG_RTR) ? (1UL << 2) : 0);
+    care &= 0xfffffffc;
+  } else {
+    word = (frame->identifier << 21) | ((frame->flags & TWAI_MSG_FLAG_RTR) ? (1UL << 20) : 0);
+    care &= 0xfff0ffff;
+
+    if (frame->data_length_code >= 1) {
+      word |= (uint32_t)frame->data[0] << 8;
+    } else {
+      care &= 0xffff00ff;
+    }
+
+    if (frame->data_length_code >= 2) {
+      word |= frame->data[1];
+    } else {
+      care &= 0xffffff00;
+    }
+  }
+
+  return ((word ^ f->acceptance_code) & care) == 0;
+}
+
+//
+/// returns true if every frame accepted by b is also accepted by a
+//
+
+static bool filter_covers(const twai_filter_config_t *a, const twai_filter_config_t *b) {
+
+  uint32_t care_a = ~a->acceptance_mask, care_b = ~b->acceptance_mask;
+
+  return ((care_a & ~care_b) == 0) && (((a->acceptance_code ^ b->acceptance_code) & care_a) == 0);
+}
+
+static bool filter_equal(const twai_filter_config_t *a, const twai_filter_config_t *b) {
+  return (a->acceptance_code == b->acceptance_code && a->acceptance_mask == b->acceptance_mask);
+}
+
+//
+/// compute the narrowest filter that passes every frame the local consumers want
+/// frame type bits are as the router's: 0 = standard, 1 = extended, 2 = standard RTR, 3 = extended RTR
+//
+
+static void filter_compute(twai_filter_config_t *f) {
+
+  uint32_t code, mask;
+  byte opc_and = 0xff, opc_or = 0;
+  unsigned int num_opcodes = 0;
+
+  wanted_empty = router_wanted(can_rx_queues(), &wanted_types, wanted_opcodes);
+
+  // a slave learns its cab's CANID and session, and times out on inactivity, from all its standard frames
+  if (config_data.role == ROLE_SLAVE) {
+    wanted_types |= 0x05;
+    wanted_empty = true;
+    memset(wanted_opcodes, 0xff, sizeof(wanted_opcodes));
+  }
+
+  *f = accept_all;
+
+  // any filter that narrows standard frames would also reject extended frames at random
+  if (wanted_types & 0x0a) {
+    return;
+  }
+
+  // reject extended frames, using bits that are not compared for standard frames
+  code = (uint32_t)CAN_FILTER_EXT_REJECT << 16;
+  mask = ~0x000f0000UL;
+
+  // RTR bit
+  if (!(wanted_types & 0x04)) {
+    mask &= ~(1UL << 20);
+  } else if (!(wanted_types & 0x01)) {
+    code |= (1UL << 20);
+    mask &= ~(1UL << 20);
+  }
+
+  // opcode, only if frames with no payload are not wanted, and only the bits common to every wanted opcode
+  if (!wanted_empty) {
+    for (unsigned int i = 0; i < 256; i++) {
+      if (bitRead(wanted_opcodes[i >> 3], i & 7)) {
+        opc_and &= i;
+        opc_or |= i;
+        ++num_opcodes;
+      }
+    }
+
+    if (num_opcodes > 0) {
+      code |= (uint32_t)opc_and << 8;
+      mask &= ~((uint32_t)(~(opc_and ^ opc_or) & 0xff) << 8);
+    }
+  }
+
+  f->acceptance_code = code;
+  f->acceptance_mask = mask;
+  f->single_filter = true;
+
+  return;
+}
+
+//
+/// reinstall the driver with a new filter
+/// returns false if the driver is busy and this should be tried again later
+//
+
+static bool filter_apply(const twai_filter_config_t *f) {
+
+  twai_status_info_t can_status;
+  esp_err_t ret;
+
+  // the alert task's wait is bounded, so this is not held up for long
+  xSemaphoreTake(can_alert_mutex, QUEUE_OP_TIMEOUT_INFINITE);
+  can_driver_lock();
+  twai_get_status_info(&can_status);
+
+  // don't discard frames waiting in the driver, or interrupt bus-off recovery
+  if (can_status.state != TWAI_STATE_RUNNING || can_status.msgs_to_tx > 0 || can_status.msgs_to_rx > 0) {
+    can_driver_unlock();
+    xSemaphoreGive(can_alert_mutex);
+    return false;
+  }
+
+  twai_stop();
+  twai_driver_uninstall();
+
+  ret = twai_driver_install(&g_config, &t_config, f);
+
+  if (ret == ESP_OK) {
+    installed = *f;
+  } else {
+    LOG("can_filter: error reinstalling TWAI driver, reverting to accept all");
+    log_esp_now_err(ret);
+    PULSE_LED(ERR_IND_LED);
+    ++can_filter_stats.failures;
+    installed = accept_all;
+    twai_driver_install(&g_config, &t_config, &installed);
+  }
+
+  ret = twai_start();
+
+  if (ret != ESP_OK) {
+    LOG("can_filter: error restarting TWAI driver");
+    log_esp_now_err(ret);
+    PULSE_LED(ERR_IND_LED);
+  }
+
+  can_driver_unlock();
+  xSemaphoreGive(can_alert_mutex);
+
+  ++can_filter_stats.reprograms;
+  VLOG("can_filter: acceptance code = 0x%08x, mask = 0x%08x", installed.acceptance_code, installed.acceptance_mask);
+
+  return true;
+}
+
+//
+/// called periodically by CAN_task, between frames
+//
+
+void can_filter_poll(void) {
+
+  static unsigned long ptimer = millis();
+  static unsigned long last = millis();
+  twai_filter_config_t f;
+  unsigned long now = millis();
+
+  if (can_filter_is_open()) {
+    can_filter_stats.open_ms += now - last;
+  } else {
+    can_filter_stats.narrowed_ms += now - last;
+  }
+
+  last = now;
+
+  if (now - ptimer < CAN_FILTER_POLL_MS) {
+    return;
+  }
+
+  ptimer = now;
+  filter_compute(&f);
+
+  if (!filter_equal(&f, &wanted)) {
+    wanted = f;
+    wanted_since = now;
+  }
+
+  if (filter_equal(&wanted, &installed)) {
+    return;
+  }
+
+  // accept more at once; accept less only once the wanted frames have settled
+  if (filter_covers(&installed, &wanted) && now - wanted_since < CAN_FILTER_HOLD_MS) {
+    return;
+  }
+
+  filter_apply(&wanted);
+  return;
+}
+
+//
+/// called by CAN_task for each frame received
+/// returns false if no consumer wants the frame, which counts as dropped in software
+//
+
+bool can_filter_account(const twai_message_t *frame) {
+
+  bool want;
+  byte type = ((frame->flags & TWAI_MSG_FLAG_EXTD) ? 1 : 0) | ((frame->flags & TWAI_MSG_FLAG_RTR) ? 2 : 0);
+
+  if (frame->data_length_code > 0 && frame->data_length_code <= 8) {
+    want = bitRead(wanted_types, type) && bitRead(wanted_opcodes[frame->data[0] >> 3], frame->data[0] & 7);
+  } else {
+    want = bitRead(wanted_types, type) && wanted_empty;
+  }
+
+  if (!want) {
+    ++can_filter_stats.sw_dropped;
+
+    if (can_filter_is_open() && !filter_match(&wanted, frame)) {
+      ++can_filter_stats.rejectable_open;
+    }
+  }
+
+  return want;
+}
+
+bool can_filter_is_open(void) {
+  return filter_equal(&installed, &accept_all);
+}
+
+//
+/// the controller doesn't count the frames it rejects, so estimate them from the rate of rejectable frames seen
+/// while the filter was open
+//
+
+unsigned long can_filter_hw_estimate(void) {
+
+  if (can_filter_stats.open_ms == 0) {
+    return 0;
+  }
+
+  return (unsigned long)((uint64_t)can_filter_stats.rejectable_open * can_filter_stats.narrowed_ms / can_filter_stats.open_ms);
+}
@@ -86,7 +86,7 @@ void indicate_cbus_mode(byte mode);
 
 void cbus_task(void *params) {
 
-  twai_message_t cf, of;
+  twai_message_t cf = {}, of = {};
   unsigned long ptimer = millis();
   uint16_t nn;
   byte rcanid;
@@ -145,6 +145,10 @@ void cbus_task(void *params) {
   xQueueAddToSet(cbus_in_queue, queue_set);
   xQueueAddToSet(cbus_internal, queue_set);
 
+  // subscribe to all frames from both sources; extended frames are ignored, so not subscribed to from the external bus
+  router_subscribe(QUEUE_CBUS_EXTERNAL, NULL, 0, ROUTE_FRAME_STD | ROUTE_FRAME_RTR, NULL);
+  router_subscribe(QUEUE_CBUS_INTERNAL, NULL, 0, ROUTE_FRAME_ALL, NULL);
+
   /// main loop
 
   for (;;) {
@@ -195,7 +199,7 @@ void cbus_task(void *params) {
     //
 
     if (enum_required) {
-      LOG("cbus_task: enumeration required flag has been set");
+      LOGI(LOG_MOD_CBUS, "cbus_task: enumeration required flag has been set");
       enum_required = false;
       enumerate_can_bus();
     }
@@ -218,7 +222,7 @@ void cbus_task(void *params) {
         vTaskDelay((TickType_t)5);
       }
 
-      VLOG("cbus_task: enumeration response sent, my CANID = %d", config_data.CANID);
+      LOGD(LOG_MOD_CBUS, "cbus_task: enumeration response sent, my CANID = %d", config_data.CANID);
       respond_to_enum = false;
     }
 
@@ -230,7 +234,7 @@ void cbus_task(void *params) {
       byte free_id, selected_id = 0;
       int8_t proxy_idx = -1;
 
-      LOG("cbus_task: end of enumeration cycle");
+      LOGD(LOG_MOD_CBUS, "cbus_task: end of enumeration cycle");
       enum_in_progress = false;
 
       for (byte i = 0; i < 16; i++) {
@@ -267,17 +271,18 @@ enum_done:
       config_data.CANID = selected_id;
       save_config();
 
-      char ptmp[8], pbuff[32];
+      char ptmp[8], pbuff[(MAX_NET_PEERS * 4) + 1];
+      pbuff[0] = 0;
 
       for (byte i = 0; i < MAX_NET_PEERS; i++) {
         sprintf(ptmp, "%d ", proxy_canids[i]);
         strcat(pbuff, ptmp);
       }
 
-      VLOG("cbus_task: proxy CANIDs = %s", proxy_canids);
+      VLOG("cbus_task: proxy CANIDs = %s", pbuff);
 
       // send NNACK
-      twai_message_t ack;
+      twai_message_t ack = {};
       ack.identifier = make_can_header();
       ack.data_length_code = 3;
       ack.data[0] = OPC_NNACK;
@@ -295,7 +300,7 @@ enum_done:
     if (active_queue != NULL) {
 
       // get the next message from the active queue
-      xQueueReceive(active_queue, &cf, QUEUE_OP_TIMEOUT);
+      frame_pool_receive(active_queue, &cf, QUEUE_OP_TIMEOUT);
 
       if (active_queue == cbus_in_queue) {
         // VLOG("cbus_task: message from external CAN bus, %s", format_CAN_frame(&cf));
@@ -312,8 +317,8 @@ enum_done:
 
       if (!enum_in_progress) {
         if (((cf.identifier & 0x7f) == config_data.CANID) && active_queue == cbus_in_queue) {
-          VLOG("cbus_task: my CANID %d clashes with another node, will re-enumerate", (cf.identifier & 0x7f));
-          VLOG("cbus_task: %s", format_CAN_frame(&cf));
+          LOGW(LOG_MOD_CBUS, "cbus_task: my CANID %d clashes with another node, will re-enumerate", (cf.identifier & 0x7f));
+          LOGW(LOG_MOD_CBUS, "cbus_task: %s", format_CAN_frame(&cf));
           enum_required = true;
         }
       }
@@ -542,7 +547,7 @@ enum_done:
 
           case OPC_RSTAT:
             // command station proxy replies to this, if it is running
-            LOG("cbus_task: command station proxy will respond to this RSTAT request");
+            LOGD(LOG_MOD_CBUS, "cbus_task: command station proxy will respond to this RSTAT request");
             break;
 
           case OPC_ARST:
@@ -571,7 +576,7 @@ enum_done:
 
 void enumerate_can_bus(void) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   LOG("cbus_task: enumerate_can_bus: initiating bus enumeration");
 
@@ -623,7 +628,7 @@ void send_message_to_queues(twai_message_t *cf) {
   uint16_t queues = QUEUE_CAN_OUT_FROM_NET | QUEUE_NET_OUT | QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN;
 
   if (!send_message_to_queues(queues, cf, "cbus_task", QUEUE_OP_TIMEOUT_LONG)) {
-    LOG("cbus_task: error queuing message");
+    LOGE(LOG_MOD_CBUS, "cbus_task: error queuing message");
     PULSE_LED(ERR_IND_LED);
   }
 
@@ -632,9 +637,9 @@ void send_message_to_queues(twai_message_t *cf) {
 
 void send_WRACK(void) {
 
-  twai_message_t of;
+  twai_message_t of = {};
 
-  LOG("cbus_task: sending WRACK");
+  LOGD(LOG_MOD_CBUS, "cbus_task: sending WRACK");
   of.identifier = make_can_header();
   of.data_length_code = 3;
   of.data[0] = OPC_WRACK;
@@ -646,9 +651,9 @@ void send_WRACK(void) {
 
 void send_CMDERR(byte num) {
 
-  twai_message_t of;
+  twai_message_t of = {};
 
-  LOG("cbus_task: sending CMDERR");
+  LOGD(LOG_MOD_CBUS, "cbus_task: sending CMDERR");
   of.identifier = make_can_header();
   of.data_length_code = 4;
   of.data[0] = OPC_CMDERR;
@@ -661,7 +666,7 @@ void send_CMDERR(byte num) {
 
 void transition_to_flim(void) {
 
-  twai_message_t of;
+  twai_message_t of = {};
 
   if (in_transition) {
     LOG("cbus_task: FLiM transition already in progress");
@@ -735,10 +740,10 @@ void indicate_cbus_mode(byte mode) {
 
 void send_cbus_battery_message(int i) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
   uint16_t queues;
 
-  VLOG("cbus_task: sending battery messages for peer = %d", i);
+  LOGD(LOG_MOD_CBUS, "cbus_task: sending battery messages for peer = %d", i);
   cf.identifier = make_can_header();
   cf.data_length_code = 8;
   cf.data[0] = OPC_ACDAT;
@@ -753,7 +758,7 @@ void send_cbus_battery_message(int i) {
     queues = QUEUE_CAN_OUT_FROM_NET | QUEUE_NET_OUT | QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN;
 
     if (!send_message_to_queues(queues, &cf, "cbus_task", QUEUE_OP_TIMEOUT)) {
-      LOG("cbus_task: error queuing battery mv message");
+      LOGE(LOG_MOD_CBUS, "cbus_task: error queuing battery mv message");
       PULSE_LED(ERR_IND_LED);
     }
   }
@@ -768,7 +773,7 @@ void send_cbus_battery_message(int i) {
     queues = QUEUE_CAN_OUT_FROM_NET | QUEUE_NET_OUT | QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN;
 
     if (!send_message_to_queues(queues, &cf, "cbus_task", QUEUE_OP_TIMEOUT)) {
-      LOG("cbus_task: error queuing battery soc message");
+      LOGE(LOG_MOD_CBUS, "cbus_task: error queuing battery soc message");
       PULSE_LED(ERR_IND_LED);
     }
   }
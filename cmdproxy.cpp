@@ -115,6 +115,10 @@ void cmdproxy_task(void *params) {
     vTaskSuspend(NULL);
   }
 
+  // subscribe to the CANCMD command opcodes we handle
+  static const byte proxy_opcodes[] = { OPC_RLOC, OPC_GLOC, OPC_KLOC, OPC_ALOC, OPC_DKEEP, OPC_DSPD, OPC_DFUN, OPC_RSTAT, OPC_RTON, OPC_RTOF };
+  router_subscribe(QUEUE_CMDPROXY_IN, proxy_opcodes, sizeof(proxy_opcodes), ROUTE_FRAME_STD, NULL);
+
   // init session table
   bzero(session_tab, sizeof(session_tab));
 
@@ -144,7 +148,7 @@ void cmdproxy_task(void *params) {
     /// receive and interpret CBUS messages from CANCABs and translate to DCC++ messages
     //
 
-    if (xQueueReceive(cmdproxy_queue, &cf, QUEUE_OP_TIMEOUT) == pdTRUE) {
+    if (frame_pool_receive(cmdproxy_queue, &cf, QUEUE_OP_TIMEOUT) == pdTRUE) {
       // VLOG("cmdproxy_task: got CAN message %s", format_CAN_frame(&cf));
 
       switch (cf.data[0]) {
@@ -276,18 +280,18 @@ void cmdproxy_task(void *params) {
           break;
 
         case OPC_DKEEP:
-          VLOG("cmd_proxy: got DKEEP keepalive for session = %d", cf.data[1]);
+          LOGV(LOG_MOD_PROXY, "cmd_proxy: got DKEEP keepalive for session = %d", cf.data[1]);
           if (session_tab[cf.data[1] - 1].active) {
             session_tab[cf.data[1] - 1].last_activity = millis();
           }
           break;
 
         case OPC_DSPD:          // <0x47><Session><Speed/Dir>
-          VLOG("cmdproxy_task: got DSPD for session = %d, speed/dir = %d", cf.data[1], cf.data[2]);
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: got DSPD for session = %d, speed/dir = %d", cf.data[1], cf.data[2]);
           i = cf.data[1] - 1;
 
           if (i > MAX_PROXY_SESSIONS) {
-            VLOG("cmdproxy_task: error: DSPD opcode, session = %d out of range", cf.data[1]);
+            LOGW(LOG_MOD_PROXY, "cmdproxy_task: error: DSPD opcode, session = %d out of range", cf.data[1]);
             send_cbus_session_error(1, &cf);     // no slots/session error
           } else {
 
@@ -301,7 +305,7 @@ void cmdproxy_task(void *params) {
             session_tab[i].last_activity = millis();
             session_tab[i].CANID = (cf.identifier & 0x7f);
 
-            VLOG("cmdproxy_task: sending DCC+ command, slot = %d, sess = %d, loco addr = %d, speed = %d, dir = %d", i, session_tab[i].cbus_session_num, \
+            LOGD(LOG_MOD_PROXY, "cmdproxy_task: sending DCC+ command, slot = %d, sess = %d, loco addr = %d, speed = %d, dir = %d", i, session_tab[i].cbus_session_num, \
                  session_tab[i].loco_addr, session_tab[i].speed, session_tab[i].direction);
             snprintf(buffer, sizeof(buffer), "<t %d %d %d %d>", session_tab[i].cbus_session_num, session_tab[i].loco_addr, session_tab[i].speed, \
                      session_tab[i].direction);
@@ -311,11 +315,11 @@ void cmdproxy_task(void *params) {
           break;
 
         case OPC_DFUN:        // <0x60><Session><FR><Fn byte>
-          VLOG("cmdproxy_task: got DFUN for session = %d, fr = %d, fn = %d", cf.data[1], cf.data[2], cf.data[3]);
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: got DFUN for session = %d, fr = %d, fn = %d", cf.data[1], cf.data[2], cf.data[3]);
           i = cf.data[1] - 1;
 
           if (i > MAX_PROXY_SESSIONS) {
-            VLOG("cmdproxy_task: error: DFUN opcode, session = %d out of rangee", cf.data[1]);
+            LOGW(LOG_MOD_PROXY, "cmdproxy_task: error: DFUN opcode, session = %d out of rangee", cf.data[1]);
             send_cbus_session_error(1, &cf);     // no slots/session error
           } else {
 
@@ -328,7 +332,7 @@ void cmdproxy_task(void *params) {
             session_tab[i].CANID = (cf.identifier & 0x7f);
 
             // <f CAB BYTE1 [BYTE2]>
-            VLOG("cmdproxy_task: sending DCC+ command, slot = %d, loco addr = %d", i, session_tab[i].loco_addr);
+            LOGD(LOG_MOD_PROXY, "cmdproxy_task: sending DCC+ command, slot = %d, loco addr = %d", i, session_tab[i].loco_addr);
             snprintf(buffer, sizeof(buffer), "<f %d %d %d>", session_tab[i].loco_addr, cf.data[2], cf.data[3]);
             send_dccpp_command(buffer);
           }
@@ -388,7 +392,7 @@ void cmdproxy_task(void *params) {
       if (msgbuf_proxy_in.head != msgbuf_proxy_in.tail) {
         strncpy(buffer, msgbuf_proxy_in.buffer[msgbuf_proxy_in.tail], PROXY_BUF_LEN);
         msgbuf_proxy_in.tail = (msgbuf_proxy_in.tail + 1) % NUM_PROXY_CMDS;
-        VLOG("cmdproxy_task: new data from dccppser task = %s", buffer);
+        LOGD(LOG_MOD_PROXY, "cmdproxy_task: new data from dccppser task = %s", buffer);
         got_message = true;
       }
       xSemaphoreGive(mtx_proxy);
@@ -400,13 +404,13 @@ void cmdproxy_task(void *params) {
 
     if (got_message) {
       got_message = false;
-      VLOG("cmdproxy_task: translating and dispatching message = %s", buffer);
+      LOGD(LOG_MOD_PROXY, "cmdproxy_task: translating and dispatching message = %s", buffer);
 
       switch (buffer[1]) {          // reponse to register/speed/dir request
         case 'T':                   // <T REGISTER SPEED DIRECTION>
-          VLOG("cmdproxy_task: got loco register response = |%s|", buffer);
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: got loco register response = |%s|", buffer);
           ntokens = sscanf(buffer + 2, "%d %d %d %d", &treg, &taddr, &tspeed, &tdir);
-          VLOG("cmdproxy_task: parsed %d tokens from DCC++ message = |%s| to %h, %d, %h, %h", ntokens, buffer, treg, taddr, tspeed, tdir);
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: parsed %d tokens from DCC++ message = |%s| to %h, %d, %h, %h", ntokens, buffer, treg, taddr, tspeed, tdir);
           i = treg - 1;
 
           if (i < MAX_PROXY_SESSIONS) {
@@ -429,7 +433,7 @@ void cmdproxy_task(void *params) {
             of.data[7] = 0;                   // Fn3
             send_CAN_message(&of);
           } else {
-            VLOG("cmdproxy_task: error: session %d is out of range", treg);
+            LOGW(LOG_MOD_PROXY, "cmdproxy_task: error: session %d is out of range", treg);
           }
           break;
 
@@ -455,7 +459,7 @@ void cmdproxy_task(void *params) {
 
         case 'a':
           track_current = atol(&buffer[3]);
-          VLOG("cmdproxy_task: DCC++ track current = %d, %d%%", track_current, (track_current * 100) / 1024);
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: DCC++ track current = %d, %d%%", track_current, (track_current * 100) / 1024);
           break;
 
         case 'i':
@@ -490,7 +494,7 @@ void cmdproxy_task(void *params) {
 
       for (j = 0; j < MAX_PROXY_SESSIONS; j++) {
         if (session_tab[j].active || session_tab[j].loco_addr > 0) {
-          VLOG("cmdproxy_task: [%d] in use = %d, addr = %d, speed = %d, dir = %d, ack = %d, CANID = %d, since activity = %d", session_tab[j].cbus_session_num, session_tab[j].active, \
+          LOGD(LOG_MOD_PROXY, "cmdproxy_task: [%d] in use = %d, addr = %d, speed = %d, dir = %d, ack = %d, CANID = %d, since activity = %d", session_tab[j].cbus_session_num, session_tab[j].active, \
                session_tab[j].loco_addr, session_tab[j].speed, session_tab[j].direction, session_tab[j].session_ack, session_tab[j].CANID, millis() - session_tab[j].last_activity);
         }
 
@@ -503,7 +507,7 @@ void cmdproxy_task(void *params) {
         }
       }
 
-      VLOG("cmdproxy_task: num sessions, active = %d, dispatched = %d", num_active, num_dispatched);
+      LOGI(LOG_MOD_PROXY, "cmdproxy_task: num sessions, active = %d, dispatched = %d", num_active, num_dispatched);
     }
   }   // for (;;)
 }
@@ -514,7 +518,7 @@ void cmdproxy_task(void *params) {
 
 void send_dccpp_command(char cmd[]) {
 
-  VLOG("cmdproxy_task: send_dccpp_command: sending DCC++ command = %s to proxy task", cmd);
+  LOGD(LOG_MOD_PROXY, "cmdproxy_task: send_dccpp_command: sending DCC++ command = %s to proxy task", cmd);
 
   while (xSemaphoreTake(mtx_proxy, QUEUE_OP_TIMEOUT) != pdTRUE);
   strncpy(msgbuf_proxy_out.buffer[msgbuf_proxy_out.head], cmd, PROXY_BUF_LEN);
@@ -530,12 +534,12 @@ void send_dccpp_command(char cmd[]) {
 
 void send_CAN_message(twai_message_t *frame) {
 
-  VLOG("cmdproxy_task: send_CAN_message: sending CAN message = %s", format_CAN_frame(frame));
+  LOGD(LOG_MOD_PROXY, "cmdproxy_task: send_CAN_message: sending CAN message = %s", format_CAN_frame(frame));
 
   uint16_t queues = QUEUE_CAN_OUT_FROM_NET | QUEUE_NET_OUT | QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CBUS_INTERNAL;
 
   if (!send_message_to_queues(queues, frame, "cmdproxy_task", QUEUE_OP_TIMEOUT_NONE)) {
-    LOG("cmdproxy_task: error queuing message");
+    LOGE(LOG_MOD_PROXY, "cmdproxy_task: error queuing message");
     PULSE_LED(ERR_IND_LED);
   }
 
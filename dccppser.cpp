@@ -124,18 +124,18 @@ void dccppser_task(void *params) {
 
           switch (num_read) {
             case -1:
-              VLOG("dccppser_task: error reading from net client, errno = %d", errno);
+              LOGE(LOG_MOD_PROXY, "dccppser_task: error reading from net client, errno = %d", errno);
               PULSE_LED(ERR_IND_LED);
               ++errs;
               break;
 
             case 0:
-              LOG("dccppser_task: read 0 bytes from net client");
+              LOGW(LOG_MOD_PROXY, "dccppser_task: read 0 bytes from net client");
               break;
 
             default:
               net_client.input[num_read] = 0;
-              VLOG("dccppser_task: read %d bytes from net client, input = |%s|", num_read, net_client.input);
+              LOGD(LOG_MOD_PROXY, "dccppser_task: read %d bytes from net client, input = |%s|", num_read, net_client.input);
               Serial2.write(net_client.input);
               PULSE_LED(NET_ACT_LED);
               netrx += num_read;
@@ -158,7 +158,7 @@ void dccppser_task(void *params) {
 
     if (xSemaphoreTake(mtx_wi, QUEUE_OP_TIMEOUT) == pdTRUE) {
       if (msgbuf_wi_out.head != msgbuf_wi_out.tail) {
-        VLOG("dccppser_task: got new message from withrottle task at buffer = %d, msg = %s", msgbuf_wi_out.head, msgbuf_wi_out.buffer[msgbuf_wi_out.tail]);
+        LOGD(LOG_MOD_PROXY, "dccppser_task: got new message from withrottle task at buffer = %d, msg = %s", msgbuf_wi_out.head, msgbuf_wi_out.buffer[msgbuf_wi_out.tail]);
         Serial2.write(msgbuf_wi_out.buffer[msgbuf_wi_out.tail]);
         msgbuf_wi_out.tail = (msgbuf_wi_out.tail + 1 ) % NUM_PROXY_CMDS;
         ++msgrx;
@@ -171,7 +171,7 @@ void dccppser_task(void *params) {
 
     if (xSemaphoreTake(mtx_proxy, QUEUE_OP_TIMEOUT) == pdTRUE) {
       if (msgbuf_proxy_out.head != msgbuf_proxy_out.tail) {
-        VLOG("dccppser_task: got new message from proxy task at buffer = %d, msg = %s", msgbuf_proxy_out.head, msgbuf_proxy_out.buffer[msgbuf_proxy_out.tail]);
+        LOGD(LOG_MOD_PROXY, "dccppser_task: got new message from proxy task at buffer = %d, msg = %s", msgbuf_proxy_out.head, msgbuf_proxy_out.buffer[msgbuf_proxy_out.tail]);
         Serial2.write(msgbuf_proxy_out.buffer[msgbuf_proxy_out.tail]);
         msgbuf_proxy_out.tail = (msgbuf_proxy_out.tail + 1 ) % NUM_PROXY_CMDS;
         ++msgrx;
@@ -207,21 +207,21 @@ void dccppser_task(void *params) {
         case '>':
           buffer[idx++] = c;
           buffer[idx] = 0;
-          VLOG("dccppser_task: received response from DCC++ = %s", buffer);
+          LOGD(LOG_MOD_PROXY, "dccppser_task: received response from DCC++ = %s", buffer);
 
           while (xSemaphoreTake(mtx_wi, QUEUE_OP_TIMEOUT) != pdTRUE);
           strncpy(msgbuf_wi_in.buffer[msgbuf_wi_in.head], buffer, PROXY_BUF_LEN);
           msgbuf_wi_in.head = (msgbuf_wi_in.head + 1) % NUM_PROXY_CMDS;
           xSemaphoreGive(mtx_wi);
           ++msgtx;
-          LOG("dccppser_task: wrote line to withrottle input buffer");
+          LOGD(LOG_MOD_PROXY, "dccppser_task: wrote line to withrottle input buffer");
 
           while (xSemaphoreTake(mtx_proxy, QUEUE_OP_TIMEOUT) != pdTRUE);
           strncpy(msgbuf_proxy_in.buffer[msgbuf_proxy_in.head], buffer, PROXY_BUF_LEN);
           msgbuf_proxy_in.head = (msgbuf_proxy_in.head + 1) % NUM_PROXY_CMDS;
           xSemaphoreGive(mtx_proxy);
           ++msgtx;
-          LOG("dccppser_task: wrote line to proxy input buffer");
+          LOGD(LOG_MOD_PROXY, "dccppser_task: wrote line to proxy input buffer");
 
           break;
 
@@ -241,7 +241,7 @@ void dccppser_task(void *params) {
     //
 
     if (millis() - stimer >= 10000UL) {
-      VLOG("dccppser_task: nettx = %d, netrx = %d, msgtx = %d, msgrx = %d, net client = %d", nettx, netrx, msgtx, msgrx, net_client.client != NULL);
+      LOGI(LOG_MOD_PROXY, "dccppser_task: nettx = %d, netrx = %d, msgtx = %d, msgrx = %d, net client = %d", nettx, netrx, msgtx, msgrx, net_client.client != NULL);
       stimer = millis();
     }
 
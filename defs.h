@@ -41,6 +41,7 @@
 
 #pragma once
 #include "driver/twai.h"
+#include <esp_now.h>
 
 //
 /// constants
@@ -51,19 +52,102 @@
 #define VER_PATCH 3
 
 #define EEPROM_SIZE 256
-#define MAX_NET_PEERS 8
+#define EEPROM_REJOIN_ADDR 240            // remembered master, after the config data
+#define ESP_NOW_MAX_PEERS 20              // ESP-NOW limit for unencrypted peers
+#define MAX_NET_PEERS (ESP_NOW_MAX_PEERS - NET_REFLECT_BROADCAST)   // the broadcast peer, if used, takes one of them
+#define PEER_INDEX_SIZE 32                // peer hash index slots, a power of 2 larger than MAX_NET_PEERS
+#define PEER_INDEX_NONE 0xff
 #define MAX_GC_CLIENTS 4
 #define SERIAL_CLIENT MAX_GC_CLIENTS
 #define MAX_WITHROTTLE_CLIENTS 4
 #define MAX_DCCPPSER_CLIENTS 4
 #define NUM_LEDS 6
+#define LED_TICK (TickType_t)5            // LED task samples activity and updates the LEDs at this interval
+#define LED_BENCHMARK 0                   // set to 1 to compare the cost of LED activity flags and queued pulses, at startup
 #define HBFREQ 1000
 #define WIFI_SCAN_MS 350
+#define REJOIN_PASSIVE_SCAN_MS 150        // single-channel passive scan, longer than the master's beacon interval
+#define REJOIN_VERIFY_MS 2500             // time for a directly paired master to respond before scanning for it
+#define REJOIN_MAGIC 0x524a4e31
+#define RESUME_MAGIC 0x52534d31
+#define RESUME_DEFER_MAX_MS 5000          // resume starts deferred services by now, even if no frame has been bridged
 #define GC_INP_SIZE 32
+#define GC_OUT_RING_SIZE 2048             // output waiting to be sent to each GC client
+#define GC_OVERFLOW_IPS 4                 // client addresses with their own overflow policy in the config
+#define GC_FLUSH_MS 5                     // max time GC output is held back to be sent with more; 0 to send at once
+#define GC_FLUSH_BYTES 1024               // send GC output at once when this much is waiting
+#define GC_DRAIN_MAX 32                   // max messages taken from each GC output queue per pass
 #define PROXY_BUF_LEN 32
 #define NUM_PROXY_CMDS 8
 #define NUM_CBUS_NVS 16
+#define NUM_SPLIT_OPCODES 8               // opcodes added to the split bus allow-list in the config
+#define SPLIT_OPCODES_GUARD 99            // marks saved split opcodes as valid, as guard_val does for the config
 #define CAN_QUEUE_DEPTH 128
+#define CAN_BITRATE 125000                // CBUS bit rate, for bus load
+#define BUSLOAD_HISTORY_SECS 60           // longest bus load window
+#define BUSLOAD_TOP_N 5                   // busiest CANIDs and opcodes shown in the stats
+#define FRAME_POOL_SIZE 256
+#define FRAME_HANDLE_NONE 0xffff
+#define CAN_TX_QUEUE_SET_SIZE 450         // sum of the CAN output queue depths
+#define CAN_TX_MAX_IN_FLIGHT 2            // max frames in the driver transmit queue, so that priority order is kept
+#define TX_SCHED_NUM_PRIORITIES 16        // CBUS major and minor priority, 4 bits
+#define TX_SCHED_SOURCE_MAX 32            // max frames waiting in the CAN transmit scheduler from each source
+#define TX_SCHED_MAX_AGE_MS 1000          // frames waiting longer than this to be sent to the CAN bus are dropped
+#define CAN_ALERT_WAIT_TICKS (TickType_t)50   // max time the alert task waits with the alert lock held
+#define CAN_ALERTS_ENABLED (TWAI_ALERT_ERR_ACTIVE | TWAI_ALERT_RECOVERY_IN_PROGRESS | TWAI_ALERT_BUS_RECOVERED | TWAI_ALERT_ABOVE_ERR_WARN | \
+                            TWAI_ALERT_BELOW_ERR_WARN | TWAI_ALERT_BUS_ERROR | TWAI_ALERT_TX_FAILED | TWAI_ALERT_RX_QUEUE_FULL | \
+                            TWAI_ALERT_ERR_PASS | TWAI_ALERT_BUS_OFF)
+#define CAN_FILTER_POLL_MS 250            // interval between checks of what the local consumers want
+#define CAN_FILTER_HOLD_MS 5000           // the filter is only narrowed once the wanted set has been stable this long
+#define CAN_FILTER_EXT_REJECT 0x0f        // extended ID bits 16..13 required by a standard-only filter, never set by the bootloader
+
+#define NET_WIRE_VERSION 7                // wire format version advertised in heartbeat and password messages
+#define NET_WIRE_VERSION_COMPACT 2        // first version that understands compact packets
+#define NET_WIRE_VERSION_TYPED 3          // first version that understands typed control messages
+#define NET_WIRE_VERSION_REFLECT 4        // first version that understands broadcast reflected frames
+#define NET_WIRE_VERSION_KEEPALIVE 6      // first version that synthesises DKEEPs for a slave's session
+#define NET_WIRE_VERSION_RELIABLE 7       // first version that understands sequenced packets and acks, with a sender epoch
+#define NET_REFLECT_BROADCAST 1           // master reflects net-to-net frames with a single broadcast, if all peers support it
+#define NET_MSG_TYPE_BASE 0xC0            // message types are 0xC0 - 0xCF, never a valid first byte of a CAN frame
+#define NET_MSG_NUM_TYPES 11
+#define NET_MSG_INVALID 0xff
+#define NET_MSG_HEARTBEAT_LEN 2           // type + version
+#define NET_MSG_JOIN_LEN 16               // type + version + password
+#define NET_MSG_BATTERY_LEN 4             // type + mV (big-endian) + soc
+#define NET_MSG_CANID_LEN 2               // type + CANID
+#define NET_MSG_REFLECT_HDR_LEN 7         // type + source MAC address, followed by a compact frame
+#define NET_MSG_ACK_LEN 9                 // type + sender epoch + next expected sequence number + bitmap of later packets held
+#define NET_MSG_SESSION_LEN 4             // type + CANCMD session + CAN identifier of the cab's DKEEPs (big-endian)
+#define NET_SESSION_NONE 0xff             // no session is alive
+#define NET_REL_HDR_LEN 5                 // type + 16-bit sender epoch + 16-bit sequence number, followed by a CAN or CAN batch message
+#define NET_REL_WINDOW 64                 // max unacknowledged reliable packets held by the sender, for all peers
+#define NET_REL_PEER_WINDOW 24            // max unacknowledged reliable packets held for any one peer
+#define NET_REL_FULL_WAIT_MS NET_REL_RTO_MS   // time to wait for a free slot before refusing a reliable send
+#define NET_REL_REORDER_SLOTS 8           // max packets held by the receiver, waiting for a gap to be filled
+#define NET_REL_RTO_MS 20                 // retransmit timeout
+#define NET_REL_MAX_RETRIES 3
+#define NET_REL_ACK_MS 10                 // max ack rate per peer, unless a gap or duplicate is seen
+#define NET_REL_REORDER_MS 60             // time to wait for a gap to be filled before giving up on it
+#define NET_SIM_LOSS_PCT 0                // for testing, randomly drop this percentage of received packets
+#define KEEPALIVE_DKEEP_MS 2000           // master sends a DKEEP for each live slave session at this interval
+#define KEEPALIVE_REFRESH_MS 3000         // slave repeats its session message at this interval
+#define KEEPALIVE_EXPIRE_MS 7000          // a session is dead if not refreshed, or its cab has sent no DKEEP, in this time
+#define NET_PASSWORD_LEN 14
+#define NET_BATTERY_NONE 0xffff           // battery value not measured
+#define NET_HB_VERSION_OFFSET 2           // position of the version byte in a heartbeat message
+#define NET_PW_VERSION_OFFSET 19          // position of the version byte in a password message, after the password
+#define NET_COMPACT_EXT 0x80              // compact frame header flags
+#define NET_COMPACT_RTR 0x40
+#define NET_COMPACT_RESERVED 0x30
+#define NET_COMPACT_MIN_FRAME_LEN 3       // header + 11-bit id, no data
+#define NET_COMPACT_MAX_FRAME_LEN 13      // header + 29-bit id + 8 data bytes
+#define NET_BATCH_MAX_FRAMES ((ESP_NOW_MAX_DATA_LEN - 1) / NET_COMPACT_MIN_FRAME_LEN)
+#define NET_BATCH_DEADLINE_US 500         // time to wait for more frames once a batch has been started, rounded up to a tick
+#define NET_FRAME_FLAGS_MASK 0x1f         // valid twai_message_t flags
+#define NET_RX_RING_SIZE 32               // received packets waiting for the net_rx task, a power of 2
+
+#define LATENCY_BENCHMARK 0               // set to 1 to measure and report per-hop forwarding latency
+#define LAT_NUM_BUCKETS 24                // log2 microsecond histogram buckets
 
 #define ERR_IND_PIN GPIO_NUM_4            // error / low batt
 #define NET_ACT_PIN GPIO_NUM_12           // network activity
@@ -90,14 +174,32 @@
 #define I2C_GPIO_ADDR 0x20
 
 #define DEBUG_FILE "/wbdebug.txt"
-#define DEBUG_FILE_PREV "/wbdebug.prev.txt"
+#define DEBUG_FILE_PREV "/wbdebug.prev.txt"    // backup file used by earlier versions, removed at startup
 #define DEBUG_MSG_LEN 160
+#define LOG_RING_SIZE 32                  // log records waiting to be formatted, per core
+#define LOG_REC_ARGS 12                   // max argument words in a deferred log record
+#define LOG_REC_STR 64                    // space for copied string arguments in a log record
+#define LOG_SPILL_SLOTS 4                 // buffers per core for messages too long for a log record
+#define LOG_FORMAT_CACHE_SIZE 64          // parsed format strings, per core
+#define LOG_POLL_TICKS (TickType_t)5      // logger task polls the rings at this interval
+#define LOG_LEVEL_MAX LOG_LVL_DEBUG       // levelled log sites above this level are compiled out
+#define LOG_LEVELS_GUARD 99               // marks saved log levels as valid, as guard_val does for the config
+#define LOG_BENCHMARK 0                   // set to 1 to measure the cost of logging to the caller, at startup
+#define LOGSINK_BUF_SIZE 4096             // debug log lines waiting to be written to file
+#define LOGSINK_PAGE_SIZE 256             // SPIFFS page size
+#define LOGSINK_FLUSH_BYTES 1024          // write to file once this much is buffered ...
+#define LOGSINK_FLUSH_MS 2000UL           // ... or the oldest line has waited this long
+#define LOGSINK_SEGMENTS 4                // debug log files kept, including the current one
+#define LOGSINK_SEGMENT_SIZE 32768        // start a new debug log file after this many bytes
+#define LOGTAIL_SIZE 8192                 // recent log messages kept in RAM, for the webserver and websocket clients
+#define LOGTAIL_WS_BURST 16               // max log messages sent to each websocket client per pass
 
 #define QUEUE_OP_TIMEOUT_NONE (TickType_t)0          // non-blocking
 #define QUEUE_OP_TIMEOUT_SHORT (TickType_t)2         // max 2 ms block
 #define QUEUE_OP_TIMEOUT (TickType_t)5               // max 5 ms block
 #define QUEUE_OP_TIMEOUT_LONG (TickType_t)10         // max 10 ms block
 #define QUEUE_OP_TIMEOUT_INFINITE (TickType_t)(-1)   // block forever
+#define QUEUE_OP_TIMEOUT_CAN_RX (TickType_t)100      // CAN receive, max 100 ms block between housekeeping passes
 
 #define QUEUE_LOGGER_IN (1 << 0)
 #define QUEUE_LED_IN (1 << 1)
@@ -115,6 +217,11 @@
 #define QUEUE_CBUS_EXTERNAL (1 << 13)
 #define QUEUE_CBUS_INTERNAL (1 << 14)
 
+#define ROUTE_FRAME_STD (1 << 0)
+#define ROUTE_FRAME_EXT (1 << 1)
+#define ROUTE_FRAME_RTR (1 << 2)
+#define ROUTE_FRAME_ALL (ROUTE_FRAME_STD | ROUTE_FRAME_EXT | ROUTE_FRAME_RTR)
+
 //
 /// forward function declarations for webserver page handlers
 //
@@ -127,6 +234,8 @@ void handle_store(void);
 void handle_info(void);
 void save_config(void);
 void handle_stats(void);
+void handle_log_levels(void);
+void handle_log(void);
 void handle_stop(void);
 void do_deepsleep(void);
 void handle_restart(void);
@@ -146,11 +255,13 @@ void VLOG(const char fmt[], ...);
 void PULSE_LED(byte led);
 bool CANtoGC(twai_message_t *frame, char buffer[]);
 bool GCtoCAN(char buffer[], twai_message_t *frame);
+unsigned long gc_client_lag_ms(const byte i);
 char *format_CAN_frame(twai_message_t *frame);
 void device_sleep(void);
 void peer_record_op(const uint8_t *mac_addr, byte op, unsigned int val = 0);    // default val for arg 3
 char *mac_to_char(const uint8_t mac_addr[6]);
-bool send_message_to_queues(uint16_t queues, void *msg, const char *source_task, TickType_t time_to_wait);
+bool send_message_to_queues(uint16_t queues, void *msg, const char *source_task, TickType_t time_to_wait, bool is_frame = true);    // default arg 5
+
 
 //
 /// enumerations
@@ -158,7 +269,34 @@ bool send_message_to_queues(uint16_t queues, void *msg, const char *source_task,
 
 enum {
   TRANSPARENT_MODE = 0,     // all traffic is forwarded
-  SPLIT_BUS = 1             // some traffic is filtered, not implemented yet
+  SPLIT_BUS = 2             // each slave is sent only the traffic for its cab; 1 was saved by older firmware and means transparent
+};
+
+enum {
+  LOG_LVL_NONE = 0,
+  LOG_LVL_ERROR,
+  LOG_LVL_WARN,
+  LOG_LVL_INFO,
+  LOG_LVL_DEBUG,
+  LOG_LVL_VERBOSE,
+  LOG_NUM_LEVELS
+};
+
+enum {
+  LOG_MOD_CAN = 0,
+  LOG_MOD_NET,
+  LOG_MOD_GC,
+  LOG_MOD_WT,
+  LOG_MOD_PROXY,
+  LOG_MOD_CBUS,
+  LOG_MOD_WEB,
+  LOG_NUM_MODULES
+};
+
+enum {
+  GC_OVERFLOW_DROP_OLDEST = 0,   // discard the oldest messages waiting, to make room
+  GC_OVERFLOW_DISCONNECT = 1     // close the connection; the client is too slow to keep up
+                                 // the serial port can't be closed, so all the messages waiting are discarded instead
 };
 
 enum {
@@ -226,7 +364,23 @@ enum {
   PEER_INCR_TX_ALL = 6,
   PEER_SET_BATT_MV = 7,
   PEER_SET_CANID = 8,
-  PEER_SET_BATT_SOC = 9
+  PEER_SET_BATT_SOC = 9,
+  PEER_SET_VERSION = 10,
+  PEER_RAISE_VERSION = 11
+};
+
+enum {
+  NET_MSG_LEGACY_CAN = 0xC0,    // internal only - a CAN frame in the original 20-byte format
+  NET_MSG_HEARTBEAT = 0xC1,
+  NET_MSG_CAN_BATCH = 0xC2,     // one or more compact encoded CAN frames
+  NET_MSG_CAN = 0xC3,           // a single compact encoded CAN frame
+  NET_MSG_JOIN = 0xC4,          // slave's network password
+  NET_MSG_BATTERY = 0xC5,
+  NET_MSG_CANID = 0xC6,
+  NET_MSG_CAN_REFLECT = 0xC7,   // a compact CAN frame reflected by the master, tagged with the originating node's MAC address
+  NET_MSG_RELIABLE = 0xC8,      // a CAN or CAN batch message with a sequence number
+  NET_MSG_ACK = 0xC9,           // acknowledgement of reliable messages
+  NET_MSG_SESSION = 0xCA        // the CANCMD session a slave's cab is keeping alive
 };
 
 enum {
@@ -287,8 +441,18 @@ typedef struct  {
   byte node_variables[NUM_CBUS_NVS];
   byte wakeup_source;
   byte touch_threshold;
+  byte split_opcodes[NUM_SPLIT_OPCODES];
+  byte split_opcodes_guard;       // SPLIT_OPCODES_GUARD once split_opcodes has been set
+  byte log_levels[LOG_NUM_MODULES];
+  byte log_levels_guard;          // LOG_LEVELS_GUARD once log_levels has been set
+  byte gc_overflow_policy;                    // GC_OVERFLOW_* for network GC clients
+  byte gc_serial_overflow_policy;             // and for the serial client
+  uint32_t gc_overflow_ip[GC_OVERFLOW_IPS];   // network clients with their own policy, 0 if unused
+  byte gc_overflow_ip_policy[GC_OVERFLOW_IPS];
 } config_t;
 
+static_assert(sizeof(config_t) <= EEPROM_REJOIN_ADDR, "config data overlaps the rejoin record in EEPROM");
+
 typedef struct {
   WiFiClient *client;
   char buffer[GC_INP_SIZE];
@@ -296,8 +460,23 @@ typedef struct {
   byte idx;
   char addr[16];
   int port;
+  char out[GC_OUT_RING_SIZE];                 // messages waiting to be sent
+  uint16_t out_head, out_tail, out_used;
+  bool out_partial;                           // the message at out_tail has been partly sent
+  byte policy;                                // what to do when out is full
+  unsigned long out_queued, out_done;         // bytes queued, and bytes sent or dropped
+  unsigned long out_sent, out_dropped;        // bytes sent, messages dropped
+  bool lag_timing;                            // a message is being timed from queueing to sending
+  unsigned long lag_mark, lag_mark_ms;        // out_done once it has gone, and when it was queued
+  unsigned long lag_ms, max_lag_ms;
+  unsigned long out_first_ms;                 // when the oldest message waiting was queued
 } gcclient_t;
 
+typedef struct {
+  unsigned long writes, bytes;                // writes to network clients, and bytes written
+  unsigned int writes_per_sec, bytes_per_write;
+} gc_out_stats_t;
+
 typedef struct {
   char msg[GC_INP_SIZE];
   char addr[16];
@@ -327,6 +506,9 @@ typedef struct {
   int num_errs;
   int battery_mv;
   int battery_soc;
+  byte wire_version;
+  int CANCMD_session;
+  uint16_t loco_addr;
 } peer_state_t;
 
 typedef struct {
@@ -339,6 +521,10 @@ typedef struct {
   char s[DEBUG_MSG_LEN];
 } log_message_t;
 
+typedef struct {
+  unsigned long records, dropped, truncated;
+} log_stats_t;
+
 typedef struct {
   uint8_t mac_addr[6];
   int error_count;
@@ -377,4 +563,348 @@ typedef struct {
   QueueHandle_t handle;
   int num_items;
   size_t item_size;
+  bool pooled;
 } queue_t;
+
+typedef uint16_t frame_handle_t;
+
+typedef struct {
+  twai_message_t frame;
+  volatile byte refcount;
+#if LATENCY_BENCHMARK
+  unsigned long alloc_time;
+#endif
+} frame_slot_t;
+
+typedef struct {
+  unsigned int in_use, hwm;
+  unsigned long allocs, exhausted;
+} frame_pool_stats_t;
+
+//
+/// frame pool function declarations
+//
+
+void frame_pool_init(void);
+frame_handle_t frame_pool_alloc(const void *msg, byte refs);
+twai_message_t *frame_pool_get(frame_handle_t fh);
+void frame_pool_release(frame_handle_t fh);
+bool frame_pool_receive(QueueHandle_t queue, twai_message_t *frame, TickType_t time_to_wait);
+#if LATENCY_BENCHMARK
+unsigned long frame_pool_age(frame_handle_t fh);
+#endif
+
+//
+/// router
+//
+
+typedef bool (*route_predicate_t)(void);
+
+typedef struct {
+  unsigned long messages, deliveries, filtered;
+} router_stats_t;
+
+typedef struct {
+  unsigned long packets_tx, frames_tx, batches_tx, frames_rx, batches_rx;
+  unsigned long wire_bytes_tx;
+  unsigned long reflect_broadcast, reflect_unicast, reflect_suppressed;
+  unsigned long split_filtered;
+} net_batch_stats_t;
+
+void router_subscribe(uint16_t queue, const byte *opcodes, byte num_opcodes, byte frame_types, route_predicate_t enabled);
+uint16_t router_select(uint16_t candidates, const void *msg, bool is_frame);
+bool router_wanted(uint16_t candidates, byte *types, byte *opcodes);
+
+size_t net_encode_frame(const twai_message_t *frame, byte *buffer);
+size_t net_decode_frame(const byte *buffer, size_t len, twai_message_t *frame);
+
+//
+/// typed network messages
+//
+
+typedef void (*net_msg_handler_t)(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+
+typedef struct {
+  const char *name;
+  int min_len;
+  net_msg_handler_t handler;
+} net_msg_type_t;
+
+typedef struct {
+  unsigned long rx, tx, errs;
+} net_msg_stats_t;
+
+byte net_msg_classify(const uint8_t **msg, int *msg_len, uint8_t *buffer);
+void net_msg_dispatch(const uint8_t *mac_addr, byte type, const uint8_t *msg, int msg_len, bool legacy);
+int net_msg_len(const uint8_t *msg);
+void net_msg_count_tx(byte type);
+const char *net_msg_name(byte index);
+byte net_msg_to_legacy(const uint8_t *msg, char legacy[2][sizeof(twai_message_t)]);
+bool net_msg_is_frame(const twai_message_t *msg);
+void handle_net_frame(const uint8_t *mac_addr, twai_message_t *frame);
+
+//
+/// ESP-NOW receive ring
+//
+
+typedef struct {
+  uint8_t mac_addr[6];
+  byte len;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} net_rx_packet_t;
+
+typedef struct {
+  unsigned long packets, dropped;
+  unsigned long cb_total_us, cb_max_us;
+  unsigned int hwm;
+} net_rx_stats_t;
+
+bool net_rx_ring_put(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+net_rx_packet_t *net_rx_ring_peek(void);
+void net_rx_ring_advance(void);
+
+//
+/// reliable delivery
+//
+
+typedef struct {
+  unsigned long sent, retransmits, abandoned, window_full, acks_tx, acks_rx;
+  unsigned long duplicates, reordered, lost, sim_dropped, restarts;
+} net_rel_stats_t;
+
+void net_rel_init(void);
+bool net_rel_needed(const twai_message_t *frame);
+uint32_t net_rel_send(byte *packet, size_t len, uint32_t peer_mask);
+void net_rel_ack(const uint8_t *mac_addr, uint16_t epoch, uint16_t base, uint32_t bitmap);
+void net_rel_send_failed(const uint8_t *mac_addr);
+void net_rel_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+void net_rel_peer_reset(int idx);
+void net_rel_tx_poll(void);
+void net_rel_rx_poll(void);
+bool net_send_packet(const uint8_t *data, size_t len);
+int peer_find(const uint8_t *mac_addr);
+int peer_find_locked(const uint8_t *mac_addr);
+void log_esp_now_err(int err_num);
+
+//
+/// session keepalive
+//
+
+typedef struct {
+  unsigned long absorbed, refresh_tx, refresh_rx, synthesised, expired;
+} keepalive_stats_t;
+
+void keepalive_init(void);
+bool keepalive_local_frame(const twai_message_t *frame);
+void keepalive_session(const uint8_t *mac_addr, byte session, uint16_t identifier);
+void keepalive_peer_frame(const uint8_t *mac_addr, const twai_message_t *frame);
+void keepalive_peer_reset(int idx);
+void keepalive_poll(void);
+bool net_send_control(const uint8_t *msg);
+
+//
+/// fast satellite rejoin
+//
+
+enum {
+  REJOIN_DIRECT = 0,            // pair the remembered master on the remembered channel
+  REJOIN_PASSIVE_SCAN = 1,      // passive scan of the remembered channel
+  REJOIN_FULL_SCAN = 2,         // active scan of all channels
+  REJOIN_NONE = 3
+};
+
+typedef struct {
+  byte method;
+  unsigned int attempts;
+} rejoin_stats_t;
+
+signed int rejoin_init(void);
+void rejoin_set_channel(signed int chan);
+byte rejoin_next_stage(uint8_t *mac_addr, byte *chan);
+void rejoin_paired(byte method, bool ok);
+bool rejoin_check(const uint8_t *mac_master, byte chan, bool joined);
+void rejoin_save(const uint8_t *mac_master, byte chan);
+const char *rejoin_method_name(byte method);
+
+//
+/// boot timeline and deep sleep resume
+//
+
+enum {
+  BOOT_FILESYSTEM = 0,
+  BOOT_I2C,
+  BOOT_CONFIG,
+  BOOT_CHANNEL,
+  BOOT_SOFT_AP,
+  BOOT_ESPNOW,
+  BOOT_SERVICES,
+  BOOT_CAN,
+  BOOT_TASKS,
+  BOOT_SETUP_DONE,
+  BOOT_JOINED,
+  BOOT_FIRST_FRAME,
+  BOOT_DEFERRED,
+  BOOT_NUM_PHASES
+};
+
+void boot_mark(byte phase);
+bool boot_format(byte phase, char *buffer, size_t len);
+void boot_report(void);
+bool resume_begin(esp_sleep_wakeup_cause_t cause);
+void resume_save(void);
+bool resume_deferred_due(void);
+
+//
+/// split bus mode
+//
+
+void split_init(void);
+bool split_enabled(void);
+void split_learn(const uint8_t *mac_addr, const twai_message_t *frame);
+uint32_t split_peer_mask(const twai_message_t *frame);
+
+//
+/// CAN acceptance filter
+//
+
+typedef struct {
+  unsigned long reprograms, failures;
+  unsigned long sw_dropped;                   // frames accepted by the controller that no consumer wanted
+  unsigned long rejectable_open;              // of those, frames the narrowed filter would have rejected, while it was open
+  unsigned long open_ms, narrowed_ms;
+} can_filter_stats_t;
+
+uint16_t can_rx_queues(void);
+void can_driver_install(void);
+void can_driver_lock(void);
+void can_driver_unlock(void);
+esp_err_t can_driver_read_alerts(uint32_t *alerts, TickType_t ticks);
+void can_filter_poll(void);
+bool can_filter_account(const twai_message_t *frame);
+bool can_filter_is_open(void);
+unsigned long can_filter_hw_estimate(void);
+
+//
+/// CAN driver alerts
+//
+
+enum {
+  CAN_ALERT_BUS_OFF = 0,
+  CAN_ALERT_RECOVERING,
+  CAN_ALERT_ERR_PASSIVE,
+  CAN_ALERT_NUM_STATES
+};
+
+typedef struct {
+  uint32_t last;                              // most recent alerts
+  unsigned long bus_off, recovered, err_passive, err_warn, rx_queue_full, bus_error, tx_failed;
+  unsigned long state_ms[CAN_ALERT_NUM_STATES];
+} can_alert_stats_t;
+
+unsigned long can_alert_state_ms(byte state);
+
+//
+/// CAN bus load meter
+//
+
+typedef struct {
+  unsigned long frames, ext_frames;
+  uint32_t peak_bits;                         // most bit times in any one second
+} busload_stats_t;
+
+void busload_init(void);
+unsigned int busload_frame_bits(const twai_message_t *frame);
+void busload_frame(const twai_message_t *frame);
+unsigned int busload_pct10(byte secs);
+unsigned int busload_peak_pct10(void);
+byte busload_top(bool by_opcode, byte *keys, unsigned long *counts, byte num);
+
+//
+/// buffered debug log file
+//
+
+typedef struct {
+  unsigned long flushes, bytes_written, bytes_dropped, write_errors, rotations;
+  unsigned long last_flush_us, max_flush_us, total_flush_us;
+} logsink_stats_t;
+
+bool logsink_begin(void);
+void logsink_write(const char *prefix, const char *msg);
+void logsink_poll(void);
+void logsink_sync(void);
+size_t logsink_pending(void);
+
+//
+/// recent log messages kept in RAM
+//
+
+void logtail_init(void);
+void logtail_add(const char *prefix, const char *msg);
+bool logtail_read(unsigned long *seq, char *buf, size_t buflen, unsigned long *missed);
+unsigned long logtail_next_seq(void);
+
+//
+/// latency benchmark
+//
+
+#if LATENCY_BENCHMARK
+
+enum {
+  LAT_NET_TO_CAN = 0,
+  LAT_GC_TO_CAN,
+  LAT_WI_TO_CAN,
+  LAT_NET_OUT,
+  LAT_GC_OUT,
+  LAT_NUM_HOPS
+};
+
+void latency_record(byte hop, unsigned long usecs);
+bool latency_format(byte hop, char *buffer, size_t len);
+void latency_report(void);
+
+#endif
+
+//
+/// CAN transmit scheduler
+//
+
+enum {
+  TX_SRC_NET = 0,
+  TX_SRC_GC,
+  TX_SRC_WI,
+  TX_SRC_NUM
+};
+
+typedef struct {
+  unsigned long frames, total_us, max_us;
+} tx_sched_stats_t;
+
+typedef struct {
+  unsigned long full;             // the source already had TX_SCHED_SOURCE_MAX frames waiting
+  unsigned long expired;          // waited longer than TX_SCHED_MAX_AGE_MS
+  unsigned long bus_down;         // the bus was not running
+} tx_sched_drops_t;
+
+void tx_sched_init(void);
+byte tx_sched_priority(const twai_message_t *frame);
+bool tx_sched_put(frame_handle_t fh, byte source);
+frame_handle_t tx_sched_get(byte *source);
+void tx_sched_expire(void);
+void tx_sched_flush(void);
+unsigned int tx_sched_pending(void);
+
+//
+/// levelled logging
+/// a site above LOG_LEVEL_MAX is compiled out; otherwise, if its module's runtime level is lower, it costs a load and a branch
+//
+
+extern byte log_levels[LOG_NUM_MODULES];
+extern const char *log_module_names[LOG_NUM_MODULES];
+extern const char *log_level_names[LOG_NUM_LEVELS];
+
+#define MLOG(mod, level, ...) do { if ((level) <= LOG_LEVEL_MAX && (level) <= log_levels[mod]) { VLOG(__VA_ARGS__); } } while (0)
+#define LOGE(mod, ...) MLOG(mod, LOG_LVL_ERROR, __VA_ARGS__)
+#define LOGW(mod, ...) MLOG(mod, LOG_LVL_WARN, __VA_ARGS__)
+#define LOGI(mod, ...) MLOG(mod, LOG_LVL_INFO, __VA_ARGS__)
+#define LOGD(mod, ...) MLOG(mod, LOG_LVL_DEBUG, __VA_ARGS__)
+#define LOGV(mod, ...) MLOG(mod, LOG_LVL_VERBOSE, __VA_ARGS__)
@@ -0,0 +1,183 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// a fixed pool of CAN frame slots shared by all pooled queues
+/// a frame is copied into a slot once, and the queues carry a 2-byte handle to the slot rather than a copy of the frame
+/// each slot carries a reference count, one for each queue the handle was sent to
+/// the last consumer to release its reference returns the slot to the free list
+//
+
+static frame_slot_t frame_pool[FRAME_POOL_SIZE];
+static frame_handle_t free_list[FRAME_POOL_SIZE];
+static unsigned int free_top = 0;
+static portMUX_TYPE pool_mux = portMUX_INITIALIZER_UNLOCKED;
+
+frame_pool_stats_t frame_pool_stats;
+
+//
+/// initialise the pool - must be called before any pooled queue is used
+//
+
+void frame_pool_init(void) {
+
+  for (unsigned int i = 0; i < FRAME_POOL_SIZE; i++) {
+    frame_pool[i].refcount = 0;
+    free_list[i] = (FRAME_POOL_SIZE - 1) - i;
+  }
+
+  free_top = FRAME_POOL_SIZE;
+  memset(&frame_pool_stats, 0, sizeof(frame_pool_stats_t));
+  return;
+}
+
+//
+/// take a free slot, copy the message into it and set its reference count
+/// returns FRAME_HANDLE_NONE if the pool is exhausted
+//
+
+frame_handle_t frame_pool_alloc(const void *msg, byte refs) {
+
+  frame_handle_t fh = FRAME_HANDLE_NONE;
+
+  if (refs == 0) {
+    return FRAME_HANDLE_NONE;
+  }
+
+  portENTER_CRITICAL(&pool_mux);
+
+  if (free_top > 0) {
+    fh = free_list[--free_top];
+    frame_pool[fh].refcount = refs;
+    ++frame_pool_stats.allocs;
+    frame_pool_stats.in_use = FRAME_POOL_SIZE - free_top;
+
+    if (frame_pool_stats.in_use > frame_pool_stats.hwm) {
+      frame_pool_stats.hwm = frame_pool_stats.in_use;
+    }
+  } else {
+    ++frame_pool_stats.exhausted;
+  }
+
+  portEXIT_CRITICAL(&pool_mux);
+
+  if (fh != FRAME_HANDLE_NONE) {
+    memcpy(&frame_pool[fh].frame, msg, sizeof(twai_message_t));
+#if LATENCY_BENCHMARK
+    frame_pool[fh].alloc_time = micros();
+#endif
+  }
+
+  return fh;
+}
+
+//
+/// get a pointer to the frame held in a slot
+/// the pointer is valid until the caller releases its reference
+//
+
+twai_message_t *frame_pool_get(frame_handle_t fh) {
+
+  if (fh >= FRAME_POOL_SIZE) {
+    return NULL;
+  }
+
+  return &frame_pool[fh].frame;
+}
+
+#if LATENCY_BENCHMARK
+
+//
+/// time in microseconds since the frame was placed in the pool
+//
+
+unsigned long frame_pool_age(frame_handle_t fh) {
+
+  if (fh >= FRAME_POOL_SIZE) {
+    return 0;
+  }
+
+  return micros() - frame_pool[fh].alloc_time;
+}
+
+#endif
+
+//
+/// drop one reference to a slot, and return it to the free list when the last reference is dropped
+//
+
+void frame_pool_release(frame_handle_t fh) {
+
+  if (fh >= FRAME_POOL_SIZE) {
+    return;
+  }
+
+  if (__atomic_sub_fetch(&frame_pool[fh].refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    portENTER_CRITICAL(&pool_mux);
+    free_list[free_top++] = fh;
+    frame_pool_stats.in_use = FRAME_POOL_SIZE - free_top;
+    portEXIT_CRITICAL(&pool_mux);
+  }
+
+  return;
+}
+
+//
+/// convenience function for consumers that want a private copy of the frame
+/// receives a handle from a pooled queue, copies the frame out and releases the reference
+//
+
+bool frame_pool_receive(QueueHandle_t queue, twai_message_t *frame, TickType_t time_to_wait) {
+
+  frame_handle_t fh;
+
+  if (xQueueReceive(queue, &fh, time_to_wait) != pdTRUE) {
+    return false;
+  }
+
+  memcpy(frame, frame_pool_get(fh), sizeof(twai_message_t));
+  frame_pool_release(fh);
+  return true;
+}
@@ -40,6 +40,7 @@
 */
 
 #include <WiFi.h>
+#include <lwip/sockets.h>
 #include "defs.h"
 
 // variables defined in other files
@@ -53,11 +54,28 @@ extern byte num_peers, num_wi_clients;
 // global variables
 gcclient_t gc_clients[MAX_GC_CLIENTS + 1];
 byte num_gc_clients;
+gc_out_stats_t gc_out_stats;
 const byte max_retries = 5;
 
 // forward function declarations
 void process_input_data(const byte i);
 bool send_message_to_client(const byte i, const char *buffer,  const size_t s);
+static void reset_client(const byte i);
+static byte overflow_policy(IPAddress ip);
+static void close_client(const byte i);
+static void drain_client(const byte i);
+
+//
+/// router enable predicates for the GC output queues
+//
+
+bool gc_out_enabled(void) {
+  return (num_gc_clients > 0);
+}
+
+bool gc_to_gc_enabled(void) {
+  return (num_gc_clients > 1);
+}
 
 //
 /// task to implement a Gridconnect server
@@ -66,11 +84,13 @@ bool send_message_to_client(const byte i, const char *buffer,  const size_t s);
 void gc_task(void *params) {
 
   WiFiServer server;
-  twai_message_t cf;
+  twai_message_t *cf;
+  frame_handle_t fh;
   wrapped_gc_t gc;
   char buffer[GC_INP_SIZE];
   byte i;
   unsigned long stimer = millis();
+  unsigned long prev_writes = 0, prev_bytes = 0;
 
   LOG("gc_task: task starting");
 
@@ -80,20 +100,22 @@ void gc_task(void *params) {
     vTaskSuspend(NULL);
   }
 
+  // subscribe to all CAN frames, while there are connected clients
+  router_subscribe(QUEUE_GC_OUT, NULL, 0, ROUTE_FRAME_ALL, gc_out_enabled);
+  router_subscribe(QUEUE_GC_TO_GC, NULL, 0, ROUTE_FRAME_ALL, gc_to_gc_enabled);
+
   // initialise client records
   for (i = 0; i < MAX_GC_CLIENTS + 1; i++) {
     gc_clients[i].client = NULL;                // client object
     gc_clients[i].input[0] = 0;                 // input data working buffer
-    gc_clients[i].buffer[0] = 0;                // in progress GC string buffer
-    gc_clients[i].idx = 0;                      // index into GC string buffer, where next char is stored
-    gc_clients[i].addr[0] = 0;                  // peer IP address
-    gc_clients[i].port = 0;                     // peer remote port
+    reset_client(i);
   }
 
   // hardcode serial client identity if configured
   if (config_data.gc_serial_on) {
     strcpy(gc_clients[SERIAL_CLIENT].addr, "SERIAL");
     gc_clients[SERIAL_CLIENT].port = 99;
+    gc_clients[SERIAL_CLIENT].policy = config_data.gc_serial_overflow_policy;
     LOG("gc_task: serial client is enabled");
   }
 
@@ -119,9 +141,11 @@ void gc_task(void *params) {
       for (i = 0; i < MAX_GC_CLIENTS; i++) {
         if (gc_clients[i].client == NULL) {
           gc_clients[i].client = new WiFiClient(client);
-          gc_clients[i].idx = 0;
+          reset_client(i);
           strcpy(gc_clients[i].addr, gc_clients[i].client->remoteIP().toString().c_str());
           gc_clients[i].port = gc_clients[i].client->remotePort();
+          gc_clients[i].policy = overflow_policy(gc_clients[i].client->remoteIP());
+          gc_clients[i].client->setNoDelay(true);     // output is already gathered into as few writes as possible
           ++num_gc_clients;
           break;
         }
@@ -162,14 +186,7 @@ void gc_task(void *params) {
         } else {
 
           // remote client has disconnected
-          gc_clients[i].client->stop();
-          delete gc_clients[i].client;
-          gc_clients[i].client = NULL;
-          gc_clients[i].buffer[0] = 0;
-          gc_clients[i].idx = 0;
-          gc_clients[i].addr[0] = 0;
-          gc_clients[i].port = 0;
-          --num_gc_clients;
+          close_client(i);
           VLOG("gc_task: reaped disconnected client at index = %d, new count = %d", i, num_gc_clients);
 
         }  // is connected
@@ -179,9 +196,10 @@ void gc_task(void *params) {
     //
     /// process GC-to-GC queue
     /// reflect incoming GC messages to all GC clients except the originator
+    /// take everything waiting, up to a limit, so it can be sent to each client together
     //
 
-    if (xQueueReceive(gc_to_gc_queue, &gc, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
+    for (byte n = 0; n < GC_DRAIN_MAX && xQueueReceive(gc_to_gc_queue, &gc, (n == 0) ? QUEUE_OP_TIMEOUT_SHORT : QUEUE_OP_TIMEOUT_NONE) == pdTRUE; n++) {
       // VLOG("gc_task: received message from GC-to-GC queue");
       // VLOG("gc_task: message IP = %s, port = %d", gc.addr, gc.port);
       size_t s = strlen(gc.msg);
@@ -194,7 +212,7 @@ void gc_task(void *params) {
           // VLOG("gc_task: client ip = %s, port = %d", gc_clients[i].addr, gc_clients[i].port);
 
           if (!send_message_to_client(i, gc.msg, s)) {
-            LOG("gc_task: error sending message to GC client");
+            LOGE(LOG_MOD_GC, "gc_task: error sending message to GC client");
             PULSE_LED(ERR_IND_LED);
             ++errors.gc_tx;
           } else {
@@ -211,14 +229,16 @@ void gc_task(void *params) {
 
     //
     /// process CAN frames from output queue, convert to GC string & send to active GC clients
+    /// as above, take everything waiting, up to a limit
     //
 
-    if (xQueueReceive(gc_out_queue, &cf, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
+    for (byte n = 0; n < GC_DRAIN_MAX && xQueueReceive(gc_out_queue, &fh, (n == 0) ? QUEUE_OP_TIMEOUT_SHORT : QUEUE_OP_TIMEOUT_NONE) == pdTRUE; n++) {
 
-      // VLOG("gc_task: got new frame from output queue: %s", format_CAN_frame(&cf));
+      cf = frame_pool_get(fh);
+      // VLOG("gc_task: got new frame from output queue: %s", format_CAN_frame(cf));
 
       if (num_gc_clients > 0) {
-        if (CANtoGC(&cf, buffer)) {
+        if (CANtoGC(cf, buffer)) {
 
           // VLOG("gc_task: CANtoGC returns %s", buffer);
           size_t s = strlen(buffer);
@@ -228,7 +248,7 @@ void gc_task(void *params) {
 
             if (gc_clients[i].port != 0) {
               if (!send_message_to_client(i, buffer, s)) {
-                LOG("gc_task: error sending incoming CAN frame to GC client");
+                LOGE(LOG_MOD_GC, "gc_task: error sending incoming CAN frame to GC client");
                 PULSE_LED(ERR_IND_LED);
                 ++errors.gc_tx;
               } else {
@@ -241,22 +261,51 @@ void gc_task(void *params) {
 
           // VLOG("gc_task: sent to %d clients", cc);
           PULSE_LED(NET_ACT_LED);
+
+#if LATENCY_BENCHMARK
+          latency_record(LAT_GC_OUT, frame_pool_age(fh));
+#endif
         }  // if converted
       }  // have active clients
+
+      frame_pool_release(fh);
     }  // if message dequeued
 
+    //
+    /// send what each client's connection will take now, without waiting
+    /// output is held back for up to GC_FLUSH_MS, unless there's a lot of it, so it goes in fewer, larger writes
+    //
+
+    for (i = 0; i <= MAX_GC_CLIENTS; i++) {
+      if (gc_clients[i].port != 0 && gc_clients[i].out_used > 0) {
+        if (gc_clients[i].out_used >= GC_FLUSH_BYTES || millis() - gc_clients[i].out_first_ms >= GC_FLUSH_MS) {
+          drain_client(i);
+        }
+      }
+    }
+
     //
     /// periodically log connected clients
     //
 
     if (millis() - stimer >= 10000UL) {
       stimer = millis();
-      VLOG("gc_task: [%d] clients = %d", config_data.CANID, num_gc_clients);
+      LOGI(LOG_MOD_GC, "gc_task: [%d] clients = %d", config_data.CANID, num_gc_clients);
+
+      // writes to network clients, roughly one TCP segment each
+      gc_out_stats.writes_per_sec = (gc_out_stats.writes - prev_writes) / 10;
+      gc_out_stats.bytes_per_write = (gc_out_stats.writes > prev_writes) ? (gc_out_stats.bytes - prev_bytes) / (gc_out_stats.writes - prev_writes) : 0;
+      prev_writes = gc_out_stats.writes;
+      prev_bytes = gc_out_stats.bytes;
+
+      if (gc_out_stats.writes_per_sec > 0) {
+        LOGI(LOG_MOD_GC, "gc_task: writes/s = %u, bytes/write = %u", gc_out_stats.writes_per_sec, gc_out_stats.bytes_per_write);
+      }
 
       if (num_gc_clients > 0) {
         for (byte i = 0; i < MAX_GC_CLIENTS + 1; i++) {
           if (gc_clients[i].port != 0) {
-            VLOG("gc_task: client %d: %s/%d", i, gc_clients[i].addr, gc_clients[i].port);
+            LOGI(LOG_MOD_GC, "gc_task: client %d: %s/%d", i, gc_clients[i].addr, gc_clients[i].port);
           }
         }
       }
@@ -328,7 +377,7 @@ bool GCtoCAN(char buffer[GC_INP_SIZE], twai_message_t *cf) {
 
   // check string begins with a colon
   if (buffer[0] != ':') {
-    VLOG("GCtoCAN: invalid GC string |%s| does not begin with :", buffer);
+    LOGW(LOG_MOD_GC, "GCtoCAN: invalid GC string |%s| does not begin with :", buffer);
     return false;
   }
 
@@ -340,7 +389,7 @@ bool GCtoCAN(char buffer[GC_INP_SIZE], twai_message_t *cf) {
       cf->flags |= TWAI_MSG_FLAG_EXTD;
       break;
     default:
-      VLOG("GCtoCAN: invalid frame type = %c", buffer[1]);
+      LOGW(LOG_MOD_GC, "GCtoCAN: invalid frame type = %c", buffer[1]);
       return false;
   }
 
@@ -355,12 +404,12 @@ bool GCtoCAN(char buffer[GC_INP_SIZE], twai_message_t *cf) {
   // i now points to the N or R indicator
 
   if (i == slen) {
-    LOG("GCtoCAN: string does not contain frame type N or R");
+    LOGW(LOG_MOD_GC, "GCtoCAN: string does not contain frame type N or R");
     return false;
   }
 
   if (i == 2) {
-    LOG("GCtoCAN: string has no header part");
+    LOGW(LOG_MOD_GC, "GCtoCAN: string has no header part");
     return false;
   }
 
@@ -373,7 +422,7 @@ bool GCtoCAN(char buffer[GC_INP_SIZE], twai_message_t *cf) {
   // check for non-hex characters
   for (j = 2; j < i; j++) {
     if (!isxdigit(buffer[j])) {
-      VLOG("GCtoCAN: error: non-hex digit '%c' in frame header at index = %d", buffer[j], j);
+      LOGW(LOG_MOD_GC, "GCtoCAN: error: non-hex digit '%c' in frame header at index = %d", buffer[j], j);
       return false;
     }
 
@@ -434,13 +483,13 @@ void process_input_data(byte i) {
 
         // retry if error is temporary
         if (errno == EAGAIN && retries < max_retries) {
-          LOG("gc_task: process_input_data: retrying read");
+          LOGD(LOG_MOD_GC, "gc_task: process_input_data: retrying read");
           vTaskDelay(2);
           ++retries;
           continue;
         }
 
-        VLOG("gc_task: process_input_data: read error from client = %d, errno = %d", i, errno);
+        LOGE(LOG_MOD_GC, "gc_task: process_input_data: read error from client = %d, errno = %d", i, errno);
 
         // clear buffer and bail out if any other error
         gc_clients[i].buffer[0] = 0;
@@ -498,7 +547,7 @@ void process_input_data(byte i) {
             uint16_t queues = QUEUE_CAN_OUT_FROM_GC | QUEUE_NET_OUT;
 
             if (!send_message_to_queues(queues, &cf, "gc_task", QUEUE_OP_TIMEOUT_SHORT)) {
-              LOG("gc_task: process_input_data: error queuing message");
+              LOGE(LOG_MOD_GC, "gc_task: process_input_data: error queuing message");
               PULSE_LED(ERR_IND_LED);
             }
 
@@ -507,8 +556,8 @@ void process_input_data(byte i) {
               strcpy(gc.addr, gc_clients[i].addr);
               gc.port = gc_clients[i].port;
 
-              if (!send_message_to_queues(QUEUE_GC_TO_GC, &gc, "gc_task", QUEUE_OP_TIMEOUT_SHORT)) {
-                LOG("gc_task: process_input_data: error queuing message");
+              if (!send_message_to_queues(QUEUE_GC_TO_GC, &gc, "gc_task", QUEUE_OP_TIMEOUT_SHORT, false)) {
+                LOGE(LOG_MOD_GC, "gc_task: process_input_data: error queuing message");
                 PULSE_LED(ERR_IND_LED);
               }
             }
@@ -516,12 +565,12 @@ void process_input_data(byte i) {
             queues = QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL;
 
             if (!send_message_to_queues(queues, &cf, "gc_task", QUEUE_OP_TIMEOUT_NONE)) {
-              LOG("gc_task: process_input_data: error queuing message");
+              LOGE(LOG_MOD_GC, "gc_task: process_input_data: error queuing message");
               PULSE_LED(ERR_IND_LED);
             }
 
           } else {
-            LOG("gc_task: process_input_data: GCtoCAN returns error");
+            LOGW(LOG_MOD_GC, "gc_task: process_input_data: GCtoCAN returns error");
             PULSE_LED(ERR_IND_LED);
           }
 
@@ -546,53 +595,255 @@ void process_input_data(byte i) {
   } else {
 
     // should never be true, but ...
-    VLOG("gc_task: process_input_data: unexpectedly read 0 bytes from client = %d", i);
+    LOGW(LOG_MOD_GC, "gc_task: process_input_data: unexpectedly read 0 bytes from client = %d", i);
   }
 
   return;
 }
 
 //
-/// send GC message buffer to connected GC client, either network or serial
+/// per-client output
+///
+/// messages for each client are put in its own output ring, and sent from there as fast as its connection will
+/// take them, with writes that don't block; so a slow client, e.g. on poor WiFi, doesn't hold up the task and the
+/// other clients
+///
+/// if a client's ring is full, its policy decides whether the oldest messages are dropped to make room, or the
+/// connection is closed; the policy is set in the config, with a default for network clients, overrides for
+/// particular client addresses, and one for the serial client
 //
 
-bool send_message_to_client(byte i, const char *buffer, const size_t s) {
+//
+/// the overflow policy for a network client connecting from this address
+//
 
-  ssize_t b;
-  byte retries = 0;
-  bool ret = true;
+static byte overflow_policy(IPAddress ip) {
+
+  for (byte i = 0; i < GC_OVERFLOW_IPS; i++) {
+    if (config_data.gc_overflow_ip[i] != 0 && config_data.gc_overflow_ip[i] == (uint32_t)ip) {
+      return config_data.gc_overflow_ip_policy[i];
+    }
+  }
 
-  if (i == SERIAL_CLIENT && config_data.gc_serial_on) {
-    // send to serial client if configured
+  return config_data.gc_overflow_policy;
+}
 
-    if (Serial.availableForWrite() >= s) {
-      Serial.write((const uint8_t *)buffer, s);
-    } else {
-      LOG("gc_task: send_message_to_client: insufficient serial write buffer space");
-      PULSE_LED(ERR_IND_LED);
-      ret =  false;
+//
+/// clear a client's input state and output ring
+//
+
+static void reset_client(const byte i) {
+
+  gc_clients[i].buffer[0] = 0;                // in progress GC string buffer
+  gc_clients[i].idx = 0;                      // index into GC string buffer, where next char is stored
+  gc_clients[i].addr[0] = 0;                  // peer IP address
+  gc_clients[i].port = 0;                     // peer remote port
+  gc_clients[i].out_head = 0;
+  gc_clients[i].out_tail = 0;
+  gc_clients[i].out_used = 0;
+  gc_clients[i].out_partial = false;
+  gc_clients[i].policy = GC_OVERFLOW_DROP_OLDEST;
+  gc_clients[i].out_queued = 0;
+  gc_clients[i].out_done = 0;
+  gc_clients[i].out_sent = 0;
+  gc_clients[i].out_dropped = 0;
+  gc_clients[i].lag_timing = false;
+  gc_clients[i].lag_ms = 0;
+  gc_clients[i].max_lag_ms = 0;
+
+  return;
+}
+
+//
+/// close a network client's connection and free its slot
+//
+
+static void close_client(const byte i) {
+
+  gc_clients[i].client->stop();
+  delete gc_clients[i].client;
+  gc_clients[i].client = NULL;
+  reset_client(i);
+  --num_gc_clients;
+
+  return;
+}
+
+//
+/// drop the oldest whole messages in a client's output ring until there are at least len bytes free
+/// if the message at the tail has been partly sent, the rest of it is kept, so the client doesn't see half a message
+//
+
+static void drop_oldest(gcclient_t *gcc, size_t len) {
+
+  size_t keep = 0, freed = 0;
+
+  // find the end of the partly sent message
+  if (gcc->out_partial) {
+    while (keep < gcc->out_used && gcc->out[(gcc->out_tail + keep) % GC_OUT_RING_SIZE] != ';') {
+      ++keep;
     }
 
-  } else {
-    // send to network client
-    do {
-      b = gc_clients[i].client->write((const char *)buffer, s);
+    keep = (keep < gcc->out_used) ? keep + 1 : gcc->out_used;
+  }
 
-      if (b == -1) {
-        if (errno == EAGAIN && retries < max_retries) {
-          LOG("gc_task: send_message_to_client: retrying write to client");
-          vTaskDelay(1);
-          ++retries;
-          continue;
+  // count whole messages after it, until there's room
+  while (GC_OUT_RING_SIZE - gcc->out_used + freed < len && keep + freed < gcc->out_used) {
+    while (keep + freed < gcc->out_used && gcc->out[(gcc->out_tail + keep + freed) % GC_OUT_RING_SIZE] != ';') {
+      ++freed;
+    }
+
+    freed = (keep + freed < gcc->out_used) ? freed + 1 : freed;
+    ++gcc->out_dropped;
+  }
+
+  // move the rest of the partly sent message up against the messages that are left
+  for (size_t j = keep; j > 0; j--) {
+    gcc->out[(gcc->out_tail + freed + j - 1) % GC_OUT_RING_SIZE] = gcc->out[(gcc->out_tail + j - 1) % GC_OUT_RING_SIZE];
+  }
+
+  gcc->out_tail = (gcc->out_tail + freed) % GC_OUT_RING_SIZE;
+  gcc->out_used -= freed;
+  gcc->out_done += freed;
+
+  return;
+}
+
+//
+/// send as much of a client's output ring as its connection will take now
+//
+
+static void drain_client(const byte i) {
+
+  gcclient_t *gcc = &gc_clients[i];
+  size_t n;
+  ssize_t b;
+
+  while (gcc->out_used > 0) {
+
+    // the ring may wrap, so send the part up to the end first
+    n = GC_OUT_RING_SIZE - gcc->out_tail;
+    n = (n < gcc->out_used) ? n : gcc->out_used;
+
+    if (i == SERIAL_CLIENT) {
+      b = Serial.availableForWrite();
+      b = (b < (ssize_t)n) ? b : n;
+
+      if (b > 0) {
+        Serial.write((const uint8_t *)&gcc->out[gcc->out_tail], b);
+      }
+    } else {
+      b = send(gcc->client->fd(), &gcc->out[gcc->out_tail], n, MSG_DONTWAIT);
+
+      if (b > 0) {
+        ++gc_out_stats.writes;
+        gc_out_stats.bytes += b;
+      } else if (b < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          b = 0;
         } else {
-          VLOG("gc_task: send_message_to_client: error sending to client = %d, expected = %d, sent = %d, errno = %d %s", i, s, b, errno, strerror(errno));
+          LOGE(LOG_MOD_GC, "gc_task: error sending to client = %d, errno = %d %s, closing connection", i, errno, strerror(errno));
           ++errors.gc_tx;
           PULSE_LED(ERR_IND_LED);
-          ret = false;
+          close_client(i);
+          return;
         }
       }
-    } while (b < 0);
+    }
+
+    if (b <= 0) {
+      break;
+    }
+
+    gcc->out_partial = (gcc->out[(gcc->out_tail + b - 1) % GC_OUT_RING_SIZE] != ';');
+    gcc->out_tail = (gcc->out_tail + b) % GC_OUT_RING_SIZE;
+    gcc->out_used -= b;
+    gcc->out_done += b;
+    gcc->out_sent += b;
+
+    if ((size_t)b < n) {
+      break;
+    }
+  }
+
+  if (gcc->out_used == 0) {
+    gcc->out_partial = false;
   }
 
-  return ret;
+  // finish timing a message once it has gone
+  if (gcc->lag_timing && (long)(gcc->out_done - gcc->lag_mark) >= 0) {
+    gcc->lag_ms = millis() - gcc->lag_mark_ms;
+    gcc->max_lag_ms = (gcc->lag_ms > gcc->max_lag_ms) ? gcc->lag_ms : gcc->max_lag_ms;
+    gcc->lag_timing = false;
+  }
+
+  return;
+}
+
+//
+/// the time the oldest message being timed has waited, or the last one timed took, whichever is longer
+//
+
+unsigned long gc_client_lag_ms(const byte i) {
+
+  unsigned long waited = gc_clients[i].lag_timing ? millis() - gc_clients[i].lag_mark_ms : 0;
+  return (waited > gc_clients[i].lag_ms) ? waited : gc_clients[i].lag_ms;
+}
+
+//
+/// queue a GC message for a connected GC client, either network or serial; it's sent by drain_client
+/// returns false if it couldn't be queued, or the client was disconnected because it couldn't keep up
+//
+
+bool send_message_to_client(byte i, const char *buffer, const size_t s) {
+
+  gcclient_t *gcc = &gc_clients[i];
+
+  if (s > GC_OUT_RING_SIZE) {
+    return false;
+  }
+
+  // make room if the ring is full
+  if (GC_OUT_RING_SIZE - gcc->out_used < s) {
+    if (gcc->policy == GC_OVERFLOW_DISCONNECT && i != SERIAL_CLIENT) {
+      LOGW(LOG_MOD_GC, "gc_task: client = %d, %s/%d, can't keep up, closing connection", i, gcc->addr, gcc->port);
+      PULSE_LED(ERR_IND_LED);
+      close_client(i);
+      return false;
+    }
+
+    if (gcc->policy == GC_OVERFLOW_DISCONNECT) {
+      // discard everything waiting, rather than just enough to make room
+      LOGW(LOG_MOD_GC, "gc_task: serial client can't keep up, discarding output");
+      PULSE_LED(ERR_IND_LED);
+      drop_oldest(gcc, GC_OUT_RING_SIZE);
+    } else {
+      drop_oldest(gcc, s);
+    }
+
+    if (GC_OUT_RING_SIZE - gcc->out_used < s) {
+      return false;
+    }
+  }
+
+  if (gcc->out_used == 0) {
+    gcc->out_first_ms = millis();
+  }
+
+  for (size_t j = 0; j < s; j++) {
+    gcc->out[(gcc->out_head + j) % GC_OUT_RING_SIZE] = buffer[j];
+  }
+
+  gcc->out_head = (gcc->out_head + s) % GC_OUT_RING_SIZE;
+  gcc->out_used += s;
+  gcc->out_queued += s;
+
+  // start timing this message if none is being timed
+  if (!gcc->lag_timing) {
+    gcc->lag_timing = true;
+    gcc->lag_mark = gcc->out_queued;
+    gcc->lag_mark_ms = millis();
+  }
+
+  return true;
 }
@@ -0,0 +1,318 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+#include "cbusdefs.h"
+
+//
+/// session keepalive
+///
+/// a CANCAB sends a DKEEP for its CANCMD session every few seconds, and the command station releases the session
+/// if they stop; only the command station needs them, yet each one would cross the network and be reflected to
+/// every other slave
+///
+/// a slave absorbs the DKEEPs from its cab, and instead sends the master a small session message when the session
+/// changes and every KEEPALIVE_REFRESH_MS; the master sends a DKEEP to the layout for the slave every KEEPALIVE_DKEEP_MS
+/// the master stops if the session message is not refreshed in time, or the slave is removed from the peer table,
+/// so the command station still releases the session if the slave or its link goes away
+/// the slave ends the session when its cab releases the loco or stops sending DKEEPs
+//
+
+// variables declared in other source files
+extern config_t config_data;
+extern peer_state_t peers[MAX_NET_PEERS];
+extern portMUX_TYPE peer_mux;
+extern byte master_wire_version;
+extern signed int CANCMD_session_num;
+
+typedef struct {
+  int session;                    // -1 = none
+  uint16_t identifier;            // CAN identifier of the cab's DKEEPs
+  unsigned long seen_time;        // master: last session message; slave: last DKEEP from the cab
+  unsigned long sent_time;        // master: last DKEEP synthesised; slave: last session message
+  bool changed;                   // slave: session message due now
+} keepalive_state_t;
+
+static keepalive_state_t ka_peers[MAX_NET_PEERS];     // master: one per slave
+static keepalive_state_t ka_local;                    // slave: the local cab
+static portMUX_TYPE ka_mux = portMUX_INITIALIZER_UNLOCKED;
+
+keepalive_stats_t keepalive_stats;
+
+//
+/// initialise keepalive state
+//
+
+void keepalive_init(void) {
+
+  bzero(ka_peers, sizeof(ka_peers));
+  bzero(&ka_local, sizeof(ka_local));
+  bzero(&keepalive_stats, sizeof(keepalive_stats));
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    ka_peers[i].session = -1;
+  }
+
+  ka_local.session = -1;
+  return;
+}
+
+//
+/// slave - a frame from the local cab
+/// returns true if the frame is a DKEEP that the master will synthesise, and so need not be sent on
+//
+
+bool keepalive_local_frame(const twai_message_t *frame) {
+
+  if (config_data.role != ROLE_SLAVE || master_wire_version < NET_WIRE_VERSION_KEEPALIVE ||
+      frame->data_length_code < 2 || (frame->flags & (TWAI_MSG_FLAG_EXTD | TWAI_MSG_FLAG_RTR))) {
+    return false;
+  }
+
+  switch (frame->data[0]) {
+
+    case OPC_DKEEP:
+      portENTER_CRITICAL(&ka_mux);
+
+      if (ka_local.session != frame->data[1] || ka_local.identifier != frame->identifier) {
+        ka_local.session = frame->data[1];
+        ka_local.identifier = frame->identifier;
+        ka_local.changed = true;
+      }
+
+      ka_local.seen_time = millis();
+      portEXIT_CRITICAL(&ka_mux);
+
+      CANCMD_session_num = frame->data[1];
+      ++keepalive_stats.absorbed;
+      return true;
+
+    case OPC_KLOC:
+      portENTER_CRITICAL(&ka_mux);
+
+      if (ka_local.session == frame->data[1]) {
+        ka_local.session = -1;
+        ka_local.changed = true;
+      }
+
+      portEXIT_CRITICAL(&ka_mux);
+      break;
+  }
+
+  return false;
+}
+
+//
+/// master - a session message from a slave
+//
+
+void keepalive_session(const uint8_t *mac_addr, byte session, uint16_t identifier) {
+
+  int idx;
+
+  // hold the peer table lock while the slave's state is updated, so its slot can't be reused meanwhile
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = peer_find_locked(mac_addr)) < 0) {
+    portEXIT_CRITICAL(&peer_mux);
+    return;
+  }
+
+  ++keepalive_stats.refresh_rx;
+  portENTER_CRITICAL(&ka_mux);
+
+  if (session == NET_SESSION_NONE) {
+    ka_peers[idx].session = -1;
+  } else {
+    // a new session is kept alive straight away
+    if (ka_peers[idx].session != session) {
+      ka_peers[idx].sent_time = millis() - KEEPALIVE_DKEEP_MS;
+    }
+
+    ka_peers[idx].session = session;
+    ka_peers[idx].identifier = identifier;
+    ka_peers[idx].seen_time = millis();
+  }
+
+  portEXIT_CRITICAL(&ka_mux);
+
+  // split bus mode learns the slave's session from its DKEEPs, which no longer arrive
+  if (session != NET_SESSION_NONE) {
+    peers[idx].CANCMD_session = session;
+  }
+
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// master - a frame from a slave; releasing the loco ends the session at once
+//
+
+void keepalive_peer_frame(const uint8_t *mac_addr, const twai_message_t *frame) {
+
+  int idx;
+
+  if (frame->data_length_code < 2 || frame->data[0] != OPC_KLOC) {
+    return;
+  }
+
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = peer_find_locked(mac_addr)) >= 0) {
+    portENTER_CRITICAL(&ka_mux);
+
+    if (ka_peers[idx].session == frame->data[1]) {
+      ka_peers[idx].session = -1;
+    }
+
+    portEXIT_CRITICAL(&ka_mux);
+  }
+
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// master - forget the session of a slave, when it is added to or removed from the peer table
+//
+
+void keepalive_peer_reset(int idx) {
+
+  if (idx < 0 || idx >= MAX_NET_PEERS) {
+    return;
+  }
+
+  portENTER_CRITICAL(&ka_mux);
+  ka_peers[idx].session = -1;
+  portEXIT_CRITICAL(&ka_mux);
+  return;
+}
+
+//
+/// send the slave's session message, or the master's synthesised DKEEPs, when due
+/// called regularly from the net send task
+//
+
+void keepalive_poll(void) {
+
+  uint8_t msg[NET_MSG_SESSION_LEN];
+  twai_message_t frame;
+  int session;
+  bool due;
+
+  if (config_data.role == ROLE_SLAVE) {
+
+    portENTER_CRITICAL(&ka_mux);
+
+    // the cab has stopped sending DKEEPs
+    if (ka_local.session >= 0 && millis() - ka_local.seen_time >= KEEPALIVE_EXPIRE_MS) {
+      ka_local.session = -1;
+      ka_local.changed = true;
+    }
+
+    due = ka_local.changed || (ka_local.session >= 0 && millis() - ka_local.sent_time >= KEEPALIVE_REFRESH_MS);
+    session = ka_local.session;
+    msg[0] = NET_MSG_SESSION;
+    msg[1] = (session >= 0) ? session : NET_SESSION_NONE;
+    msg[2] = highByte(ka_local.identifier);
+    msg[3] = lowByte(ka_local.identifier);
+
+    if (due) {
+      ka_local.changed = false;
+      ka_local.sent_time = millis();
+    }
+
+    portEXIT_CRITICAL(&ka_mux);
+
+    if (due && master_wire_version >= NET_WIRE_VERSION_KEEPALIVE) {
+      if (net_send_control(msg)) {
+        ++keepalive_stats.refresh_tx;
+      }
+    }
+
+    return;
+  }
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+
+    portENTER_CRITICAL(&ka_mux);
+
+    if (ka_peers[i].session < 0) {
+      portEXIT_CRITICAL(&ka_mux);
+      continue;
+    }
+
+    // the slave or its link has gone away - stop, so the command station releases the session
+    if (millis() - ka_peers[i].seen_time >= KEEPALIVE_EXPIRE_MS) {
+      ka_peers[i].session = -1;
+      portEXIT_CRITICAL(&ka_mux);
+      VLOG("keepalive_poll: session keepalive expired for peer = %d", i);
+      ++keepalive_stats.expired;
+      continue;
+    }
+
+    due = (millis() - ka_peers[i].sent_time >= KEEPALIVE_DKEEP_MS);
+
+    if (due) {
+      ka_peers[i].sent_time = millis();
+      bzero(&frame, sizeof(frame));
+      frame.identifier = ka_peers[i].identifier;
+      frame.data_length_code = 2;
+      frame.data[0] = OPC_DKEEP;
+      frame.data[1] = ka_peers[i].session;
+    }
+
+    portEXIT_CRITICAL(&ka_mux);
+
+    // the DKEEP goes wherever a frame from the slave would, except to the other slaves
+    if (due) {
+      if (send_message_to_queues(QUEUE_CAN_OUT_FROM_NET | QUEUE_GC_OUT | QUEUE_WITHROTTLE_IN | QUEUE_CMDPROXY_IN | QUEUE_CBUS_EXTERNAL,
+                                 &frame, "keepalive_poll", QUEUE_OP_TIMEOUT_NONE)) {
+        ++keepalive_stats.synthesised;
+      }
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,136 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+#if LATENCY_BENCHMARK
+
+//
+/// per-hop forwarding latency benchmark
+/// latency is measured from the time a frame is placed in the frame pool to the time it is handed to the outbound driver or client
+/// samples are recorded in log2 microsecond buckets, so percentiles are reported as the upper bound of the bucket they fall in
+//
+
+static const char *hop_names[LAT_NUM_HOPS] = { "net->CAN", "GC->CAN", "WI->CAN", "net out", "GC out" };
+static volatile uint32_t lat_hist[LAT_NUM_HOPS][LAT_NUM_BUCKETS];
+static volatile uint32_t lat_max[LAT_NUM_HOPS];
+static volatile uint32_t lat_count[LAT_NUM_HOPS];
+
+//
+/// record a latency sample for a hop
+//
+
+void latency_record(byte hop, unsigned long usecs) {
+
+  byte b = (usecs == 0) ? 0 : (32 - __builtin_clz(usecs));
+
+  if (hop >= LAT_NUM_HOPS) {
+    return;
+  }
+
+  if (b >= LAT_NUM_BUCKETS) {
+    b = LAT_NUM_BUCKETS - 1;
+  }
+
+  ++lat_hist[hop][b];
+  ++lat_count[hop];
+
+  if (usecs > lat_max[hop]) {
+    lat_max[hop] = usecs;
+  }
+
+  return;
+}
+
+//
+/// return the upper bound of the bucket containing the given percentile
+//
+
+static unsigned long latency_percentile(byte hop, byte pct) {
+
+  uint32_t target = (lat_count[hop] * pct + 99) / 100, sum = 0;
+
+  for (byte b = 0; b < LAT_NUM_BUCKETS; b++) {
+    sum += lat_hist[hop][b];
+
+    if (sum >= target) {
+      return (1UL << b);
+    }
+  }
+
+  return lat_max[hop];
+}
+
+//
+/// format the percentiles for a hop, returns false if there are no samples
+//
+
+bool latency_format(byte hop, char *buffer, size_t len) {
+
+  if (hop >= LAT_NUM_HOPS || lat_count[hop] == 0) {
+    return false;
+  }
+
+  snprintf(buffer, len, "%s: n = %u, p50 < %lu us, p90 < %lu us, p99 < %lu us, max = %u us", hop_names[hop], lat_count[hop], \
+           latency_percentile(hop, 50), latency_percentile(hop, 90), latency_percentile(hop, 99), lat_max[hop]);
+  return true;
+}
+
+//
+/// log the percentiles for all hops with samples
+//
+
+void latency_report(void) {
+
+  char tbuff[128];
+
+  for (byte i = 0; i < LAT_NUM_HOPS; i++) {
+    if (latency_format(i, tbuff, sizeof(tbuff))) {
+      VLOG("latency: %s", tbuff);
+    }
+  }
+
+  return;
+}
+
+#endif
@@ -44,6 +44,97 @@
 
 extern QueueHandle_t logger_in_queue, led_cmd_queue;
 
+//
+/// activity LEDs
+///
+/// PULSE_LED is called several times for every frame; rather than queueing a command to this task each time, it
+/// sets a bit for the LED, and the task, which runs every LED_TICK, takes and clears the bits and pulses the LEDs
+/// that have seen activity; a 5 ms pulse can't show more than that anyway
+///
+/// the command queue is still used for changes of mode, e.g. blink or fast blink
+//
+
+static volatile uint32_t led_activity = 0;
+
+//
+/// apply a command to an LED
+//
+
+static void led_apply(led_state_t *ls, byte cmd, byte val) {
+
+  if (cmd == LED_PULSE || (ls->last_cmd != cmd)) {      // process only if one-shot pulse or different command
+
+    // set LED state
+    ls->type = cmd;
+    ls->val = val;
+    ls->last_cmd = cmd;
+    ls->next_time = 0;                                  // schedule initial state change immediately
+
+    switch (cmd) {
+      case LED_OFF:                                     // switch off initially
+        ls->curr_state = LED_ON;
+        ls->next_state = LED_OFF;
+        break;
+
+      case LED_ON:                                      // switch on initially
+      case LED_BLINK:
+      case LED_FAST_BLINK:
+      case LED_PULSE:
+      case LED_LONG_BLINK:
+      case LED_SHORT_BLINK:
+        ls->curr_state = LED_OFF;
+        ls->next_state = LED_ON;
+        break;
+
+      default:
+        LOG("led_task: unknown command");
+        break;
+    }
+  }
+
+  return;
+}
+
+#if LED_BENCHMARK
+
+//
+/// compare the cost of an activity pulse with queueing a command for it, as it used to be
+/// the queue figure includes receiving the command, but not the switch to this task that used to follow each one
+//
+
+static void led_benchmark(void) {
+
+  const unsigned int iterations = 1000;
+  uint32_t start, flags, queued;
+  led_command_t lc = { CAN_ACT_LED, LED_PULSE, 0 };
+
+  start = xthal_get_ccount();
+
+  for (unsigned int i = 0; i < iterations; i++) {
+    PULSE_LED(CAN_ACT_LED);
+  }
+
+  flags = (xthal_get_ccount() - start) / iterations;
+
+  start = xthal_get_ccount();
+
+  for (unsigned int i = 0; i < iterations; i++) {
+    xQueueSend(led_cmd_queue, &lc, QUEUE_OP_TIMEOUT_NONE);
+    xQueueReceive(led_cmd_queue, &lc, QUEUE_OP_TIMEOUT_NONE);
+  }
+
+  queued = (xthal_get_ccount() - start) / iterations;
+
+  // estimate for 1000 frames/s, each pulsing an LED three times, e.g. CAN RX, net TX and GC TX
+  unsigned long saved_us = ((queued > flags) ? (queued - flags) : 0) * 3000UL / (getCpuFrequencyMhz());
+
+  VLOG("led_benchmark: cycles per pulse, flags = %lu, queued = %lu; saves about %lu us/s at 1000 frames/s", \
+       flags, queued, saved_us);
+  return;
+}
+
+#endif
+
 //
 /// implements a task to offload LED timing and control from other tasks
 //
@@ -54,6 +145,8 @@ void led_task(void *params) {
 
   led_command_t cmd;
   led_state_t led_states[NUM_LEDS] = {};
+  uint32_t activity;
+  TickType_t last_wake;
 
   LOG("led_task: task starting");
 
@@ -74,39 +167,28 @@ void led_task(void *params) {
     digitalWrite(led_states[i].pin, LOW);
   }
 
-  for (;;) {
-
-    // get next command from the input queue
-    if (xQueueReceive(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
+#if LED_BENCHMARK
+  led_benchmark();
+#endif
 
-      if (cmd.cmd == LED_PULSE || (led_states[cmd.led].last_cmd != cmd.cmd)) {      // process only if one-shot pulse or different command
+  last_wake = xTaskGetTickCount();
 
-        // set LED state
-        led_states[cmd.led].type = cmd.cmd;
-        led_states[cmd.led].val = cmd.val;
-        led_states[cmd.led].last_cmd = cmd.cmd;
-        led_states[cmd.led].next_time = 0;                // schedule initial state change immediately
+  for (;;) {
 
-        switch (cmd.cmd) {
-          case LED_OFF:                                   // switch off initially
-            led_states[cmd.led].curr_state = LED_ON;
-            led_states[cmd.led].next_state = LED_OFF;
-            break;
+    // apply any mode commands from the input queue
+    while (xQueueReceive(led_cmd_queue, &cmd, QUEUE_OP_TIMEOUT_NONE) == pdTRUE) {
+      if (cmd.led < NUM_LEDS) {
+        led_apply(&led_states[cmd.led], cmd.cmd, cmd.val);
+      }
+    }
 
-          case LED_ON:                                    // switch on initially
-          case LED_BLINK:
-          case LED_FAST_BLINK:
-          case LED_PULSE:
-          case LED_LONG_BLINK:
-          case LED_SHORT_BLINK:
-            led_states[cmd.led].curr_state = LED_OFF;
-            led_states[cmd.led].next_state = LED_ON;
-            break;
+    // take the activity seen since the last pass, and pulse those LEDs
+    activity = __atomic_exchange_n(&led_activity, 0, __ATOMIC_RELAXED);
 
-          default:
-            LOG("led_task: unknown command");
-            break;
-        }
+    for (byte i = 0; activity && i < NUM_LEDS; i++) {
+      if (activity & (1UL << i)) {
+        led_apply(&led_states[i], LED_PULSE, 0);
+        activity &= ~(1UL << i);
       }
     }
 
@@ -153,18 +235,18 @@ void led_task(void *params) {
         }   // switch type
       }   // if state change due
     }   // for each led
+
+    vTaskDelayUntil(&last_wake, LED_TICK);
   }   // for (;;)
 }
 
 //
 /// convenience function to pulse an LED
+/// safe to call from any task or an ISR; it only sets the LED's activity bit
+//
 
-void PULSE_LED(byte led) {
-
-  led_command_t lc;
+void IRAM_ATTR PULSE_LED(byte led) {
 
-  lc.led = led;
-  lc.cmd = LED_PULSE;
-  xQueueSend(led_cmd_queue, &lc, QUEUE_OP_TIMEOUT_NONE);
+  __atomic_fetch_or(&led_activity, 1UL << led, __ATOMIC_RELAXED);
   return;
 }
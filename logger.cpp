@@ -42,32 +42,556 @@
 #include <WiFi.h>
 #include <SPIFFS.h>
 #include <HardwareSerial.h>
+#include "soc/soc_memory_layout.h"
 #include "defs.h"
 
-extern QueueHandle_t logger_in_queue;
 extern config_t config_data;
 
 HardwareSerial AltSerial(1);      // UART2
 
+//
+/// deferred logging
+///
+/// LOG and VLOG don't format the message; they put a compact record in a ring for the current core, holding the
+/// timestamp, a pointer to the format string and the raw arguments, and the logger task formats it later
+/// a format string is parsed once, the first time it is used, and the argument types cached by its address
+///
+/// format strings and string arguments in flash are kept as pointers; other strings, e.g. a frame formatted into
+/// a buffer, are copied into the record, as they may have changed by the time the record is formatted
+/// a record that can't be deferred, e.g. a format with too many arguments, or string arguments too long to copy into
+/// the record, is formatted by the caller as before
+/// a message longer than a record can hold, e.g. one formatted by the caller, is copied into one of a few spill
+/// buffers per ring, so it keeps its full DEBUG_MSG_LEN; if they are all in use, it is cut short and counted
+///
+/// the rings don't block; a record is dropped if its ring is full, and the number dropped is logged later
+//
+
+enum {
+  LOG_ARG_WORD = 0,               // int, char, pointer, long
+  LOG_ARG_DWORD,                  // long long
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STR                     // string, either a pointer or LOG_STR_COPIED
+};
+
+#define LOG_STR_COPIED 1          // not a valid string pointer; the string was copied into the record
+
+typedef struct {
+  unsigned long m;                // timestamp, us
+  const char *fmt;                // format string, in flash; NULL if the message is args[0] or str
+  uint32_t kinds;                 // LOG_ARG_* for each conversion, 2 bits each
+  byte num_convs;                 // conversions in the format
+  byte str_len;                   // bytes of str used
+  bool spilled;                   // the message is in the ring's next spill buffer, not in str
+  uint32_t args[LOG_REC_ARGS];
+  char str[LOG_REC_STR];          // copied strings, each NUL-terminated, in argument order
+} log_record_t;
+
+typedef struct {
+  const char *fmt;
+  uint32_t kinds;
+  byte num_convs;
+  bool deferrable;
+} log_format_cache_t;
+
+typedef struct {
+  log_record_t rec[LOG_RING_SIZE];
+  unsigned int head, tail;
+  char spill[LOG_SPILL_SLOTS][DEBUG_MSG_LEN];   // long messages, used in the same order as the records
+  unsigned int spill_head, spill_tail;
+  log_format_cache_t cache[LOG_FORMAT_CACHE_SIZE];
+  portMUX_TYPE mux;
+} log_ring_t;
+
+static log_ring_t log_rings[2] = {
+  { {}, 0, 0, {}, 0, 0, {}, portMUX_INITIALIZER_UNLOCKED },
+  { {}, 0, 0, {}, 0, 0, {}, portMUX_INITIALIZER_UNLOCKED }
+};
+
+static TaskHandle_t logger_task_handle = NULL;
+
+log_stats_t log_stats;
+
+// runtime levels for levelled log sites, set from the webserver
+byte log_levels[LOG_NUM_MODULES] = { LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO, LOG_LVL_INFO };
+const char *log_module_names[LOG_NUM_MODULES] = { "CAN", "NET", "GC", "WT", "PROXY", "CBUS", "WEB" };
+const char *log_level_names[LOG_NUM_LEVELS] = { "none", "error", "warning", "info", "debug", "verbose" };
+
+//
+/// find the end of a conversion specification, and the type of argument it takes
+/// returns a pointer to the conversion character, or NULL if the spec is not supported; class is -1 for %%
+//
+
+static const char *parse_spec(const char *p, int *arg_class) {
+
+  bool dword = false;
+
+  // flags, width and precision; * takes an argument, which we don't support
+  while (*p && strchr("-+ #0123456789.", *p)) {
+    ++p;
+  }
+
+  // length modifiers
+  while (*p && strchr("hlLjzt", *p)) {
+    if ((*p == 'l' && p[1] == 'l') || *p == 'j' || *p == 'L') {
+      dword = true;
+    }
+
+    p += (*p == 'l' && p[1] == 'l') ? 2 : 1;
+  }
+
+  switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c': case 'p':
+      *arg_class = dword ? LOG_ARG_DWORD : LOG_ARG_WORD;
+      return p;
+
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+      *arg_class = LOG_ARG_DOUBLE;
+      return p;
+
+    case 's':
+      *arg_class = LOG_ARG_STR;
+      return p;
+
+    case '%':
+      *arg_class = -1;
+      return p;
+
+    default:
+      return NULL;
+  }
+}
+
+//
+/// parse a format string into a cache entry
+//
+
+static void parse_format(const char *fmt, log_format_cache_t *fc) {
+
+  const char *p = fmt;
+  byte words = 0;
+  int arg_class;
+
+  fc->fmt = fmt;
+  fc->kinds = 0;
+  fc->num_convs = 0;
+  fc->deferrable = esp_ptr_in_drom(fmt);
+
+  while (fc->deferrable && (p = strchr(p, '%')) != NULL) {
+    p = parse_spec(p + 1, &arg_class);
+
+    if (p == NULL || fc->num_convs >= LOG_REC_ARGS) {
+      fc->deferrable = false;
+      break;
+    }
+
+    if (arg_class >= 0) {
+      words += (arg_class == LOG_ARG_DWORD || arg_class == LOG_ARG_DOUBLE) ? 2 : 1;
+      fc->kinds |= (uint32_t)arg_class << (2 * fc->num_convs);
+      ++fc->num_convs;
+    }
+
+    ++p;
+  }
+
+  if (words > LOG_REC_ARGS) {
+    fc->deferrable = false;
+  }
+
+  return;
+}
+
+//
+/// claim the next record in the current core's ring, and return it with the ring locked, or NULL if the ring is full
+//
+
+static log_record_t *ring_claim(log_ring_t **ringp) {
+
+  log_ring_t *ring = &log_rings[xPortGetCoreID() & 1];
+
+  portENTER_CRITICAL(&ring->mux);
+
+  if (ring->head - ring->tail >= LOG_RING_SIZE) {
+    ++log_stats.dropped;
+    portEXIT_CRITICAL(&ring->mux);
+    return NULL;
+  }
+
+  *ringp = ring;
+  return &ring->rec[ring->head % LOG_RING_SIZE];
+}
+
+static void ring_commit(log_ring_t *ring) {
+
+  bool wake;
+
+  ++ring->head;
+  ++log_stats.records;
+  wake = (ring->head - ring->tail == LOG_RING_SIZE / 2);
+  portEXIT_CRITICAL(&ring->mux);
+
+  // the logger polls, but is woken early if a burst of messages half fills a ring
+  if (wake && logger_task_handle != NULL) {
+    xTaskNotifyGive(logger_task_handle);
+  }
+
+  return;
+}
+
+//
+/// log a message with a timestamp
+//
+
+void LOG(const char s[]) {
+
+  log_ring_t *ring;
+  log_record_t *rec = ring_claim(&ring);
+
+  if (rec == NULL) {
+    return;
+  }
+
+  rec->m = micros();
+  rec->num_convs = 0;
+
+  rec->fmt = NULL;
+  rec->kinds = LOG_ARG_STR;
+  rec->spilled = false;
+  rec->str_len = 0;
+
+  if (esp_ptr_in_drom(s)) {
+    rec->args[0] = (uint32_t)s;
+  } else {
+    rec->args[0] = LOG_STR_COPIED;
+    size_t len = strnlen(s, DEBUG_MSG_LEN - 1);
+
+    if (len >= LOG_REC_STR && ring->spill_head - ring->spill_tail < LOG_SPILL_SLOTS) {
+      // too long for the record, so use a spill buffer
+      char *sp = ring->spill[ring->spill_head++ % LOG_SPILL_SLOTS];
+      memcpy(sp, s, len);
+      sp[len] = 0;
+      rec->spilled = true;
+    } else {
+      if (len >= LOG_REC_STR) {
+        len = LOG_REC_STR - 1;
+        ++log_stats.truncated;
+      }
+
+      memcpy(rec->str, s, len);
+      rec->str[len] = 0;
+      rec->str_len = len + 1;
+    }
+  }
+
+  ring_commit(ring);
+  return;
+}
+
+//
+/// format a message now, in the caller, for a record that can't be deferred
+//
+
+static void log_now(const char *fmt, va_list args) {
+
+  char tmpbuff[DEBUG_MSG_LEN];
+
+  vsnprintf(tmpbuff, sizeof(tmpbuff), fmt, args);
+  LOG(tmpbuff);
+  return;
+}
+
+//
+/// log a message with a variable number of arguments
+//
+
+void VLOG(const char fmt[], ...) {
+
+  va_list vptr, vcopy;
+  log_ring_t *ring;
+  log_record_t *rec = ring_claim(&ring);
+  log_format_cache_t *fc;
+  byte w = 0;
+  const char *s;
+  size_t len;
+
+  if (rec == NULL) {
+    return;
+  }
+
+  rec->m = micros();
+  va_start(vptr, fmt);
+  va_copy(vcopy, vptr);
+
+  // look up the format, parsing it the first time it is seen
+  fc = &ring->cache[((uint32_t)fmt >> 2) % LOG_FORMAT_CACHE_SIZE];
+
+  if (fc->fmt != fmt) {
+    parse_format(fmt, fc);
+  }
+
+  if (!fc->deferrable) {
+    // give up the record and format the message now, outside the lock, as the old logger did
+    portEXIT_CRITICAL(&ring->mux);
+    va_end(vptr);
+    log_now(fmt, vcopy);
+    va_end(vcopy);
+    return;
+  }
+
+  rec->fmt = fmt;
+  rec->kinds = fc->kinds;
+  rec->num_convs = fc->num_convs;
+  rec->str_len = 0;
+  rec->spilled = false;
+
+  for (byte i = 0; i < fc->num_convs; i++) {
+    switch ((fc->kinds >> (2 * i)) & 3) {
+      case LOG_ARG_WORD:
+        rec->args[w++] = va_arg(vptr, uint32_t);
+        break;
+
+      case LOG_ARG_DWORD: {
+          uint64_t d = va_arg(vptr, uint64_t);
+          rec->args[w++] = (uint32_t)d;
+          rec->args[w++] = (uint32_t)(d >> 32);
+        }
+        break;
+
+      case LOG_ARG_DOUBLE: {
+          double f = va_arg(vptr, double);
+          memcpy(&rec->args[w], &f, sizeof(f));
+          w += 2;
+        }
+        break;
+
+      case LOG_ARG_STR:
+        s = va_arg(vptr, const char *);
+
+        if (s == NULL || esp_ptr_in_drom(s)) {
+          rec->args[w++] = (uint32_t)s;
+        } else if ((len = strnlen(s, LOG_REC_STR)) < LOG_REC_STR - rec->str_len) {
+          // copy it, and note that this argument is in the record
+          memcpy(rec->str + rec->str_len, s, len);
+          rec->str[rec->str_len + len] = 0;
+          rec->str_len += len + 1;
+          rec->args[w++] = LOG_STR_COPIED;
+        } else {
+          // no room; give up the record and format the message now
+          portEXIT_CRITICAL(&ring->mux);
+          va_end(vptr);
+          log_now(fmt, vcopy);
+          va_end(vcopy);
+          return;
+        }
+
+        break;
+    }
+  }
+
+  va_end(vptr);
+  va_end(vcopy);
+  ring_commit(ring);
+  return;
+}
+
+//
+/// format a record into a buffer, one conversion at a time
+//
+
+static void format_record(const log_record_t *rec, const char *spill, char *buffer, size_t len) {
+
+  const char *p, *q, *copied = rec->str;
+  char spec[16];
+  size_t n = 0;
+  byte conv = 0, w = 0;
+  int arg_class;
+
+  buffer[0] = 0;
+
+  if (rec->fmt == NULL) {
+    strncpy(buffer, rec->spilled ? spill : (rec->args[0] == LOG_STR_COPIED) ? rec->str : (const char *)rec->args[0], len - 1);
+    buffer[len - 1] = 0;
+    return;
+  }
+
+  for (p = rec->fmt; *p && n < len - 1; ) {
+
+    if (*p != '%') {
+      buffer[n++] = *p++;
+      continue;
+    }
+
+    q = parse_spec(p + 1, &arg_class);
+
+    if (arg_class < 0) {
+      buffer[n++] = '%';
+      p = q + 1;
+      continue;
+    }
+
+    // copy the spec, so it can be used to format the single argument
+    size_t sl = q - p + 1;
+
+    if (sl >= sizeof(spec)) {
+      sl = sizeof(spec) - 1;
+    }
+
+    memcpy(spec, p, sl);
+    spec[sl] = 0;
+
+    switch ((rec->kinds >> (2 * conv)) & 3) {
+      case LOG_ARG_WORD:
+        snprintf(buffer + n, len - n, spec, rec->args[w++]);
+        break;
+
+      case LOG_ARG_DWORD:
+        snprintf(buffer + n, len - n, spec, rec->args[w] | ((uint64_t)rec->args[w + 1] << 32));
+        w += 2;
+        break;
+
+      case LOG_ARG_DOUBLE: {
+          double f;
+          memcpy(&f, &rec->args[w], sizeof(f));
+          snprintf(buffer + n, len - n, spec, f);
+          w += 2;
+        }
+        break;
+
+      case LOG_ARG_STR:
+        if (rec->args[w] == LOG_STR_COPIED) {
+          snprintf(buffer + n, len - n, spec, copied);
+          copied += strlen(copied) + 1;
+        } else {
+          snprintf(buffer + n, len - n, spec, (const char *)rec->args[w]);
+        }
+
+        ++w;
+        break;
+    }
+
+    n += strlen(buffer + n);
+    ++conv;
+    p = q + 1;
+  }
+
+  buffer[n] = 0;
+  return;
+}
+
+//
+/// take the oldest record from either ring, and its message if it was spilled
+//
+
+static bool ring_take(log_record_t *rec, char *spill) {
+
+  log_ring_t *ring = NULL;
+  unsigned long oldest = 0;
+
+  for (byte c = 0; c < 2; c++) {
+    log_ring_t *r = &log_rings[c];
+
+    portENTER_CRITICAL(&r->mux);
+
+    if (r->head != r->tail) {
+      unsigned long m = r->rec[r->tail % LOG_RING_SIZE].m;
+
+      if (ring == NULL || (long)(m - oldest) < 0) {
+        ring = r;
+        oldest = m;
+      }
+    }
+
+    portEXIT_CRITICAL(&r->mux);
+  }
+
+  if (ring == NULL) {
+    return false;
+  }
+
+  portENTER_CRITICAL(&ring->mux);
+  memcpy(rec, &ring->rec[ring->tail % LOG_RING_SIZE], sizeof(log_record_t));
+  ++ring->tail;
+
+  if (rec->spilled) {
+    strcpy(spill, ring->spill[ring->spill_tail++ % LOG_SPILL_SLOTS]);
+  }
+
+  portEXIT_CRITICAL(&ring->mux);
+
+  return true;
+}
+
+#if LOG_BENCHMARK
+
+//
+/// compare the cost to the caller of the deferred logger with formatting and queueing the message, as it used to be
+//
+
+static void log_benchmark(void) {
+
+  const unsigned int iterations = LOG_RING_SIZE / 2;
+  uint32_t start, deferred, immediate;
+  char tmpbuff[DEBUG_MSG_LEN];
+  unsigned long saved_dropped = log_stats.dropped;
+  log_record_t rec;
+
+  start = xthal_get_ccount();
+
+  for (unsigned int i = 0; i < iterations; i++) {
+    VLOG("log_benchmark: frame = %d, canid = %d, opcode = 0x%02x, %s", i, 37, 0x47, "test");
+  }
+
+  deferred = xthal_get_ccount() - start;
+
+  // discard them before they're seen
+  while (ring_take(&rec, tmpbuff));
+  log_stats.dropped = saved_dropped;
+
+  start = xthal_get_ccount();
+
+  for (unsigned int i = 0; i < iterations; i++) {
+    log_message_t lm;
+    lm.m = micros();
+    snprintf(tmpbuff, DEBUG_MSG_LEN - 1, "log_benchmark: frame = %d, canid = %d, opcode = 0x%02x, %s", i, 37, 0x47, "test");
+    strncpy(lm.s, tmpbuff, DEBUG_MSG_LEN - 1);
+  }
+
+  immediate = xthal_get_ccount() - start;
+
+  VLOG("log_benchmark: cycles per message, deferred = %lu, formatted by caller = %lu (excluding queue send)", \
+       deferred / iterations, immediate / iterations);
+  return;
+}
+
+#endif
+
 //
 /// task to log error and debug messages to a file and a serial port
 //
 
 void logger_task(void *params) {
 
-  log_message_t lm;
+  log_record_t rec;
+  char msg[DEBUG_MSG_LEN];
+  char spill[DEBUG_MSG_LEN];
   char tmp[16];
-  File file;
   bool file_is_open = false;
   bool output_port_changed = false, debug_changed = false;
+  unsigned long reported_dropped = 0, reported_truncated = 0;
 
   // initialise main serial/USB port
   Serial.begin(115200);
   Serial.setTimeout(1);
 
+  logger_task_handle = xTaskGetCurrentTaskHandle();
+  logtail_init();
+
   LOG("logger_task: logger task starting");
   VLOG("logger_task: debug = %d", config_data.debug);
 
+#if LOG_BENCHMARK
+  log_benchmark();
+#endif
+
   // infinite loop
   for (;;) {
 
@@ -82,16 +606,10 @@ void logger_task(void *params) {
         LOG("logger_task: SPIFFS mounted");
       }
 
-      // copy debug file to backup
-      if (SPIFFS.exists(DEBUG_FILE)) {
-        SPIFFS.rename(DEBUG_FILE, DEBUG_FILE_PREV);
-      }
-
       VLOG("logger_task: SPIFFS: bytes total = %d, used = %d", SPIFFS.totalBytes(), SPIFFS.usedBytes());
 
-      file = SPIFFS.open(DEBUG_FILE, FILE_WRITE);
-
-      if (!file) {
+      // start a new debug log segment, keeping the previous ones
+      if (!logsink_begin()) {
         LOG("logger_task: error opening debug file");
       } else {
         LOG("logger_task: opened debug file");
@@ -107,57 +625,46 @@ void logger_task(void *params) {
       output_port_changed = true;
     }
 
-    // process the incoming message queue
-    if (xQueueReceive(logger_in_queue, &lm, QUEUE_OP_TIMEOUT_SHORT) == pdTRUE) {
-      sprintf(tmp, "%11.6f: ", (float)(lm.m / 1000000.0));
-
-      // write to file
-      if (config_data.debug && file_is_open) {
-        file.print(tmp);
-        file.println(lm.s);
-        file.flush();
-      }
-
-      // write to console
-      if (output_port_changed) {
-        AltSerial.print(tmp);
-        AltSerial.println(lm.s);
-      } else {
-        Serial.print(tmp);
-        Serial.println(lm.s);
-      }
+    // note any records lost because a ring was full
+    if (log_stats.dropped != reported_dropped) {
+      VLOG("logger_task: %lu log messages dropped", log_stats.dropped - reported_dropped);
+      reported_dropped = log_stats.dropped;
     }
-  }
-}
-
-//
-/// convenience function to log a message with a timestamp
-//
-
-void LOG(const char s[]) {
 
-  log_message_t lm;
-
-  lm.m = micros();
-  strncpy(lm.s, s, DEBUG_MSG_LEN - 1);
+    if (log_stats.truncated != reported_truncated) {
+      VLOG("logger_task: %lu log messages cut short, spill buffers full", log_stats.truncated - reported_truncated);
+      reported_truncated = log_stats.truncated;
+    }
 
-  xQueueSend(logger_in_queue, &lm, QUEUE_OP_TIMEOUT_SHORT);
-  return;
-}
+    // write out buffered debug file lines that have waited long enough
+    if (file_is_open) {
+      logsink_poll();
+    }
 
-//
-/// log a message with a variable number of arguments
-//
+    // format and output the waiting records, oldest first
+    if (!ring_take(&rec, spill)) {
+      ulTaskNotifyTake(pdTRUE, LOG_POLL_TICKS);
+      continue;
+    }
 
-void VLOG(const char fmt[], ...) {
+    format_record(&rec, spill, msg, sizeof(msg));
+    sprintf(tmp, "%11.6f: ", (float)(rec.m / 1000000.0));
 
-  va_list vptr;
-  char tmpbuff[DEBUG_MSG_LEN];
+    // keep for the webserver and websocket clients
+    logtail_add(tmp, msg);
 
-  va_start(vptr, fmt);
-  vsnprintf(tmpbuff, DEBUG_MSG_LEN - 1, fmt, vptr);
-  va_end(vptr);
+    // add to the debug file buffer
+    if (config_data.debug && file_is_open) {
+      logsink_write(tmp, msg);
+    }
 
-  LOG(tmpbuff);
-  return;
+    // write to console
+    if (output_port_changed) {
+      AltSerial.print(tmp);
+      AltSerial.println(msg);
+    } else {
+      Serial.print(tmp);
+      Serial.println(msg);
+    }
+  }
 }
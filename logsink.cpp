@@ -0,0 +1,280 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include <SPIFFS.h>
+#include "defs.h"
+
+//
+/// buffered debug log file
+///
+/// writing each log line to SPIFFS and flushing it costs a flash program, and often an erase, per line, and keeps
+/// the logger task away from the rings for long enough to fill them
+///
+/// instead, lines are collected in RAM and written out a page at a time, once enough has built up to fill one or
+/// more pages, or when the oldest buffered line has waited for LOGSINK_FLUSH_MS; writes that end on a page
+/// boundary don't leave a part-filled page to be rewritten by the next one
+///
+/// the log is kept in LOGSINK_SEGMENTS files of about LOGSINK_SEGMENT_SIZE bytes each; DEBUG_FILE is the current
+/// segment and DEBUG_FILE.1, .2 ... are older ones; when the current segment is full, or at startup, the segments
+/// are shifted along and the oldest is deleted, so the space used is bounded and the same blocks aren't reused
+/// every time
+//
+
+#define LOGSINK_SEG_NAME_LEN 32
+
+static char logsink_buf[LOGSINK_BUF_SIZE];
+static size_t logsink_len = 0;                      // bytes waiting in the buffer
+static size_t logsink_seg_bytes = 0;                // bytes written to the current segment
+static unsigned long logsink_first_ms = 0;          // when the oldest buffered line was added
+static File logsink_file;
+static bool logsink_open = false;
+static SemaphoreHandle_t logsink_mutex = NULL;
+
+logsink_stats_t logsink_stats;
+
+//
+/// make the name of segment n; segment 0 is the current one
+//
+
+static void segment_name(byte n, char *name) {
+
+  if (n == 0) {
+    strcpy(name, DEBUG_FILE);
+  } else {
+    snprintf(name, LOGSINK_SEG_NAME_LEN, "%s.%d", DEBUG_FILE, n);
+  }
+
+  return;
+}
+
+//
+/// close the current segment, shift the older ones along, and start a new current segment
+//
+
+static bool segment_rotate(void) {
+
+  char from[LOGSINK_SEG_NAME_LEN], to[LOGSINK_SEG_NAME_LEN];
+
+  if (logsink_open) {
+    logsink_file.close();
+    logsink_open = false;
+  }
+
+  segment_name(LOGSINK_SEGMENTS - 1, to);
+
+  if (SPIFFS.exists(to)) {
+    SPIFFS.remove(to);
+  }
+
+  for (int i = LOGSINK_SEGMENTS - 2; i >= 0; i--) {
+    segment_name(i, from);
+    segment_name(i + 1, to);
+
+    if (SPIFFS.exists(from)) {
+      SPIFFS.rename(from, to);
+    }
+  }
+
+  logsink_file = SPIFFS.open(DEBUG_FILE, FILE_WRITE);
+  logsink_seg_bytes = 0;
+
+  if (!logsink_file) {
+    return false;
+  }
+
+  logsink_open = true;
+  ++logsink_stats.rotations;
+  return true;
+}
+
+//
+/// write the first len bytes of the buffer to the current segment, and keep the rest
+//
+
+static void flush_bytes(size_t len) {
+
+  unsigned long t;
+
+  if (len == 0 || !logsink_open) {
+    return;
+  }
+
+  t = micros();
+
+  if (logsink_file.write((const uint8_t *)logsink_buf, len) != len) {
+    ++logsink_stats.write_errors;
+  }
+
+  logsink_file.flush();
+
+  t = micros() - t;
+  logsink_stats.last_flush_us = t;
+  logsink_stats.total_flush_us += t;
+  logsink_stats.max_flush_us = (t > logsink_stats.max_flush_us) ? t : logsink_stats.max_flush_us;
+  logsink_stats.bytes_written += len;
+  ++logsink_stats.flushes;
+
+  logsink_seg_bytes += len;
+  logsink_len -= len;
+  memmove(logsink_buf, logsink_buf + len, logsink_len);
+  logsink_first_ms = millis();
+
+  // start a new segment if this one is full
+  if (logsink_seg_bytes >= LOGSINK_SEGMENT_SIZE) {
+    if (!segment_rotate()) {
+      ++logsink_stats.write_errors;
+    }
+  }
+
+  return;
+}
+
+//
+/// start logging to file; the existing segments are kept, and a new current segment started
+//
+
+bool logsink_begin(void) {
+
+  if (logsink_mutex == NULL) {
+    logsink_mutex = xSemaphoreCreateMutex();
+  }
+
+  xSemaphoreTake(logsink_mutex, portMAX_DELAY);
+
+  // tidy up the single backup file used by earlier versions
+  if (SPIFFS.exists(DEBUG_FILE_PREV)) {
+    SPIFFS.remove(DEBUG_FILE_PREV);
+  }
+
+  logsink_len = 0;
+  bool ret = segment_rotate();
+
+  xSemaphoreGive(logsink_mutex);
+  return ret;
+}
+
+//
+/// add a timestamped line to the buffer, and write out any whole pages
+//
+
+void logsink_write(const char *prefix, const char *msg) {
+
+  size_t plen = strlen(prefix), mlen = strlen(msg), n;
+
+  if (logsink_mutex == NULL || !logsink_open) {
+    return;
+  }
+
+  xSemaphoreTake(logsink_mutex, portMAX_DELAY);
+
+  // if the buffer is full, flash writes are failing or can't keep up; drop the line
+  if (logsink_len + plen + mlen + 2 > LOGSINK_BUF_SIZE) {
+    logsink_stats.bytes_dropped += plen + mlen + 2;
+    xSemaphoreGive(logsink_mutex);
+    return;
+  }
+
+  if (logsink_len == 0) {
+    logsink_first_ms = millis();
+  }
+
+  memcpy(logsink_buf + logsink_len, prefix, plen);
+  logsink_len += plen;
+  memcpy(logsink_buf + logsink_len, msg, mlen);
+  logsink_len += mlen;
+  logsink_buf[logsink_len++] = '\r';
+  logsink_buf[logsink_len++] = '\n';
+
+  // once there is enough for a full write, write up to the last page boundary in the file
+  if (logsink_len >= LOGSINK_FLUSH_BYTES) {
+    n = ((logsink_seg_bytes + logsink_len) / LOGSINK_PAGE_SIZE) * LOGSINK_PAGE_SIZE - logsink_seg_bytes;
+    flush_bytes(n);
+  }
+
+  xSemaphoreGive(logsink_mutex);
+  return;
+}
+
+//
+/// write out everything buffered if the oldest line has waited long enough; called periodically by the logger task
+//
+
+void logsink_poll(void) {
+
+  if (logsink_mutex == NULL || logsink_len == 0) {
+    return;
+  }
+
+  xSemaphoreTake(logsink_mutex, portMAX_DELAY);
+
+  if (logsink_len > 0 && millis() - logsink_first_ms >= LOGSINK_FLUSH_MS) {
+    flush_bytes(logsink_len);
+  }
+
+  xSemaphoreGive(logsink_mutex);
+  return;
+}
+
+//
+/// write out everything buffered now, e.g. before a restart or deep sleep
+//
+
+void logsink_sync(void) {
+
+  if (logsink_mutex == NULL) {
+    return;
+  }
+
+  xSemaphoreTake(logsink_mutex, portMAX_DELAY);
+  flush_bytes(logsink_len);
+  xSemaphoreGive(logsink_mutex);
+  return;
+}
+
+//
+/// bytes currently waiting to be written
+//
+
+size_t logsink_pending(void) {
+  return logsink_len;
+}
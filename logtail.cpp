@@ -0,0 +1,197 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// recent log messages, kept in RAM
+///
+/// the logger task adds every message it outputs, whether or not the debug file is enabled, so recent history can
+/// be read from the webserver (/log) or followed live over the websocket server, without writing to flash
+///
+/// messages are stored end to end in a byte ring, each preceded by its length; the oldest are discarded to make
+/// room for new ones; each message has a sequence number, so a reader can ask for everything after the last
+/// message it saw, and can tell if it has fallen behind and missed some
+//
+
+static char logtail_buf[LOGTAIL_SIZE];
+static size_t logtail_head = 0;                     // where the next message will be written
+static size_t logtail_tail = 0;                     // start of the oldest message
+static size_t logtail_used = 0;                     // bytes in use, including length words
+static unsigned long logtail_first_seq = 0;         // sequence number of the oldest message
+static unsigned long logtail_next = 0;              // sequence number of the next message
+static SemaphoreHandle_t logtail_mutex = NULL;
+
+//
+/// copy bytes in and out of the ring, wrapping at the end
+//
+
+static void ring_put(size_t pos, const char *src, size_t len) {
+
+  for (size_t i = 0; i < len; i++) {
+    logtail_buf[(pos + i) % LOGTAIL_SIZE] = src[i];
+  }
+
+  return;
+}
+
+static void ring_get(size_t pos, char *dst, size_t len) {
+
+  for (size_t i = 0; i < len; i++) {
+    dst[i] = logtail_buf[(pos + i) % LOGTAIL_SIZE];
+  }
+
+  return;
+}
+
+static uint16_t ring_len(size_t pos) {
+
+  uint16_t len;
+
+  ring_get(pos, (char *)&len, sizeof(len));
+  return len;
+}
+
+//
+/// called by the logger task before it outputs anything
+//
+
+void logtail_init(void) {
+
+  if (logtail_mutex == NULL) {
+    logtail_mutex = xSemaphoreCreateMutex();
+  }
+
+  return;
+}
+
+//
+/// add a message, discarding the oldest ones if there isn't room
+//
+
+void logtail_add(const char *prefix, const char *msg) {
+
+  size_t plen = strlen(prefix), mlen = strlen(msg);
+  uint16_t len = plen + mlen, old;
+
+  if (logtail_mutex == NULL || len + sizeof(len) > LOGTAIL_SIZE) {
+    return;
+  }
+
+  xSemaphoreTake(logtail_mutex, portMAX_DELAY);
+
+  while (logtail_used + len + sizeof(len) > LOGTAIL_SIZE) {
+    old = ring_len(logtail_tail);
+    logtail_tail = (logtail_tail + sizeof(old) + old) % LOGTAIL_SIZE;
+    logtail_used -= sizeof(old) + old;
+    ++logtail_first_seq;
+  }
+
+  ring_put(logtail_head, (const char *)&len, sizeof(len));
+  ring_put(logtail_head + sizeof(len), prefix, plen);
+  ring_put(logtail_head + sizeof(len) + plen, msg, mlen);
+  logtail_head = (logtail_head + sizeof(len) + len) % LOGTAIL_SIZE;
+  logtail_used += sizeof(len) + len;
+  ++logtail_next;
+
+  xSemaphoreGive(logtail_mutex);
+  return;
+}
+
+//
+/// copy the message with sequence number *seq into buf, and set *seq to the one after it
+/// if *seq has already been discarded, the oldest message is returned instead, and *missed set to the number lost
+/// returns false if there is no message at or after *seq yet
+//
+
+bool logtail_read(unsigned long *seq, char *buf, size_t buflen, unsigned long *missed) {
+
+  size_t pos;
+  uint16_t len;
+
+  *missed = 0;
+
+  if (logtail_mutex == NULL || buflen == 0) {
+    return false;
+  }
+
+  xSemaphoreTake(logtail_mutex, portMAX_DELAY);
+
+  if (*seq >= logtail_next) {
+    xSemaphoreGive(logtail_mutex);
+    return false;
+  }
+
+  if (*seq < logtail_first_seq) {
+    *missed = logtail_first_seq - *seq;
+    *seq = logtail_first_seq;
+  }
+
+  // step over the older messages to the one wanted
+  pos = logtail_tail;
+
+  for (unsigned long s = logtail_first_seq; s < *seq; s++) {
+    pos = (pos + sizeof(len) + ring_len(pos)) % LOGTAIL_SIZE;
+  }
+
+  len = ring_len(pos);
+
+  if (len >= buflen) {
+    len = buflen - 1;
+  }
+
+  ring_get(pos + sizeof(len), buf, len);
+  buf[len] = 0;
+  ++*seq;
+
+  xSemaphoreGive(logtail_mutex);
+  return true;
+}
+
+//
+/// the sequence number the next message will have
+//
+
+unsigned long logtail_next_seq(void) {
+  return logtail_next;
+}
@@ -0,0 +1,136 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// compact variable-length wire encoding for CAN frames sent over ESP-NOW
+///
+/// a compact packet starts with a message type byte, NET_MSG_CAN_BATCH or NET_MSG_CAN, followed by one or more encoded frames
+/// each frame is encoded as:
+///   header byte - bit 7 = extended frame, bit 6 = RTR, bits 3-0 = dlc
+///   identifier  - 2 bytes for an 11-bit identifier, 4 bytes for a 29-bit identifier, most significant byte first
+///   data        - dlc bytes, none for an RTR frame
+/// so a 2-byte DKEEP takes 5 bytes on air, rather than sizeof(twai_message_t)
+//
+
+//
+/// encode a frame into the buffer, which must have room for NET_COMPACT_MAX_FRAME_LEN bytes
+/// returns the number of bytes written
+//
+
+size_t net_encode_frame(const twai_message_t *frame, byte *buffer) {
+
+  size_t len = 0;
+  byte dlc = (frame->data_length_code > 8) ? 8 : frame->data_length_code;
+  bool ext = (frame->flags & TWAI_MSG_FLAG_EXTD);
+  bool rtr = (frame->flags & TWAI_MSG_FLAG_RTR);
+
+  buffer[len++] = (ext ? NET_COMPACT_EXT : 0) | (rtr ? NET_COMPACT_RTR : 0) | dlc;
+
+  if (ext) {
+    buffer[len++] = (frame->identifier >> 24) & 0x1f;
+    buffer[len++] = (frame->identifier >> 16) & 0xff;
+    buffer[len++] = (frame->identifier >> 8) & 0xff;
+    buffer[len++] = frame->identifier & 0xff;
+  } else {
+    buffer[len++] = (frame->identifier >> 8) & 0x07;
+    buffer[len++] = frame->identifier & 0xff;
+  }
+
+  if (!rtr) {
+    memcpy(&buffer[len], frame->data, dlc);
+    len += dlc;
+  }
+
+  return len;
+}
+
+//
+/// decode a frame from the buffer, of which len bytes remain
+/// returns the number of bytes consumed, or 0 if the encoding is invalid or truncated
+//
+
+size_t net_decode_frame(const byte *buffer, size_t len, twai_message_t *frame) {
+
+  size_t idx = 0, need;
+  byte hdr, dlc;
+
+  if (len < NET_COMPACT_MIN_FRAME_LEN) {
+    return 0;
+  }
+
+  hdr = buffer[idx++];
+  dlc = hdr & 0x0f;
+
+  if (dlc > 8 || (hdr & NET_COMPACT_RESERVED)) {
+    return 0;
+  }
+
+  need = 1 + ((hdr & NET_COMPACT_EXT) ? 4 : 2) + ((hdr & NET_COMPACT_RTR) ? 0 : dlc);
+
+  if (len < need) {
+    return 0;
+  }
+
+  bzero((void *)frame, sizeof(twai_message_t));
+  frame->data_length_code = dlc;
+
+  if (hdr & NET_COMPACT_EXT) {
+    frame->flags |= TWAI_MSG_FLAG_EXTD;
+    frame->identifier = ((uint32_t)(buffer[idx] & 0x1f) << 24) | ((uint32_t)buffer[idx + 1] << 16) | ((uint32_t)buffer[idx + 2] << 8) | buffer[idx + 3];
+    idx += 4;
+  } else {
+    frame->identifier = ((uint32_t)(buffer[idx] & 0x07) << 8) | buffer[idx + 1];
+    idx += 2;
+  }
+
+  if (hdr & NET_COMPACT_RTR) {
+    frame->flags |= TWAI_MSG_FLAG_RTR;
+  } else {
+    memcpy(frame->data, &buffer[idx], dlc);
+    idx += dlc;
+  }
+
+  return idx;
+}
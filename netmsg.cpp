@@ -0,0 +1,520 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// typed ESP-NOW messages
+///
+/// every message sent by this firmware starts with a message type byte in the range 0xC0 - 0xCF
+/// which can never be the first byte of a CAN frame in the original format, as the frame flags are always < 0x20
+/// messages are dispatched through a table indexed by the low nibble of the type byte, and counted per type
+///
+/// nodes with older firmware send 20-byte CAN frames and 20-byte control messages identified by an ASCII prefix
+/// these are translated to the equivalent typed message on receipt, and typed control messages are translated
+/// back to the original format when sending to an older node
+//
+
+// variables declared in other source files
+extern config_t config_data;
+extern stats_t stats, errors;
+extern byte slave_canid, master_wire_version;
+extern net_batch_stats_t net_batch_stats;
+extern uint8_t mac_master[6];
+
+// message handlers
+static void handle_legacy_can(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_heartbeat(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_can_batch(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_can(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_join(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_battery(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_canid(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_can_reflect(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_reliable(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_ack(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+static void handle_session(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+
+// dispatch table, indexed by the low nibble of the message type
+static const net_msg_type_t msg_types[NET_MSG_NUM_TYPES] = {
+  { "legacy CAN", sizeof(twai_message_t), handle_legacy_can },
+  { "heartbeat", NET_MSG_HEARTBEAT_LEN, handle_heartbeat },
+  { "CAN batch", 1 + NET_COMPACT_MIN_FRAME_LEN, handle_can_batch },
+  { "CAN", 1 + NET_COMPACT_MIN_FRAME_LEN, handle_can },
+  { "join", NET_MSG_JOIN_LEN, handle_join },
+  { "battery", NET_MSG_BATTERY_LEN, handle_battery },
+  { "CANID", NET_MSG_CANID_LEN, handle_canid },
+  { "CAN reflect", NET_MSG_REFLECT_HDR_LEN + NET_COMPACT_MIN_FRAME_LEN, handle_can_reflect },
+  { "reliable", NET_REL_HDR_LEN + 1 + NET_COMPACT_MIN_FRAME_LEN, handle_reliable },
+  { "ack", NET_MSG_ACK_LEN, handle_ack },
+  { "session", NET_MSG_SESSION_LEN, handle_session }
+};
+
+net_msg_stats_t net_msg_stats[NET_MSG_NUM_TYPES];
+
+//
+/// return the message type of a received packet, or NET_MSG_INVALID if the type is unknown or the packet is too short
+/// packets from older firmware are translated into a typed message in the caller's buffer, and *msg is updated to point to it
+/// the buffer must be at least sizeof(twai_message_t) bytes
+//
+
+byte net_msg_classify(const uint8_t **msg, int *msg_len, uint8_t *buffer) {
+
+  const uint8_t *data = *msg;
+  unsigned int val;
+
+  if (*msg_len < 1) {
+    return NET_MSG_INVALID;
+  }
+
+  // a typed message
+  if ((data[0] & 0xf0) == NET_MSG_TYPE_BASE && data[0] != NET_MSG_LEGACY_CAN) {
+    if ((data[0] & 0x0f) >= NET_MSG_NUM_TYPES) {
+      return NET_MSG_INVALID;
+    }
+
+    if (*msg_len < msg_types[data[0] & 0x0f].min_len) {
+      ++net_msg_stats[data[0] & 0x0f].errs;
+      return NET_MSG_INVALID;
+    }
+
+    return data[0];
+  }
+
+  // older firmware sends only 20-byte messages
+  if (*msg_len != sizeof(twai_message_t)) {
+    return NET_MSG_INVALID;
+  }
+
+  // an original format CAN frame, which is passed through unchanged
+  if (net_msg_is_frame((const twai_message_t *)data)) {
+    return NET_MSG_LEGACY_CAN;
+  }
+
+  // an original format control message - translate to the equivalent typed message
+  bzero(buffer, sizeof(twai_message_t));
+  *msg = buffer;
+
+  if (data[0] == 'H' && data[1] == 'B') {
+    buffer[0] = NET_MSG_HEARTBEAT;
+    buffer[1] = data[NET_HB_VERSION_OFFSET];
+    *msg_len = NET_MSG_HEARTBEAT_LEN;
+  } else if (data[0] == 'P' && data[1] == 'W') {
+    buffer[0] = NET_MSG_JOIN;
+    buffer[1] = data[NET_PW_VERSION_OFFSET];
+    memcpy(&buffer[2], &data[2], NET_PASSWORD_LEN);
+    *msg_len = NET_MSG_JOIN_LEN;
+  } else if ((data[0] == 'M' && data[1] == 'V') || (data[0] == 'S' && data[1] == 'O')) {
+    char tbuff[8];
+    memcpy(tbuff, &data[2], 4);
+    tbuff[4] = 0;
+    val = atoi(tbuff);
+    buffer[0] = NET_MSG_BATTERY;
+
+    if (data[0] == 'M') {
+      buffer[1] = highByte(val);
+      buffer[2] = lowByte(val);
+      buffer[3] = NET_BATTERY_NONE & 0xff;
+    } else {
+      buffer[1] = highByte(NET_BATTERY_NONE);
+      buffer[2] = lowByte(NET_BATTERY_NONE);
+      buffer[3] = val;
+    }
+
+    *msg_len = NET_MSG_BATTERY_LEN;
+  } else if (data[0] == 'C' && data[1] == 'A') {
+    char tbuff[8];
+    memcpy(tbuff, &data[2], 3);
+    tbuff[3] = 0;
+    buffer[0] = NET_MSG_CANID;
+    buffer[1] = atoi(tbuff);
+    *msg_len = NET_MSG_CANID_LEN;
+  } else {
+    return NET_MSG_INVALID;
+  }
+
+  return buffer[0];
+}
+
+//
+/// dispatch a received message, previously classified by net_msg_classify, to its handler
+/// legacy is true if the message was translated from the original format
+//
+
+void net_msg_dispatch(const uint8_t *mac_addr, byte type, const uint8_t *msg, int msg_len, bool legacy) {
+
+  byte version;
+
+  ++net_msg_stats[type & 0x0f].rx;
+
+  // a typed message tells us the minimum wire format version the sender understands,
+  // in case we missed its heartbeat or password message, e.g. if the master has restarted
+  // heartbeat and join messages carry the sender's version explicitly
+
+  if (!legacy && type != NET_MSG_LEGACY_CAN && type != NET_MSG_HEARTBEAT && type != NET_MSG_JOIN) {
+    switch (type) {
+      case NET_MSG_CAN_BATCH:
+        version = NET_WIRE_VERSION_COMPACT;
+        break;
+      case NET_MSG_CAN_REFLECT:
+        version = NET_WIRE_VERSION_REFLECT;
+        break;
+      case NET_MSG_RELIABLE:
+      case NET_MSG_ACK:
+        version = NET_WIRE_VERSION_RELIABLE;
+        break;
+      case NET_MSG_SESSION:
+        version = NET_WIRE_VERSION_KEEPALIVE;
+        break;
+      default:
+        version = NET_WIRE_VERSION_TYPED;
+        break;
+    }
+
+    if (config_data.role == ROLE_MASTER) {
+      peer_record_op(mac_addr, PEER_RAISE_VERSION, version);
+    } else if (master_wire_version < version) {
+      master_wire_version = version;
+    }
+  }
+
+  msg_types[type & 0x0f].handler(mac_addr, msg, msg_len);
+  return;
+}
+
+//
+/// the on-air length of a typed control message
+//
+
+int net_msg_len(const uint8_t *msg) {
+  return msg_types[msg[0] & 0x0f].min_len;
+}
+
+//
+/// count a message sent
+//
+
+void net_msg_count_tx(byte type) {
+  ++net_msg_stats[type & 0x0f].tx;
+  return;
+}
+
+//
+/// the name of a message type, for stats
+//
+
+const char *net_msg_name(byte index) {
+  return (index < NET_MSG_NUM_TYPES) ? msg_types[index].name : "unknown";
+}
+
+//
+/// translate a typed control message to the original format for an older node
+/// returns the number of 20-byte messages written to the legacy buffer, which may be 0 if there is no equivalent
+//
+
+byte net_msg_to_legacy(const uint8_t *msg, char legacy[2][sizeof(twai_message_t)]) {
+
+  byte n = 0;
+  unsigned int mv;
+
+  bzero(legacy, 2 * sizeof(twai_message_t));
+
+  switch (msg[0]) {
+
+    case NET_MSG_HEARTBEAT:
+      legacy[0][0] = 'H';
+      legacy[0][1] = 'B';
+      legacy[0][NET_HB_VERSION_OFFSET] = msg[1];
+      n = 1;
+      break;
+
+    case NET_MSG_JOIN:
+      legacy[0][0] = 'P';
+      legacy[0][1] = 'W';
+      memcpy(&legacy[0][2], &msg[2], NET_PASSWORD_LEN);
+      legacy[0][NET_PW_VERSION_OFFSET] = msg[1];
+      n = 1;
+      break;
+
+    case NET_MSG_BATTERY:
+      mv = (msg[1] << 8) + msg[2];
+
+      if (mv != NET_BATTERY_NONE) {
+        snprintf(legacy[n++], sizeof(twai_message_t), "MV%4d", mv);
+      }
+
+      if (msg[3] != (NET_BATTERY_NONE & 0xff)) {
+        snprintf(legacy[n++], sizeof(twai_message_t), "SO%3d", msg[3]);
+      }
+      break;
+
+    case NET_MSG_CANID:
+      snprintf(legacy[0], sizeof(twai_message_t), "CA%3d", msg[1]);
+      n = 1;
+      break;
+  }
+
+  return n;
+}
+
+//
+/// message handlers
+//
+
+//
+/// a CAN frame in the original 20-byte format
+/// copied, as the packet data may not be aligned
+//
+
+static void handle_legacy_can(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  twai_message_t frame;
+
+  memcpy(&frame, data, sizeof(twai_message_t));
+  handle_net_frame(mac_addr, &frame);
+  ++net_batch_stats.frames_rx;
+  return;
+}
+
+//
+/// one or more compact encoded CAN frames
+//
+
+static void handle_can_batch(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  twai_message_t frame;
+  size_t used, idx = 1, num_frames = 0;
+
+  while (idx < (size_t)data_len) {
+    used = net_decode_frame(&data[idx], data_len - idx, &frame);
+
+    if (used == 0) {
+      VLOG("on_data_rcvd: invalid compact frame encoding at offset = %d", idx);
+      ++errors.net_rx;
+      ++net_msg_stats[NET_MSG_CAN_BATCH & 0x0f].errs;
+      PULSE_LED(ERR_IND_LED);
+      break;
+    }
+
+    handle_net_frame(mac_addr, &frame);
+    idx += used;
+    ++num_frames;
+  }
+
+  if (num_frames > 1) {
+    ++net_batch_stats.batches_rx;
+  }
+
+  net_batch_stats.frames_rx += num_frames;
+  return;
+}
+
+//
+/// a single compact encoded CAN frame
+//
+
+static void handle_can(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  twai_message_t frame;
+
+  if (net_decode_frame(&data[1], data_len - 1, &frame) == 0) {
+    LOG("on_data_rcvd: invalid compact frame encoding");
+    ++errors.net_rx;
+    ++net_msg_stats[NET_MSG_CAN & 0x0f].errs;
+    PULSE_LED(ERR_IND_LED);
+    return;
+  }
+
+  handle_net_frame(mac_addr, &frame);
+  ++net_batch_stats.frames_rx;
+  return;
+}
+
+//
+/// heartbeat - we record the sender's wire format version
+/// the master sends these regularly; a slave sends them to introduce itself if no password is used
+//
+
+static void handle_heartbeat(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  // VLOG("on_data_rcvd: heartbeat, version = %d", data[1]);
+
+  if (config_data.role == ROLE_MASTER) {
+    peer_record_op(mac_addr, PEER_SET_VERSION, data[1]);
+  } else {
+    master_wire_version = data[1];
+  }
+
+  return;
+}
+
+//
+/// join - a slave's network password, which has already been checked if the slave is not yet paired
+/// any further join messages are superfluous, and we just record the version
+//
+
+static void handle_join(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  if (config_data.role == ROLE_MASTER) {
+    peer_record_op(mac_addr, PEER_SET_VERSION, data[1]);
+  }
+
+  return;
+}
+
+//
+/// battery telemetry from a slave's battery monitor task
+/// voltage 0-9999 mV, big-endian; state of charge 0-100 %; either may be absent
+//
+
+static void handle_battery(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  unsigned int mv = (data[1] << 8) + data[2];
+
+  if (config_data.role != ROLE_MASTER) {
+    return;
+  }
+
+  if (mv != NET_BATTERY_NONE) {
+    peer_record_op(mac_addr, PEER_SET_BATT_MV, mv);
+    VLOG("on_data_received: satellite battery voltage = %d", mv);
+  }
+
+  if (data[3] != (NET_BATTERY_NONE & 0xff)) {
+    peer_record_op(mac_addr, PEER_SET_BATT_SOC, data[3]);
+    VLOG("on_data_received: satellite battery soc = %d", data[3]);
+  }
+
+  return;
+}
+
+//
+/// CANID assignment from the master, for a slave acting as a proxy
+//
+
+static void handle_canid(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  if (config_data.role == ROLE_SLAVE) {
+    slave_canid = data[1];
+    VLOG("on_data_received: satellite CANID = %d", slave_canid);
+  }
+
+  return;
+}
+
+//
+/// a CAN frame reflected by the master to all slaves with a single broadcast
+/// the slave that originally sent the frame discards it
+/// broadcasts from any other node, e.g. the master of another layout network on the same channel, are ignored
+//
+
+static void handle_can_reflect(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  static uint8_t my_mac[6];
+  static bool have_my_mac = false;
+  twai_message_t frame;
+
+  if (config_data.role != ROLE_SLAVE || memcmp(mac_addr, mac_master, sizeof(my_mac)) != 0) {
+    return;
+  }
+
+  // slaves send from the soft AP interface
+  if (!have_my_mac) {
+    WiFi.softAPmacAddress(my_mac);
+    have_my_mac = true;
+  }
+
+  if (memcmp(&data[1], my_mac, sizeof(my_mac)) == 0) {
+    ++net_batch_stats.reflect_suppressed;
+    return;
+  }
+
+  if (net_decode_frame(&data[NET_MSG_REFLECT_HDR_LEN], data_len - NET_MSG_REFLECT_HDR_LEN, &frame) == 0) {
+    LOG("on_data_rcvd: invalid compact frame encoding");
+    ++errors.net_rx;
+    ++net_msg_stats[NET_MSG_CAN_REFLECT & 0x0f].errs;
+    PULSE_LED(ERR_IND_LED);
+    return;
+  }
+
+  handle_net_frame(mac_addr, &frame);
+  ++net_batch_stats.frames_rx;
+  return;
+}
+
+//
+/// a CAN or CAN batch message with a sequence number, passed to the reliable delivery layer
+//
+
+static void handle_reliable(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  net_rel_receive(mac_addr, data, data_len);
+  return;
+}
+
+//
+/// an acknowledgement of reliable messages
+//
+
+static void handle_ack(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  uint32_t bitmap;
+
+  memcpy(&bitmap, &data[5], sizeof(bitmap));
+  net_rel_ack(mac_addr, (data[1] << 8) + data[2], (data[3] << 8) + data[4], bitmap);
+  return;
+}
+
+//
+/// the CANCMD session a slave's cab is keeping alive, or NET_SESSION_NONE
+/// only the master acts on this
+//
+
+static void handle_session(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  if (config_data.role == ROLE_MASTER) {
+    keepalive_session(mac_addr, data[1], (data[2] << 8) + data[3]);
+  }
+
+  return;
+}
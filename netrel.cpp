@@ -0,0 +1,701 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+#include "cbusdefs.h"
+
+//
+/// reliable ordered delivery for ESP-NOW packets carrying CAN frames that must not be lost
+///
+/// ESP-NOW retries a unicast a few times at the MAC layer, but a packet that still fails is lost
+/// a packet carrying a frame from a class that needs reliable delivery, e.g. DSPD or KLOC, is wrapped with a 16-bit
+/// sequence number, one sequence per link, and held until the receiving peer has acknowledged it
+/// a sequence per link allows the master to send a different selection of frames to each slave in split bus mode
+///
+/// each packet also carries the sender's epoch, a random number chosen at each boot; a receiver that sees a new epoch
+/// knows the sender has restarted its sequence numbers from 0, e.g. after a satellite resumes from deep sleep, and
+/// starts again; acks echo the epoch, so a sender ignores acks meant for its previous incarnation
+///
+/// receivers deliver packets in sequence order, holding any that arrive early in a small reorder buffer until the gap is
+/// filled or a timeout expires, and discard duplicates
+/// receivers acknowledge with a cumulative sequence number and a bitmap of the packets received beyond it, sent at
+/// most every NET_REL_ACK_MS, or immediately when a gap is seen
+/// senders retransmit an unacknowledged packet a bounded number of times
+/// unacknowledged packets are held in a pool shared by all peers, and each peer may hold at most NET_REL_PEER_WINDOW
+/// of them; when a peer's window or the pool is full, the sender waits for acks, and if none come in time the send is
+/// refused and counted; a pending packet is never overwritten
+///
+/// other frames, e.g. DKEEP, which is repeated anyway, are sent as before with no overhead
+//
+
+// variables declared in other source files
+extern config_t config_data;
+extern peer_state_t peers[MAX_NET_PEERS];
+extern portMUX_TYPE peer_mux;
+extern uint8_t mac_master[6];
+
+// a packet held by the sender until acknowledged
+typedef struct {
+  bool pending;
+  byte peer, len, retries;
+  uint16_t seq;
+  unsigned long sent_time;
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} rel_tx_slot_t;
+
+// receive state for each sending peer
+typedef struct {
+  bool valid, ack_due, ack_now;
+  uint16_t epoch;                 // the sender's epoch
+  uint16_t base;                  // next sequence number to deliver
+  uint32_t bitmap;                // bit n = packet base + n is held in the reorder buffer
+  unsigned long gap_time, ack_time;
+} rel_rx_state_t;
+
+// a packet received out of order
+typedef struct {
+  bool used;
+  byte peer, len;
+  uint16_t seq;
+  uint8_t mac_addr[6];
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} rel_rx_slot_t;
+
+static rel_tx_slot_t tx_slots[NET_REL_WINDOW];
+static uint16_t tx_seq[MAX_NET_PEERS];
+static byte tx_inflight[MAX_NET_PEERS];          // pending slots held by each peer
+static bool tx_refusing[MAX_NET_PEERS];          // a send to the peer has been refused, and no slot has freed up since
+static uint16_t tx_epoch;                        // chosen at boot, sent with every reliable packet
+static portMUX_TYPE rel_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static rel_rx_state_t rx_state[MAX_NET_PEERS];
+static rel_rx_slot_t rx_slots[NET_REL_REORDER_SLOTS];
+
+static byte reliable_opcodes[32];
+
+net_rel_stats_t net_rel_stats;
+
+// opcodes that need reliable delivery - loco session control, speed and functions, track power and accessory events
+static const byte reliable_opcode_list[] = {
+  OPC_TOF, OPC_TON, OPC_ESTOP, OPC_ARST, OPC_RTOF, OPC_RTON, OPC_RESTP,
+  OPC_KLOC, OPC_QLOC, OPC_RLOC, OPC_ALOC, OPC_STMOD, OPC_PCON, OPC_KCON,
+  OPC_DSPD, OPC_DFLG, OPC_DFNON, OPC_DFNOF, OPC_DFUN, OPC_GLOC, OPC_ERR, OPC_PLOC,
+  OPC_ACON, OPC_ACOF, OPC_ASON, OPC_ASOF
+};
+
+//
+/// initialise the reliable delivery state
+//
+
+void net_rel_init(void) {
+
+  bzero(tx_slots, sizeof(tx_slots));
+  bzero(tx_seq, sizeof(tx_seq));
+  bzero(tx_inflight, sizeof(tx_inflight));
+  bzero(tx_refusing, sizeof(tx_refusing));
+  bzero(rx_state, sizeof(rx_state));
+  bzero(rx_slots, sizeof(rx_slots));
+  bzero(reliable_opcodes, sizeof(reliable_opcodes));
+  bzero(&net_rel_stats, sizeof(net_rel_stats));
+  tx_epoch = esp_random();
+
+  for (byte i = 0; i < sizeof(reliable_opcode_list); i++) {
+    bitSet(reliable_opcodes[reliable_opcode_list[i] >> 3], reliable_opcode_list[i] & 7);
+  }
+
+  return;
+}
+
+//
+/// returns true if this frame needs reliable delivery
+//
+
+bool net_rel_needed(const twai_message_t *frame) {
+  return (frame->data_length_code > 0 && !(frame->flags & (TWAI_MSG_FLAG_EXTD | TWAI_MSG_FLAG_RTR)) &&
+          bitRead(reliable_opcodes[frame->data[0] >> 3], frame->data[0] & 7));
+}
+
+//
+/// the peer table index of a node, or -1
+/// a slave has only one peer, the master, which uses index 0
+/// locked is true if the caller holds the peer table lock, so the peer can't be removed while the index is used
+//
+
+static int rel_peer_index(const uint8_t *mac_addr, bool locked) {
+
+  if (config_data.role == ROLE_SLAVE) {
+    return (memcmp(mac_addr, mac_master, sizeof(uint8_t[6])) == 0) ? 0 : -1;
+  }
+
+  return locked ? peer_find_locked(mac_addr) : peer_find(mac_addr);
+}
+
+//
+/// copy the MAC address of a node, by peer table index, under the peer table lock
+/// returns false if the peer has been removed
+//
+
+static bool rel_peer_mac(byte idx, uint8_t *mac_addr) {
+
+  if (config_data.role == ROLE_SLAVE) {
+    memcpy(mac_addr, mac_master, sizeof(uint8_t[6]));
+    return true;
+  }
+
+  portENTER_CRITICAL(&peer_mux);
+  memcpy(mac_addr, peers[idx].mac_addr, sizeof(uint8_t[6]));
+  portEXIT_CRITICAL(&peer_mux);
+  return mac_addr[0] != 0;
+}
+
+//
+/// free a pending slot; the caller holds rel_mux
+//
+
+static void rel_release(rel_tx_slot_t *slot) {
+
+  slot->pending = false;
+
+  if (tx_inflight[slot->peer] > 0) {
+    --tx_inflight[slot->peer];
+  }
+
+  tx_refusing[slot->peer] = false;
+
+  return;
+}
+
+//
+/// claim a free slot for a peer, unless its window or the pool is full; the caller holds rel_mux
+//
+
+static rel_tx_slot_t *rel_claim(byte peer) {
+
+  if (tx_inflight[peer] >= NET_REL_PEER_WINDOW) {
+    return NULL;
+  }
+
+  for (byte i = 0; i < NET_REL_WINDOW; i++) {
+    if (!tx_slots[i].pending) {
+      ++tx_inflight[peer];
+      tx_slots[i].pending = true;
+      tx_slots[i].peer = peer;
+      return &tx_slots[i];
+    }
+  }
+
+  return NULL;
+}
+
+//
+/// forget all state for a peer, when it is added to or removed from the peer table
+//
+
+void net_rel_peer_reset(int idx) {
+
+  if (idx < 0 || idx >= MAX_NET_PEERS) {
+    return;
+  }
+
+  portENTER_CRITICAL(&rel_mux);
+
+  for (byte i = 0; i < NET_REL_WINDOW; i++) {
+    if (tx_slots[i].pending && tx_slots[i].peer == idx) {
+      rel_release(&tx_slots[i]);
+    }
+  }
+
+  tx_inflight[idx] = 0;
+  tx_refusing[idx] = false;
+  rx_state[idx].valid = false;
+  portEXIT_CRITICAL(&rel_mux);
+  return;
+}
+
+//
+/// send a packet with a sequence number to each of the given peers, and hold it for retransmission until acknowledged
+/// peer_mask is a bitmap of peer table indexes; a slave has only one peer, the master, which uses index 0
+/// the packet buffer must have room for the NET_REL_HDR_LEN byte header to be inserted at the front
+/// returns the peers that took the packet; a packet held for a peer is retransmitted if the first send fails
+/// the packet is counted once, as a reliable message, if any peer took it
+//
+
+uint32_t net_rel_send(byte *packet, size_t len, uint32_t peer_mask) {
+
+  rel_tx_slot_t *slot;
+  esp_err_t result;
+  uint32_t accepted = 0;
+  unsigned long start;
+  uint8_t mac_addr[6];
+
+  memmove(&packet[NET_REL_HDR_LEN], packet, len);
+  len += NET_REL_HDR_LEN;
+  packet[0] = NET_MSG_RELIABLE;
+
+  for (byte p = 0; p < MAX_NET_PEERS; p++) {
+
+    if (!(peer_mask & (1UL << p)) || !rel_peer_mac(p, mac_addr)) {
+      continue;
+    }
+
+    // wait for a slot if the peer's window or the pool is full; acks are processed by the net receive task, and
+    // packets that run out of retries are given up by net_rel_tx_poll, so keep that going while waiting
+    // once a send to a peer has been refused, don't wait again until one of its slots frees up, so a peer that has
+    // gone away doesn't hold up the others
+    start = millis();
+
+    for (;;) {
+      portENTER_CRITICAL(&rel_mux);
+      slot = rel_claim(p);
+
+      if (slot != NULL || tx_refusing[p] || millis() - start >= NET_REL_FULL_WAIT_MS) {
+        break;
+      }
+
+      portEXIT_CRITICAL(&rel_mux);
+      net_rel_tx_poll();
+      vTaskDelay(1);
+    }
+
+    if (slot == NULL) {
+      bool first = !tx_refusing[p];
+      tx_refusing[p] = true;
+      portEXIT_CRITICAL(&rel_mux);
+      ++net_rel_stats.window_full;
+
+      if (first) {
+        LOGW(LOG_MOD_NET, "net_rel_send: send window full for network peer %s, refusing sends", mac_to_char(mac_addr));
+      }
+
+      continue;
+    }
+
+    packet[1] = highByte(tx_epoch);
+    packet[2] = lowByte(tx_epoch);
+    packet[3] = highByte(tx_seq[p]);
+    packet[4] = lowByte(tx_seq[p]);
+
+    slot->seq = tx_seq[p]++;
+    slot->len = len;
+    slot->retries = 0;
+    slot->sent_time = millis();
+    memcpy(slot->data, packet, len);
+    portEXIT_CRITICAL(&rel_mux);
+
+    ++net_rel_stats.sent;
+    accepted |= (1UL << p);
+    result = esp_now_send(mac_addr, packet, len);
+
+    if (result != ESP_OK) {
+      VLOG("net_rel_send: error sending to network peer %s, err = %d", mac_to_char(mac_addr), result);
+      log_esp_now_err(result);
+    }
+  }
+
+  if (accepted != 0) {
+    net_msg_count_tx(NET_MSG_RELIABLE);
+  }
+
+  return accepted;
+}
+
+//
+/// process an acknowledgement from a peer
+/// acks for another epoch are for packets sent before this node restarted, and are ignored
+/// base is the next sequence number the peer expects; bit n of the bitmap means it holds packet base + 1 + n
+/// if the peer holds later packets, it has a gap, and the missing packets are made due for immediate retransmission
+//
+
+void net_rel_ack(const uint8_t *mac_addr, uint16_t epoch, uint16_t base, uint32_t bitmap) {
+
+  int idx;
+  int16_t d;
+  bool acked;
+
+  if (epoch != tx_epoch) {
+    return;
+  }
+
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = rel_peer_index(mac_addr, true)) < 0) {
+    portEXIT_CRITICAL(&peer_mux);
+    return;
+  }
+
+  ++net_rel_stats.acks_rx;
+  portENTER_CRITICAL(&rel_mux);
+
+  for (byte i = 0; i < NET_REL_WINDOW; i++) {
+    if (!tx_slots[i].pending || tx_slots[i].peer != idx) {
+      continue;
+    }
+
+    d = (int16_t)(tx_slots[i].seq - base);
+    acked = (d < 0) || (d >= 1 && d <= 32 && (bitmap & (1UL << (d - 1))));
+
+    if (acked) {
+      rel_release(&tx_slots[i]);
+    } else if (bitmap != 0) {
+      tx_slots[i].sent_time = 0;
+    }
+  }
+
+  portEXIT_CRITICAL(&rel_mux);
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// a send to a peer has failed at the MAC layer, so make its unacknowledged packets due for retransmission
+/// called from the ESP-NOW send callback
+//
+
+void net_rel_send_failed(const uint8_t *mac_addr) {
+
+  int idx;
+
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = rel_peer_index(mac_addr, true)) >= 0) {
+    portENTER_CRITICAL(&rel_mux);
+
+    for (byte i = 0; i < NET_REL_WINDOW; i++) {
+      if (tx_slots[i].pending && tx_slots[i].peer == idx) {
+        tx_slots[i].sent_time = 0;
+      }
+    }
+
+    portEXIT_CRITICAL(&rel_mux);
+  }
+
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// retransmit unacknowledged packets whose timeout has expired
+/// called regularly from the net send task
+//
+
+void net_rel_tx_poll(void) {
+
+  uint8_t data[ESP_NOW_MAX_DATA_LEN];
+  uint8_t mac_addr[6];
+  byte len, peer;
+  esp_err_t result;
+
+  for (byte i = 0; i < NET_REL_WINDOW; i++) {
+
+    portENTER_CRITICAL(&rel_mux);
+
+    if (!tx_slots[i].pending || millis() - tx_slots[i].sent_time < NET_REL_RTO_MS) {
+      portEXIT_CRITICAL(&rel_mux);
+      continue;
+    }
+
+    if (tx_slots[i].retries >= NET_REL_MAX_RETRIES) {
+      rel_release(&tx_slots[i]);
+      portEXIT_CRITICAL(&rel_mux);
+      ++net_rel_stats.abandoned;
+      continue;
+    }
+
+    ++tx_slots[i].retries;
+    tx_slots[i].sent_time = millis();
+    peer = tx_slots[i].peer;
+    len = tx_slots[i].len;
+    memcpy(data, tx_slots[i].data, len);
+    portEXIT_CRITICAL(&rel_mux);
+
+    if (!rel_peer_mac(peer, mac_addr)) {
+      continue;
+    }
+
+    result = esp_now_send(mac_addr, data, len);
+
+    if (result == ESP_OK) {
+      ++net_rel_stats.retransmits;
+    } else {
+      log_esp_now_err(result);
+    }
+  }
+
+  return;
+}
+
+//
+/// receive side
+//
+
+static void rel_deliver(const uint8_t *mac_addr, const uint8_t *data, int len) {
+
+  const uint8_t *msg = data;
+  int msg_len = len;
+
+  // only CAN frame messages are sent reliably
+  if (len < 1 || (data[0] != NET_MSG_CAN && data[0] != NET_MSG_CAN_BATCH)) {
+    ++net_rel_stats.lost;
+    return;
+  }
+
+  if (net_msg_classify(&msg, &msg_len, NULL) != NET_MSG_INVALID) {
+    net_msg_dispatch(mac_addr, data[0], msg, msg_len, false);
+  }
+
+  return;
+}
+
+static int rel_find_slot(byte peer, uint16_t seq) {
+
+  for (byte i = 0; i < NET_REL_REORDER_SLOTS; i++) {
+    if (rx_slots[i].used && rx_slots[i].peer == peer && rx_slots[i].seq == seq) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+//
+/// move on to the next sequence number, delivering the held packet if we have it, or counting it as lost
+//
+
+static void rel_advance(byte peer) {
+
+  rel_rx_state_t *st = &rx_state[peer];
+  int i;
+
+  if (st->bitmap & 1) {
+    if ((i = rel_find_slot(peer, st->base)) >= 0) {
+      rel_deliver(rx_slots[i].mac_addr, rx_slots[i].data, rx_slots[i].len);
+      rx_slots[i].used = false;
+    }
+  } else {
+    ++net_rel_stats.lost;
+  }
+
+  ++st->base;
+  st->bitmap >>= 1;
+  return;
+}
+
+//
+/// deliver held packets that are now in sequence
+//
+
+static void rel_drain(byte peer) {
+
+  while (rx_state[peer].bitmap & 1) {
+    rel_advance(peer);
+  }
+
+  return;
+}
+
+//
+/// give up on any missing packets before the given sequence number, delivering those held, in order
+//
+
+static void rel_skip_gap_to(byte peer, uint16_t seq) {
+
+  rel_rx_state_t *st = &rx_state[peer];
+
+  while ((int16_t)(seq - st->base) > 0 && st->bitmap != 0) {
+    rel_advance(peer);
+  }
+
+  if ((int16_t)(seq - st->base) > 0) {
+    net_rel_stats.lost += (uint16_t)(seq - st->base);
+    st->base = seq;
+  }
+
+  return;
+}
+
+//
+/// a packet with a sequence number has been received
+/// it is delivered now if it is the next in sequence, held if it is early, or discarded if it is a duplicate
+//
+
+void net_rel_receive(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  // packets are delivered from here, so the peer table lock can't be held throughout; the receive state is only
+  // changed by the net receive task, and if the peer is removed meanwhile, a new peer in its slot starts afresh,
+  // as the slot has been marked invalid, or its epoch won't match
+  int idx = rel_peer_index(mac_addr, false);
+  uint16_t epoch = (data[1] << 8) + data[2];
+  uint16_t seq = (data[3] << 8) + data[4];
+  rel_rx_state_t *st;
+  int16_t d;
+
+  if (idx < 0) {
+    return;
+  }
+
+  st = &rx_state[idx];
+
+  // first packet from this peer; we may have missed the start of its sequence, so start from here
+  if (!st->valid) {
+    bzero(st, sizeof(rel_rx_state_t));
+    st->valid = true;
+    st->epoch = epoch;
+    st->base = seq;
+  }
+
+  // the sender has restarted, so its sequence starts again from 0; deliver anything held from before, and start again
+  if (epoch != st->epoch) {
+    while (st->bitmap != 0) {
+      rel_advance(idx);
+    }
+
+    bzero(st, sizeof(rel_rx_state_t));
+    st->valid = true;
+    st->epoch = epoch;
+    ++net_rel_stats.restarts;
+  }
+
+  st->ack_due = true;
+  d = (int16_t)(seq - st->base);
+
+  // already delivered, or already held - the ack was lost, so acknowledge again immediately
+  if (d < 0 || (d > 0 && d < 32 && (st->bitmap & (1UL << d)))) {
+    ++net_rel_stats.duplicates;
+    st->ack_now = true;
+    return;
+  }
+
+  // next in sequence
+  if (d == 0) {
+    rel_deliver(mac_addr, &data[NET_REL_HDR_LEN], data_len - NET_REL_HDR_LEN);
+    st->bitmap |= 1;
+    ++st->base;
+    st->bitmap >>= 1;
+    rel_drain(idx);
+    return;
+  }
+
+  // early - hold it until the gap is filled, and ask for the missing packets straight away
+  if (d < 32 && data_len <= ESP_NOW_MAX_DATA_LEN) {
+    for (byte i = 0; i < NET_REL_REORDER_SLOTS; i++) {
+      if (!rx_slots[i].used) {
+        rx_slots[i].used = true;
+        rx_slots[i].peer = idx;
+        rx_slots[i].seq = seq;
+        rx_slots[i].len = data_len - NET_REL_HDR_LEN;
+        memcpy(rx_slots[i].mac_addr, mac_addr, sizeof(uint8_t[6]));
+        memcpy(rx_slots[i].data, &data[NET_REL_HDR_LEN], data_len - NET_REL_HDR_LEN);
+
+        if (st->bitmap == 0) {
+          st->gap_time = millis();
+        }
+
+        st->bitmap |= (1UL << d);
+        st->ack_now = true;
+        ++net_rel_stats.reordered;
+        return;
+      }
+    }
+  }
+
+  // too far ahead, or nowhere to hold it - give up on the missing packets before this one
+  rel_skip_gap_to(idx, seq);
+  rel_deliver(mac_addr, &data[NET_REL_HDR_LEN], data_len - NET_REL_HDR_LEN);
+  st->bitmap |= 1;
+  rel_advance(idx);
+  rel_drain(idx);
+  return;
+}
+
+//
+/// send due acknowledgements, and give up on gaps that have not been filled in time
+/// called regularly from the net receive task
+//
+
+void net_rel_rx_poll(void) {
+
+  uint8_t ack[NET_MSG_ACK_LEN];
+  uint8_t mac_addr[6];
+  rel_rx_state_t *st;
+  uint32_t held;
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    st = &rx_state[i];
+
+    if (!st->valid) {
+      continue;
+    }
+
+    // give up on the missing packets before the first one held
+    if (st->bitmap != 0 && millis() - st->gap_time >= NET_REL_REORDER_MS) {
+      while (!(st->bitmap & 1)) {
+        rel_advance(i);
+      }
+
+      rel_drain(i);
+      st->gap_time = millis();
+      st->ack_now = true;
+    }
+
+    if (st->ack_due && (st->ack_now || millis() - st->ack_time >= NET_REL_ACK_MS)) {
+      held = st->bitmap >> 1;
+      ack[0] = NET_MSG_ACK;
+      ack[1] = highByte(st->epoch);
+      ack[2] = lowByte(st->epoch);
+      ack[3] = highByte(st->base);
+      ack[4] = lowByte(st->base);
+      memcpy(&ack[5], &held, sizeof(held));
+
+      if (rel_peer_mac(i, mac_addr) && esp_now_send(mac_addr, ack, sizeof(ack)) == ESP_OK) {
+        net_msg_count_tx(NET_MSG_ACK);
+        ++net_rel_stats.acks_tx;
+      }
+
+      st->ack_due = false;
+      st->ack_now = false;
+      st->ack_time = millis();
+    }
+  }
+
+  return;
+}
@@ -0,0 +1,115 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// single-producer, single-consumer ring of received ESP-NOW packets
+/// the producer is the ESP-NOW receive callback, running in the wifi task context; the consumer is the net_rx task
+/// the callback only copies the packet into the next free slot, so that it never blocks the wifi task
+/// each index is written by only one side, so no lock is needed
+//
+
+static net_rx_packet_t ring[NET_RX_RING_SIZE];
+static volatile unsigned int ring_head = 0;     // next slot to write, producer only
+static volatile unsigned int ring_tail = 0;     // next slot to read, consumer only
+
+net_rx_stats_t net_rx_stats;
+
+//
+/// copy a received packet into the ring
+/// returns false if the ring is full or the packet is too large, and the packet is dropped
+//
+
+bool net_rx_ring_put(const uint8_t *mac_addr, const uint8_t *data, int data_len) {
+
+  unsigned int head = ring_head;
+  unsigned int used = head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+
+  if (used >= NET_RX_RING_SIZE || data_len < 0 || data_len > ESP_NOW_MAX_DATA_LEN) {
+    ++net_rx_stats.dropped;
+    return false;
+  }
+
+  net_rx_packet_t *p = &ring[head % NET_RX_RING_SIZE];
+  memcpy(p->mac_addr, mac_addr, sizeof(p->mac_addr));
+  memcpy(p->data, data, data_len);
+  p->len = data_len;
+
+  // publish the slot to the consumer
+  __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+  ++net_rx_stats.packets;
+
+  if (used + 1 > net_rx_stats.hwm) {
+    net_rx_stats.hwm = used + 1;
+  }
+
+  return true;
+}
+
+//
+/// return the oldest packet in the ring without removing it, or NULL if the ring is empty
+/// the slot remains valid until net_rx_ring_advance is called
+//
+
+net_rx_packet_t *net_rx_ring_peek(void) {
+
+  unsigned int tail = ring_tail;
+
+  if (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == tail) {
+    return NULL;
+  }
+
+  return &ring[tail % NET_RX_RING_SIZE];
+}
+
+//
+/// release the oldest packet back to the producer
+//
+
+void net_rx_ring_advance(void) {
+
+  __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+  return;
+}
@@ -0,0 +1,225 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include <EEPROM.h>
+#include "defs.h"
+
+//
+/// fast satellite rejoin
+///
+/// a full active scan takes WIFI_SCAN_MS per channel, so several seconds across all channels
+/// a slave remembers the MAC address and channel of the master it last joined, in RTC memory, which survives deep sleep,
+/// and in flash, which survives a power cycle
+/// on startup, it first pairs the remembered master directly on the remembered channel, which costs no scan at all,
+/// and waits for the master to respond; if it does not, it tries a passive scan of just that channel,
+/// and only then a full scan
+//
+
+// variables declared in other source files
+extern config_t config_data;
+
+typedef struct {
+  uint32_t magic;
+  byte network_number;
+  byte channel;
+  uint8_t mac_master[6];
+} rejoin_cache_t;
+
+RTC_DATA_ATTR static rejoin_cache_t rtc_cache;
+static rejoin_cache_t cache;
+static byte stage = REJOIN_FULL_SCAN;
+static bool saved = false;
+static unsigned long pair_time = 0UL;
+
+rejoin_stats_t rejoin_stats;
+
+static const char *stage_names[] = { "direct", "passive scan", "full scan" };
+
+static bool cache_valid(const rejoin_cache_t *c) {
+  return (c->magic == REJOIN_MAGIC && c->network_number == config_data.network_number && c->channel >= 1 && c->channel <= 14);
+}
+
+//
+/// load the remembered master, from RTC memory if valid, otherwise from flash
+/// returns the remembered channel, or -1 if there is none for the configured network
+//
+
+signed int rejoin_init(void) {
+
+  bzero(&rejoin_stats, sizeof(rejoin_stats));
+  rejoin_stats.method = REJOIN_NONE;
+
+  if (cache_valid(&rtc_cache)) {
+    memcpy(&cache, &rtc_cache, sizeof(cache));
+    LOG("rejoin_init: using master from RTC memory");
+  } else {
+    EEPROM.readBytes(EEPROM_REJOIN_ADDR, (void *)&cache, sizeof(cache));
+
+    if (!cache_valid(&cache)) {
+      LOG("rejoin_init: no remembered master");
+      stage = REJOIN_FULL_SCAN;
+      return -1;
+    }
+
+    LOG("rejoin_init: using master from flash");
+  }
+
+  VLOG("rejoin_init: master = %s, channel = %d", mac_to_char(cache.mac_master), cache.channel);
+  stage = REJOIN_DIRECT;
+  return cache.channel;
+}
+
+//
+/// the channel of a master found by the startup scan, which is used for a single-channel scan rather than a full scan
+//
+
+void rejoin_set_channel(signed int chan) {
+
+  if (chan > 0 && stage == REJOIN_FULL_SCAN) {
+    cache.channel = chan;
+    stage = REJOIN_PASSIVE_SCAN;
+  }
+
+  return;
+}
+
+//
+/// the next way to find the master - direct pairing, a single-channel passive scan, or a full scan
+/// for direct pairing, the remembered MAC address and channel are returned
+//
+
+byte rejoin_next_stage(uint8_t *mac_addr, byte *chan) {
+
+  *chan = cache.channel;
+
+  if (stage == REJOIN_DIRECT) {
+    memcpy(mac_addr, cache.mac_master, sizeof(uint8_t[6]));
+  }
+
+  ++rejoin_stats.attempts;
+  VLOG("rejoin_next_stage: trying %s", stage_names[stage]);
+  return stage;
+}
+
+//
+/// the master has been paired by the given method; if the pairing is unconfirmed it falls back to the next stage
+//
+
+void rejoin_paired(byte method, bool ok) {
+
+  if (ok) {
+    rejoin_stats.method = method;
+    pair_time = millis();
+    saved = false;
+  } else if (stage < REJOIN_FULL_SCAN) {
+    ++stage;
+  }
+
+  return;
+}
+
+//
+/// called regularly by a slave
+/// remember the master once it has responded, or give up on a direct pairing it has not responded to in time
+/// returns false if the master should be unpaired and found again
+//
+
+bool rejoin_check(const uint8_t *mac_master, byte chan, bool joined) {
+
+  if (rejoin_stats.method == REJOIN_NONE) {
+    return true;
+  }
+
+  if (joined) {
+    if (!saved) {
+      VLOG("rejoin_check: joined master by %s", stage_names[rejoin_stats.method]);
+      boot_mark(BOOT_JOINED);
+      rejoin_save(mac_master, chan);
+      saved = true;
+    }
+
+    return true;
+  }
+
+  if (rejoin_stats.method == REJOIN_DIRECT && millis() - pair_time >= REJOIN_VERIFY_MS) {
+    LOG("rejoin_check: remembered master has not responded");
+    rejoin_stats.method = REJOIN_NONE;
+    stage = REJOIN_PASSIVE_SCAN;
+    return false;
+  }
+
+  return true;
+}
+
+//
+/// remember the master, in RTC memory, and in flash if it has changed
+//
+
+void rejoin_save(const uint8_t *mac_master, byte chan) {
+
+  rejoin_cache_t c;
+
+  c.magic = REJOIN_MAGIC;
+  c.network_number = config_data.network_number;
+  c.channel = chan;
+  memcpy(c.mac_master, mac_master, sizeof(uint8_t[6]));
+
+  memcpy(&rtc_cache, &c, sizeof(c));
+
+  if (memcmp(&c, &cache, sizeof(c)) != 0) {
+    memcpy(&cache, &c, sizeof(c));
+    EEPROM.writeBytes(EEPROM_REJOIN_ADDR, (void *)&c, sizeof(c));
+    EEPROM.commit();
+    VLOG("rejoin_save: saved master = %s, channel = %d", mac_to_char(mac_master), chan);
+  }
+
+  return;
+}
+
+//
+/// the name of a join method, for stats
+//
+
+const char *rejoin_method_name(byte method) {
+  return (method < REJOIN_NONE) ? stage_names[method] : "none";
+}
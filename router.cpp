@@ -0,0 +1,195 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// a subscription-based router for messages sent with send_message_to_queues
+/// each consumer task registers the opcodes and frame types it handles for its input queue(s), and an optional enable predicate
+/// the opcode and frame type tables are precomputed bitmaps of subscribed queues, indexed by opcode and frame type,
+/// so routing a frame is a couple of table lookups, with the predicates evaluated only for the queues that remain
+//
+
+static uint16_t route_map[256];                       // subscribed queues, by opcode
+static uint16_t empty_map;                            // subscribed queues for frames with no payload, and non-frame messages
+static uint16_t type_map[4];                          // subscribed queues, by frame type
+static route_predicate_t predicates[16];              // per-queue enable predicates, may be NULL
+static uint16_t predicate_map;                        // queues that have a predicate
+static portMUX_TYPE router_mux = portMUX_INITIALIZER_UNLOCKED;
+
+router_stats_t router_stats;
+
+//
+/// register a subscription for a queue
+/// queue is a single QUEUE_* bit; opcodes == NULL subscribes to all opcodes, frames with no payload, and non-frame messages
+/// frame_types is an or'd combination of ROUTE_FRAME_STD, ROUTE_FRAME_EXT and ROUTE_FRAME_RTR
+//
+
+void router_subscribe(uint16_t queue, const byte *opcodes, byte num_opcodes, byte frame_types, route_predicate_t enabled) {
+
+  byte i;
+
+  portENTER_CRITICAL(&router_mux);
+
+  if (opcodes == NULL) {
+    for (i = 0; i < 255; i++) {
+      route_map[i] |= queue;
+    }
+
+    route_map[255] |= queue;
+    empty_map |= queue;
+  } else {
+    for (i = 0; i < num_opcodes; i++) {
+      route_map[opcodes[i]] |= queue;
+    }
+  }
+
+  // frame type index: bit 0 = extended, bit 1 = RTR
+  if (frame_types & ROUTE_FRAME_STD) {
+    type_map[0] |= queue;
+  }
+
+  if (frame_types & ROUTE_FRAME_EXT) {
+    type_map[1] |= queue;
+  }
+
+  if ((frame_types & ROUTE_FRAME_STD) && (frame_types & ROUTE_FRAME_RTR)) {
+    type_map[2] |= queue;
+  }
+
+  if ((frame_types & ROUTE_FRAME_EXT) && (frame_types & ROUTE_FRAME_RTR)) {
+    type_map[3] |= queue;
+  }
+
+  if (enabled != NULL) {
+    predicates[__builtin_ctz(queue)] = enabled;
+    predicate_map |= queue;
+  }
+
+  portEXIT_CRITICAL(&router_mux);
+  return;
+}
+
+//
+/// return the subset of the candidate queues that should receive this message
+/// messages that are not CAN frames, e.g. wrapped GC strings, have no frame type or opcode to look up,
+/// so they are only delivered to queues subscribed to all opcodes
+//
+
+uint16_t router_select(uint16_t candidates, const void *msg, bool is_frame) {
+
+  uint16_t selected, pending;
+
+  if (is_frame) {
+    const twai_message_t *cf = (const twai_message_t *)msg;
+    byte type = ((cf->flags & TWAI_MSG_FLAG_EXTD) ? 1 : 0) | ((cf->flags & TWAI_MSG_FLAG_RTR) ? 2 : 0);
+    selected = candidates & type_map[type] & ((cf->data_length_code > 0 && cf->data_length_code <= 8) ? route_map[cf->data[0]] : empty_map);
+  } else {
+    selected = candidates & empty_map;
+  }
+
+  // evaluate the enable predicates, only for the queues that remain
+  pending = selected & predicate_map;
+
+  while (pending) {
+    byte i = __builtin_ctz(pending);
+    pending &= pending - 1;
+
+    if (!predicates[i]()) {
+      selected &= ~(1 << i);
+    }
+  }
+
+  ++router_stats.messages;
+  router_stats.deliveries += __builtin_popcount(selected);
+  router_stats.filtered += __builtin_popcount(candidates & ~selected);
+
+  return selected;
+}
+
+//
+/// summarise the frames wanted by the enabled subscribers among the candidate queues, for the CAN acceptance filter
+/// types is a bitmap of frame type indexes, as type_map; opcodes is a 256-bit bitmap
+/// returns true if frames with no payload are wanted
+//
+
+bool router_wanted(uint16_t candidates, byte *types, byte *opcodes) {
+
+  uint16_t enabled, pending;
+  bool empty;
+
+  // evaluate the enable predicates once, outside the critical section
+  pending = candidates & predicate_map;
+  enabled = candidates;
+
+  while (pending) {
+    byte i = __builtin_ctz(pending);
+    pending &= pending - 1;
+
+    if (!predicates[i]()) {
+      enabled &= ~(1 << i);
+    }
+  }
+
+  *types = 0;
+  bzero(opcodes, 32);
+
+  portENTER_CRITICAL(&router_mux);
+
+  for (byte t = 0; t < 4; t++) {
+    if (type_map[t] & enabled) {
+      *types |= (1 << t);
+    }
+  }
+
+  for (unsigned int i = 0; i < 256; i++) {
+    if (route_map[i] & enabled) {
+      bitSet(opcodes[i >> 3], i & 7);
+    }
+  }
+
+  empty = (empty_map & enabled) != 0;
+
+  portEXIT_CRITICAL(&router_mux);
+  return empty;
+}
@@ -0,0 +1,244 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+#include "cbusdefs.h"
+
+//
+/// split bus mode - the master sends each slave only the frames it can act on
+///
+/// each slave has a single CANCAB, which needs the PLOC and ERR replies to its own requests, the speed and function
+/// frames for its own CANCMD session, e.g. when a loco is shared, and a few opcodes of interest to every cab,
+/// e.g. track power and emergency stop, plus any opcodes added to the allow-list in the config
+///
+/// the master learns the loco address each slave has requested from its RLOC and GLOC frames, and the session number
+/// allocated to it from the PLOC reply; the session is also taken from the slave's DKEEP and DSPD frames, and its
+/// session keepalive messages, so is relearnt if the master restarts
+//
+
+// variables declared in other source files
+extern config_t config_data;
+extern peer_state_t peers[MAX_NET_PEERS];
+extern portMUX_TYPE peer_mux;
+
+// opcodes forwarded to all slaves
+static byte split_opcodes[32];
+
+static const byte split_opcode_list[] = {
+  OPC_TOF, OPC_TON, OPC_ESTOP, OPC_ARST, OPC_HLT, OPC_BON
+};
+
+// opcodes whose first data byte is a CANCMD session number
+static byte session_opcodes[32];
+
+static const byte session_opcode_list[] = {
+  OPC_KLOC, OPC_QLOC, OPC_DKEEP, OPC_STMOD, OPC_PCON, OPC_KCON, OPC_DSPD, OPC_DFLG,
+  OPC_DFNON, OPC_DFNOF, OPC_SSTAT, OPC_DFUN, OPC_PCVS, OPC_PLOC
+};
+
+//
+/// initialise the opcode tables, including the allow-list from the config
+//
+
+void split_init(void) {
+
+  bzero(split_opcodes, sizeof(split_opcodes));
+  bzero(session_opcodes, sizeof(session_opcodes));
+
+  for (byte i = 0; i < sizeof(split_opcode_list); i++) {
+    bitSet(split_opcodes[split_opcode_list[i] >> 3], split_opcode_list[i] & 7);
+  }
+
+  // zero is an unused entry
+  for (byte i = 0; i < NUM_SPLIT_OPCODES; i++) {
+    if (config_data.split_opcodes[i] != 0) {
+      bitSet(split_opcodes[config_data.split_opcodes[i] >> 3], config_data.split_opcodes[i] & 7);
+    }
+  }
+
+  for (byte i = 0; i < sizeof(session_opcode_list); i++) {
+    bitSet(session_opcodes[session_opcode_list[i] >> 3], session_opcode_list[i] & 7);
+  }
+
+  return;
+}
+
+//
+/// returns true if split bus mode is in use
+//
+
+bool split_enabled(void) {
+  return (config_data.role == ROLE_MASTER && config_data.bridge_mode == SPLIT_BUS);
+}
+
+//
+/// learn the loco address and session of a slave's cab, from a frame it has sent
+//
+
+void split_learn(const uint8_t *mac_addr, const twai_message_t *frame) {
+
+  int idx;
+
+  if (!split_enabled() || frame->data_length_code < 2 || (frame->flags & (TWAI_MSG_FLAG_EXTD | TWAI_MSG_FLAG_RTR))) {
+    return;
+  }
+
+  // hold the peer table lock while the record is updated, so its slot can't be reused meanwhile
+  portENTER_CRITICAL(&peer_mux);
+
+  if ((idx = peer_find_locked(mac_addr)) < 0) {
+    portEXIT_CRITICAL(&peer_mux);
+    return;
+  }
+
+  switch (frame->data[0]) {
+    case OPC_RLOC:
+    case OPC_GLOC:
+      peers[idx].loco_addr = (frame->data[1] << 8) + frame->data[2];
+      break;
+
+    case OPC_DKEEP:
+    case OPC_DSPD:
+      peers[idx].CANCMD_session = frame->data[1];
+      break;
+
+    case OPC_KLOC:
+      if (peers[idx].CANCMD_session == frame->data[1]) {
+        peers[idx].CANCMD_session = -1;
+      }
+      break;
+  }
+
+  portEXIT_CRITICAL(&peer_mux);
+  return;
+}
+
+//
+/// the slaves a frame should be sent to, as a bitmap of peer table indexes
+/// a PLOC reply to a loco request also records the session allocated to the requesting slave
+//
+
+uint32_t split_peer_mask(const twai_message_t *frame) {
+
+  uint32_t mask = 0, all = 0;
+  uint16_t addr = 0;
+  int session = -1;
+  byte opc;
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+    if (peers[i].mac_addr[0] != 0) {
+      all |= (1UL << i);
+    }
+  }
+
+  if (frame->data_length_code == 0 || (frame->flags & (TWAI_MSG_FLAG_EXTD | TWAI_MSG_FLAG_RTR))) {
+    return 0;
+  }
+
+  opc = frame->data[0];
+
+  if (bitRead(split_opcodes[opc >> 3], opc & 7)) {
+    return all;
+  }
+
+  // too short to tell who it is for
+  if ((opc == OPC_PLOC || opc == OPC_ERR) && frame->data_length_code < 4) {
+    return all;
+  }
+
+  if (bitRead(session_opcodes[opc >> 3], opc & 7)) {
+    session = frame->data[1];
+  }
+
+  if (opc == OPC_PLOC) {
+    addr = (frame->data[2] << 8) + frame->data[3];
+  }
+
+  // an error refers to either a loco address or a session
+  if (opc == OPC_ERR) {
+    switch (frame->data[3]) {
+      case ERR_LOCO_STACK_FULL:
+      case ERR_LOCO_ADDR_TAKEN:
+      case ERR_LOCO_NOT_FOUND:
+      case ERR_INVALID_REQUEST:
+        addr = (frame->data[1] << 8) + frame->data[2];
+        break;
+
+      case ERR_SESSION_NOT_PRESENT:
+      case ERR_SESSION_CANCELLED:
+        session = frame->data[1];
+        break;
+
+      default:
+        return all;
+    }
+  }
+
+  if (session < 0 && addr == 0) {
+    return 0;
+  }
+
+  for (byte i = 0; i < MAX_NET_PEERS; i++) {
+
+    if (!(all & (1UL << i))) {
+      continue;
+    }
+
+    if (addr != 0 && peers[i].loco_addr == addr) {
+      mask |= (1UL << i);
+      peers[i].loco_addr = 0;
+
+      if (opc == OPC_PLOC) {
+        peers[i].CANCMD_session = session;
+      }
+    } else if (session >= 0 && peers[i].CANCMD_session == session) {
+      mask |= (1UL << i);
+
+      if (opc == OPC_ERR) {
+        peers[i].CANCMD_session = -1;
+      }
+    }
+  }
+
+  return mask;
+}
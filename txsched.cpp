@@ -0,0 +1,271 @@
+//
+/// ESP32 CAN WiFi Bridge
+/// (c) Duncan Greenwood, 2019, 2020
+//
+
+/*
+
+  Copyright (C) Duncan Greenwood, 2019
+
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+
+*/
+
+
+#include <WiFi.h>
+#include "defs.h"
+
+//
+/// a priority scheduler for frames waiting to be sent to the local CAN bus
+/// frames from all sources are held in FIFO lists per CBUS priority level and per source,
+/// and the next frame is taken from the highest priority level, with sources at that level served round-robin
+/// the lists are linked through the frame pool handle, so the scheduler needs no storage of its own for frames
+/// used only by CAN_tx_task, so no locking is required
+///
+/// frames held here keep their frame pool slots, so if the bus stops taking frames, e.g. when it is bus-off or nothing
+/// acks, they must not pile up until the pool is exhausted and the rest of the bridge stops; each source may have only
+/// TX_SCHED_SOURCE_MAX frames waiting, frames older than TX_SCHED_MAX_AGE_MS are dropped, and all frames are dropped
+/// while the bus is not running; a dropped frame is released back to the pool and counted
+//
+
+static frame_handle_t next_fh[FRAME_POOL_SIZE];                   // list links, by frame handle
+static unsigned long enq_time[FRAME_POOL_SIZE];                   // time each frame entered the scheduler
+static frame_handle_t head[TX_SCHED_NUM_PRIORITIES][TX_SRC_NUM];
+static frame_handle_t tail[TX_SCHED_NUM_PRIORITIES][TX_SRC_NUM];
+static byte next_source[TX_SCHED_NUM_PRIORITIES];                 // round-robin position, per priority level
+static uint16_t nonempty;                                         // bitmap of priority levels with waiting frames
+static unsigned int num_pending;
+static unsigned int source_pending[TX_SRC_NUM];
+
+tx_sched_stats_t tx_sched_stats[TX_SCHED_NUM_PRIORITIES];
+tx_sched_drops_t tx_sched_drops;
+unsigned int tx_sched_hwm;
+
+//
+/// initialise the scheduler lists
+//
+
+void tx_sched_init(void) {
+
+  for (byte p = 0; p < TX_SCHED_NUM_PRIORITIES; p++) {
+    for (byte s = 0; s < TX_SRC_NUM; s++) {
+      head[p][s] = FRAME_HANDLE_NONE;
+      tail[p][s] = FRAME_HANDLE_NONE;
+    }
+
+    next_source[p] = 0;
+  }
+
+  for (byte s = 0; s < TX_SRC_NUM; s++) {
+    source_pending[s] = 0;
+  }
+
+  nonempty = 0;
+  num_pending = 0;
+  tx_sched_hwm = 0;
+  memset(tx_sched_stats, 0, sizeof(tx_sched_stats));
+  memset(&tx_sched_drops, 0, sizeof(tx_sched_drops));
+  return;
+}
+
+//
+/// the CBUS priority of a frame - the major and minor priority bits are the top 4 bits of the 11-bit identifier
+/// for extended frames, we use the same bits of the 29-bit identifier, which also arbitrate first on the bus
+/// lower values are higher priority
+//
+
+byte tx_sched_priority(const twai_message_t *frame) {
+
+  if (frame->flags & TWAI_MSG_FLAG_EXTD) {
+    return (frame->identifier >> 25) & 0x0f;
+  }
+
+  return (frame->identifier >> 7) & 0x0f;
+}
+
+//
+/// unlink the frame at the head of the list for a priority and source, which must not be empty
+//
+
+static frame_handle_t unlink_head(byte p, byte s) {
+
+  frame_handle_t fh = head[p][s];
+
+  head[p][s] = next_fh[fh];
+
+  if (head[p][s] == FRAME_HANDLE_NONE) {
+    tail[p][s] = FRAME_HANDLE_NONE;
+
+    bool level_empty = true;
+
+    for (byte i = 0; i < TX_SRC_NUM; i++) {
+      if (head[p][i] != FRAME_HANDLE_NONE) {
+        level_empty = false;
+        break;
+      }
+    }
+
+    if (level_empty) {
+      nonempty &= ~(1 << p);
+    }
+  }
+
+  --num_pending;
+  --source_pending[s];
+  return fh;
+}
+
+//
+/// add a frame to the tail of the list for its priority and source
+/// returns false if the source already has too many frames waiting; the frame is dropped and released
+//
+
+bool tx_sched_put(frame_handle_t fh, byte source) {
+
+  if (source_pending[source] >= TX_SCHED_SOURCE_MAX) {
+    frame_pool_release(fh);
+    ++tx_sched_drops.full;
+    return false;
+  }
+
+  byte p = tx_sched_priority(frame_pool_get(fh));
+
+  next_fh[fh] = FRAME_HANDLE_NONE;
+  enq_time[fh] = micros();
+
+  if (head[p][source] == FRAME_HANDLE_NONE) {
+    head[p][source] = fh;
+  } else {
+    next_fh[tail[p][source]] = fh;
+  }
+
+  tail[p][source] = fh;
+  nonempty |= (1 << p);
+  ++num_pending;
+  ++source_pending[source];
+
+  if (num_pending > tx_sched_hwm) {
+    tx_sched_hwm = num_pending;
+  }
+
+  return true;
+}
+
+//
+/// remove the next frame to send, or return FRAME_HANDLE_NONE if there are none waiting
+/// the source of the frame is returned in *source
+//
+
+frame_handle_t tx_sched_get(byte *source) {
+
+  frame_handle_t fh;
+  unsigned long delay_us;
+  byte p, s;
+
+  if (nonempty == 0) {
+    return FRAME_HANDLE_NONE;
+  }
+
+  // highest priority level with waiting frames
+  p = __builtin_ctz(nonempty);
+
+  // next source in round-robin order at this level
+  s = next_source[p];
+
+  while (head[p][s] == FRAME_HANDLE_NONE) {
+    s = (s + 1) % TX_SRC_NUM;
+  }
+
+  next_source[p] = (s + 1) % TX_SRC_NUM;
+
+  fh = unlink_head(p, s);
+
+  // record queueing delay for this priority level
+  delay_us = micros() - enq_time[fh];
+  ++tx_sched_stats[p].frames;
+  tx_sched_stats[p].total_us += delay_us;
+
+  if (delay_us > tx_sched_stats[p].max_us) {
+    tx_sched_stats[p].max_us = delay_us;
+  }
+
+  *source = s;
+  return fh;
+}
+
+//
+/// drop frames that have waited longer than TX_SCHED_MAX_AGE_MS
+/// each list is in arrival order, so only the frames at the heads need be checked
+//
+
+void tx_sched_expire(void) {
+
+  unsigned long now = micros();
+
+  for (byte p = 0; nonempty >> p; p++) {
+    for (byte s = 0; s < TX_SRC_NUM; s++) {
+      while (head[p][s] != FRAME_HANDLE_NONE && now - enq_time[head[p][s]] > TX_SCHED_MAX_AGE_MS * 1000UL) {
+        frame_pool_release(unlink_head(p, s));
+        ++tx_sched_drops.expired;
+      }
+    }
+  }
+
+  return;
+}
+
+//
+/// drop all waiting frames, while the bus is not running
+//
+
+void tx_sched_flush(void) {
+
+  while (nonempty != 0) {
+    byte p = __builtin_ctz(nonempty);
+
+    for (byte s = 0; s < TX_SRC_NUM; s++) {
+      while (head[p][s] != FRAME_HANDLE_NONE) {
+        frame_pool_release(unlink_head(p, s));
+        ++tx_sched_drops.bus_down;
+      }
+    }
+  }
+
+  return;
+}
+
+//
+/// number of frames waiting
+//
+
+unsigned int tx_sched_pending(void) {
+  return num_pending;
+}
@@ -65,10 +65,27 @@ extern bool switches_present;
 extern char mdnsname[];
 extern stats_t stats, errors;
 extern peer_state_t peers[MAX_NET_PEERS];
-extern gcclient_t gc_clients[MAX_GC_CLIENTS];
+extern gcclient_t gc_clients[MAX_GC_CLIENTS + 1];
 extern byte num_peers, num_gc_clients, num_wi_clients;
 extern bool in_transition, enum_required;
-extern task_info_t task_list[12];
+extern task_info_t task_list[15];
+extern frame_pool_stats_t frame_pool_stats;
+extern router_stats_t router_stats;
+extern can_filter_stats_t can_filter_stats;
+extern busload_stats_t busload_stats;
+extern can_alert_stats_t can_alert_stats;
+extern logsink_stats_t logsink_stats;
+extern gc_out_stats_t gc_out_stats;
+extern net_batch_stats_t net_batch_stats;
+extern net_msg_stats_t net_msg_stats[NET_MSG_NUM_TYPES];
+extern net_rx_stats_t net_rx_stats;
+extern net_rel_stats_t net_rel_stats;
+extern keepalive_stats_t keepalive_stats;
+extern rejoin_stats_t rejoin_stats;
+extern bool boot_resumed;
+extern tx_sched_stats_t tx_sched_stats[TX_SCHED_NUM_PRIORITIES];
+extern tx_sched_drops_t tx_sched_drops;
+extern unsigned int tx_sched_hwm;
 extern MCP23008 mcp;
 
 // externally defined functions
@@ -97,6 +114,8 @@ const char htmlMenu[]   = "<h3> Node: {{mdnsname}}</h3>"
                           "<div>Device configuration <button onclick=\"window.location.href = '/config';\">Click</button></div>"
                           "<div>Info <button onclick=\"window.location.href = '/info';\">Click</button></div>"
                           "<div>Stats <button onclick=\"window.location.href = '/stats';\">Click</button></div>"
+                          "<div>Recent log <button onclick=\"window.location.href = '/log';\">Click</button></div>"
+                          "<div>Log levels <button onclick=\"window.location.href = '/log_levels';\">Click</button></div>"
                           "<div>File upload <button onclick=\"window.location.href = '/file_upload';\">Click</button></div>"
                           "<div>Software update <button onclick=\"window.location.href = '/softwareupdate';\">Click</button></div>"
                           "<div>Restart <button onclick=\"window.location.href = '/restart';\">Click</button></div>"
@@ -200,6 +219,14 @@ const char htmlConfig[] = "<h3>Node: {{mdnsname}}</h3>"
                           "<input type = 'checkbox' name = 'gc_server_on' {{gc_server_on}}> GridConnect server (master only)<br>"
                           "GC server port: <input type = 'number' name = 'gc_server_port' min = '1024' max = '65535' step = '1' value = '{{gc_server_port}}'> <br>"
                           "<input type = 'checkbox' name = 'gc_serial_on' {{gc_serial_on}}> Enable USB serial port<br>"
+                          "Slow network clients: <br>"
+                          "<input type = 'radio' name = 'gc_overflow_policy' value = 'drop' {{gc_drop_selected}}> Drop oldest messages<br>"
+                          "<input type = 'radio' name = 'gc_overflow_policy' value = 'disconnect' {{gc_disconnect_selected}}> Disconnect<br>"
+                          "Except drop oldest for: <input type = 'text' name = 'gc_drop_ips' maxlength = '64' value = '{{gc_drop_ips}}'> IP addresses<br>"
+                          "and disconnect: <input type = 'text' name = 'gc_disconnect_ips' maxlength = '64' value = '{{gc_disconnect_ips}}'> IP addresses<br>"
+                          "Slow USB serial port: <br>"
+                          "<input type = 'radio' name = 'gc_serial_overflow_policy' value = 'drop' {{gc_serial_drop_selected}}> Drop oldest messages<br>"
+                          "<input type = 'radio' name = 'gc_serial_overflow_policy' value = 'discard' {{gc_serial_discard_selected}}> Discard all waiting messages<br>"
                           "<hr>"
 
                           "<input type = 'checkbox' name = 'withrottle_on' {{withrottle_on}}> WiThrottle server (master only)<br>"
@@ -216,12 +243,12 @@ const char htmlConfig[] = "<h3>Node: {{mdnsname}}</h3>"
                           "<input type = 'checkbox' name = 'cmdproxy_on' {{cmdproxy_on}}> DCC++ CANCMD proxy (master only)<br>"
                           "<hr>"
 
-                          /*
-                            Bridge mode: <br> \
-                            <input type = 'radio' name = 'bridge_mode' value = 'transparent' {{transparent_selected}} > Transparent<br> \
-                            <input type = 'radio' name = 'bridge_mode' value = 'filtering' {{filtering_selected}} > Filtering (not implemented yet)<br> \
-                            <br> \
-                          */
+                          "Bridge mode (master only): <br>"
+                          "<input type = 'radio' name = 'bridge_mode' value = 'transparent' {{transparent_selected}}> Transparent<br>"
+                          "<input type = 'radio' name = 'bridge_mode' value = 'split' {{split_selected}}> Split bus - satellites receive only their own cab traffic<br>"
+                          "Also send to all satellites: <input type = 'text' name = 'split_opcodes' maxlength = '32' value = '{{split_opcodes}}'> opcodes, hex<br>"
+                          "<hr>"
+
 
                           "<input type = 'submit' value = 'Save & restart'>"
                           "</form>";
@@ -294,6 +321,8 @@ void start_webserver(void) {
   webserver.on("/store", handle_store);
   webserver.on("/info", handle_info);
   webserver.on("/stats", handle_stats);
+  webserver.on("/log_levels", handle_log_levels);
+  webserver.on("/log", handle_log);
   webserver.on("/stop", handle_stop);
   webserver.on("/do_deepsleep", do_deepsleep);
   webserver.on("/restart", handle_restart);
@@ -308,7 +337,7 @@ void start_webserver(void) {
   }, save_uploaded_file);
 
   webserver.on("/softwareupdate", HTTP_GET, []() {
-    LOG("webserver: handling /softwareupdate");
+    LOGI(LOG_MOD_WEB, "webserver: handling /softwareupdate");
     webserver.sendHeader("Connection", "close");
     webserver.send(200, "text/html", softwareupdate);
   });
@@ -340,7 +369,7 @@ void start_webserver(void) {
   });
 
   webserver.on("/file_upload", HTTP_GET, []() {
-    LOG("webserver: handling /file_upload - GET");
+    LOGI(LOG_MOD_WEB, "webserver: handling /file_upload - GET");
 
     webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
     webserver.send(200, "text/html", "");
@@ -353,7 +382,7 @@ void start_webserver(void) {
   });
 
   webserver.on("/file_upload", HTTP_POST, []() {
-    LOG("webserver: handling /file_upload - POST");
+    LOGI(LOG_MOD_WEB, "webserver: handling /file_upload - POST");
     webserver.send(200);
   },
   handle_file_upload);
@@ -433,7 +462,7 @@ String get_content_type(String filename) {
 
 void handle_root(void) {
 
-  LOG("webserver: handling /");
+  LOGI(LOG_MOD_WEB, "webserver: handling /");
   PULSE_LED(NET_ACT_LED);
 
   String tmp = String(htmlMenu);
@@ -454,7 +483,7 @@ void handle_root(void) {
 
 void handle_config(void) {
 
-  LOG("webserver: handling /config");
+  LOGI(LOG_MOD_WEB, "webserver: handling /config");
   PULSE_LED(NET_ACT_LED);
 
   // update template variables
@@ -487,14 +516,52 @@ void handle_config(void) {
     tmp.replace("{{slave_selected}}", "");
   }
 
-  if (config_data.bridge_mode) {
+  if (config_data.bridge_mode == SPLIT_BUS) {
     tmp.replace("{{transparent_selected}}", "");
-    tmp.replace("{{filtering_selected}}", "checked");
+    tmp.replace("{{split_selected}}", "checked");
   } else {
     tmp.replace("{{transparent_selected}}", "checked");
-    tmp.replace("{{filtering_selected}}", "");
+    tmp.replace("{{split_selected}}", "");
+  }
+
+  String ops = "";
+
+  for (byte i = 0; i < NUM_SPLIT_OPCODES; i++) {
+    if (config_data.split_opcodes[i] != 0) {
+      ops += String(config_data.split_opcodes[i], HEX) + " ";
+    }
   }
 
+  tmp.replace("{{split_opcodes}}", ops);
+
+  if (config_data.gc_overflow_policy == GC_OVERFLOW_DISCONNECT) {
+    tmp.replace("{{gc_drop_selected}}", "");
+    tmp.replace("{{gc_disconnect_selected}}", "checked");
+  } else {
+    tmp.replace("{{gc_drop_selected}}", "checked");
+    tmp.replace("{{gc_disconnect_selected}}", "");
+  }
+
+  if (config_data.gc_serial_overflow_policy == GC_OVERFLOW_DISCONNECT) {
+    tmp.replace("{{gc_serial_drop_selected}}", "");
+    tmp.replace("{{gc_serial_discard_selected}}", "checked");
+  } else {
+    tmp.replace("{{gc_serial_drop_selected}}", "checked");
+    tmp.replace("{{gc_serial_discard_selected}}", "");
+  }
+
+  String drop_ips = "", disconnect_ips = "";
+
+  for (byte i = 0; i < GC_OVERFLOW_IPS; i++) {
+    if (config_data.gc_overflow_ip[i] != 0) {
+      String &ips = (config_data.gc_overflow_ip_policy[i] == GC_OVERFLOW_DISCONNECT) ? disconnect_ips : drop_ips;
+      ips += IPAddress(config_data.gc_overflow_ip[i]).toString() + " ";
+    }
+  }
+
+  tmp.replace("{{gc_drop_ips}}", drop_ips);
+  tmp.replace("{{gc_disconnect_ips}}", disconnect_ips);
+
   if (config_data.config_mode) {
     tmp.replace("{{browser_selected}}", "");
     tmp.replace("{{switches_selected}}", "checked");
@@ -623,14 +690,14 @@ void handle_config(void) {
 
 void handle_store(void) {
 
-  LOG("webserver: handling /store");
+  LOGI(LOG_MOD_WEB, "webserver: handling /store");
   PULSE_LED(NET_ACT_LED);
 
   // update config
   config_data.role = (webserver.arg("role") == "master") ? ROLE_MASTER : ROLE_SLAVE;
   config_data.network_number = webserver.arg("network_number").toInt();
   config_data.config_mode = (webserver.arg("config_mode") == "browser") ? CONFIG_USES_SW : CONFIG_USES_HW;
-  config_data.bridge_mode = (webserver.arg("bridge_mode") == "transparent") ? TRANSPARENT_MODE : SPLIT_BUS;
+  config_data.bridge_mode = (webserver.arg("bridge_mode") == "split") ? SPLIT_BUS : TRANSPARENT_MODE;
   config_data.slave_number = webserver.arg("slave_number").toInt();
   config_data.gc_server_on = (webserver.arg("gc_server_on") == "on") ? true : false;
   config_data.gc_server_port = webserver.arg("gc_server_port").toInt();
@@ -681,6 +748,75 @@ void handle_store(void) {
     config_data.dcc_type = DCC_UNK;
   }
 
+  // split bus allow-list, a list of hex opcodes separated by spaces or commas
+  bzero(config_data.split_opcodes, sizeof(config_data.split_opcodes));
+  config_data.split_opcodes_guard = SPLIT_OPCODES_GUARD;
+  String ops = webserver.arg("split_opcodes");
+  const char *p = ops.c_str();
+  char *end;
+
+  for (byte i = 0; i < NUM_SPLIT_OPCODES; ) {
+    while (*p == ' ' || *p == ',') {
+      ++p;
+    }
+
+    if (*p == 0) {
+      break;
+    }
+
+    unsigned long opc = strtoul(p, &end, 16);
+
+    if (end == p) {
+      break;
+    }
+
+    if (opc > 0 && opc <= 0xff) {
+      config_data.split_opcodes[i++] = opc;
+    }
+
+    p = end;
+  }
+
+  // GC overflow policies, and addresses with their own, separated by spaces or commas
+  config_data.gc_overflow_policy = (webserver.arg("gc_overflow_policy") == "disconnect") ? GC_OVERFLOW_DISCONNECT : GC_OVERFLOW_DROP_OLDEST;
+  config_data.gc_serial_overflow_policy = (webserver.arg("gc_serial_overflow_policy") == "discard") ? GC_OVERFLOW_DISCONNECT : GC_OVERFLOW_DROP_OLDEST;
+  bzero(config_data.gc_overflow_ip, sizeof(config_data.gc_overflow_ip));
+  byte n = 0;
+
+  for (byte policy = GC_OVERFLOW_DROP_OLDEST; policy <= GC_OVERFLOW_DISCONNECT; policy++) {
+    String ips = webserver.arg((policy == GC_OVERFLOW_DISCONNECT) ? "gc_disconnect_ips" : "gc_drop_ips");
+    p = ips.c_str();
+
+    while (n < GC_OVERFLOW_IPS) {
+      while (*p == ' ' || *p == ',') {
+        ++p;
+      }
+
+      if (*p == 0) {
+        break;
+      }
+
+      char addr[16];
+      byte len = 0;
+
+      while (*p != 0 && *p != ' ' && *p != ',') {
+        if (len < sizeof(addr) - 1) {
+          addr[len++] = *p;
+        }
+
+        ++p;
+      }
+
+      addr[len] = 0;
+      IPAddress ip;
+
+      if (ip.fromString(addr) && (uint32_t)ip != 0) {
+        config_data.gc_overflow_ip[n] = (uint32_t)ip;
+        config_data.gc_overflow_ip_policy[n++] = policy;
+      }
+    }
+  }
+
   // indicates a valid config
   config_data.guard_val = 99;
 
@@ -716,7 +852,7 @@ void handle_info(void) {
   char tbuff[64];
   int num_files = 0;
 
-  VLOG("webserver: handling %s", webserver.uri().c_str());
+  LOGI(LOG_MOD_WEB, "webserver: handling %s", webserver.uri().c_str());
   PULSE_LED(NET_ACT_LED);
 
   byte mins = (millis() / 1000 / 60) % 60;
@@ -811,9 +947,9 @@ void handle_info(void) {
 void handle_stats(void) {
 
   String tmp;
-  char tmpbuff[100];
+  char tmpbuff[128];
 
-  LOG("webserver: handling /stats");
+  LOGI(LOG_MOD_WEB, "webserver: handling /stats");
   PULSE_LED(NET_ACT_LED);
 
   tmp = String(htmlStats);
@@ -836,22 +972,208 @@ void handle_stats(void) {
 
   for (byte i = 0; i < MAX_NET_PEERS; i++) {
     if (peers[i].mac_addr[0] != 0) {
-      sprintf(tmpbuff, "[%2d] %s, CANID = %d, tx = %d, rx = %d, errs = %d, battery = %d", i, mac_to_char(peers[i].mac_addr), peers[i].CANID, peers[i].tx, peers[i].rx, peers[i].num_errs, peers[i].battery_mv);
+      snprintf(tmpbuff, sizeof(tmpbuff), "[%2d] %s, CANID = %d, tx = %d, rx = %d, errs = %d, battery = %d, version = %d", i, mac_to_char(peers[i].mac_addr), peers[i].CANID, peers[i].tx, peers[i].rx, peers[i].num_errs, peers[i].battery_mv, peers[i].wire_version);
       tmp += String(tmpbuff);
       tmp += "<br/>";
     }
   }
 
   tmp += "<h3>Gridconnect clients:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "network writes = %lu, bytes = %lu; last 10 s: writes/s = %u, bytes/write = %u", gc_out_stats.writes, \
+           gc_out_stats.bytes, gc_out_stats.writes_per_sec, gc_out_stats.bytes_per_write);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  for (byte i = 0; i <= MAX_GC_CLIENTS; i++) {
+    if (gc_clients[i].port != 0) {
+      snprintf(tmpbuff, sizeof(tmpbuff), "[%2d] %s, %d, queued = %u bytes, lag = %lu ms, max = %lu ms", i, gc_clients[i].addr, \
+               gc_clients[i].port, gc_clients[i].out_used, gc_client_lag_ms(i), gc_clients[i].max_lag_ms);
+      tmp += String(tmpbuff);
+      snprintf(tmpbuff, sizeof(tmpbuff), ", sent = %lu bytes, dropped = %lu messages, on overflow = %s", gc_clients[i].out_sent, \
+               gc_clients[i].out_dropped, (gc_clients[i].policy == GC_OVERFLOW_DROP_OLDEST) ? "drop oldest" : (i == SERIAL_CLIENT) ? "discard all" : "disconnect");
+      tmp += String(tmpbuff);
+      tmp += "<br/>";
+    }
+  }
+
+  tmp += "<h3>Frame pool:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "size = %d, in use = %u, hwm = %u, allocs = %lu, exhausted = %lu", FRAME_POOL_SIZE, frame_pool_stats.in_use, frame_pool_stats.hwm, frame_pool_stats.allocs, frame_pool_stats.exhausted);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>Startup:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "%s start, master joined by %s, attempts = %u", boot_resumed ? "resume" : "cold", rejoin_method_name(rejoin_stats.method), rejoin_stats.attempts);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  for (byte i = 0; i < BOOT_NUM_PHASES; i++) {
+    if (boot_format(i, tmpbuff, sizeof(tmpbuff))) {
+      tmp += String(tmpbuff);
+      tmp += "<br/>";
+    }
+  }
+
+  tmp += "<h3>Router:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "messages = %lu, deliveries = %lu, filtered = %lu", router_stats.messages, router_stats.deliveries, router_stats.filtered);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>CAN bus load:</h3>";
+  {
+    const byte windows[] = { 1, 10, 60 };
+    unsigned int pct[3];
+    byte keys[BUSLOAD_TOP_N], n;
+    unsigned long counts[BUSLOAD_TOP_N];
+
+    for (byte i = 0; i < 3; i++) {
+      pct[i] = busload_pct10(windows[i]);
+    }
+
+    snprintf(tmpbuff, sizeof(tmpbuff), "1 s = %u.%u%%, 10 s = %u.%u%%, 60 s = %u.%u%%, peak 1 s = %u.%u%%", pct[0] / 10, pct[0] % 10, \
+             pct[1] / 10, pct[1] % 10, pct[2] / 10, pct[2] % 10, busload_peak_pct10() / 10, busload_peak_pct10() % 10);
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+    snprintf(tmpbuff, sizeof(tmpbuff), "frames = %lu, extended = %lu%s", busload_stats.frames, busload_stats.ext_frames, \
+             can_filter_is_open() ? "" : ", excluding frames rejected by the acceptance filter");
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+
+    // busiest source CANIDs and opcodes, over the current and previous minute
+    for (byte by_opcode = 0; by_opcode < 2; by_opcode++) {
+      n = busload_top(by_opcode, keys, counts, BUSLOAD_TOP_N);
+      tmp += by_opcode ? "busiest opcodes:" : "busiest CANIDs:";
+
+      for (byte i = 0; i < n; i++) {
+        snprintf(tmpbuff, sizeof(tmpbuff), by_opcode ? " 0x%02x = %lu" : " %u = %lu", keys[i], counts[i]);
+        tmp += String(tmpbuff);
+      }
+
+      tmp += "<br/>";
+    }
+  }
+
+  tmp += "<h3>CAN alerts:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "bus off = %lu, recovered = %lu, error passive = %lu, error warning = %lu", can_alert_stats.bus_off, \
+           can_alert_stats.recovered, can_alert_stats.err_passive, can_alert_stats.err_warn);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "rx queue full = %lu, bus errors = %lu, tx failed = %lu", can_alert_stats.rx_queue_full, \
+           can_alert_stats.bus_error, can_alert_stats.tx_failed);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "time bus off = %lu ms, recovering = %lu ms, error passive = %lu ms", can_alert_state_ms(CAN_ALERT_BUS_OFF), \
+           can_alert_state_ms(CAN_ALERT_RECOVERING), can_alert_state_ms(CAN_ALERT_ERR_PASSIVE));
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>CAN acceptance filter:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "state = %s, reprogrammed = %lu, failures = %lu", can_filter_is_open() ? "accept all" : "narrowed", \
+           can_filter_stats.reprograms, can_filter_stats.failures);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "dropped in software = %lu, filtered in hardware = %lu (est.)", can_filter_stats.sw_dropped, can_filter_hw_estimate());
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>ESP-NOW batching:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "sent: packets = %lu, frames = %lu, batches = %lu", net_batch_stats.packets_tx, net_batch_stats.frames_tx, net_batch_stats.batches_tx);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "received: frames = %lu, batches = %lu", net_batch_stats.frames_rx, net_batch_stats.batches_rx);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "reflected: broadcast = %lu, unicast = %lu, own suppressed = %lu", net_batch_stats.reflect_broadcast, net_batch_stats.reflect_unicast, net_batch_stats.reflect_suppressed);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "split bus: frames not sent to a satellite = %lu", net_batch_stats.split_filtered);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  if (net_batch_stats.frames_tx > 0) {
+    unsigned long bpf10 = (net_batch_stats.wire_bytes_tx * 10) / net_batch_stats.frames_tx;
+    snprintf(tmpbuff, sizeof(tmpbuff), "wire bytes per frame = %lu.%lu, original format = %d", bpf10 / 10, bpf10 % 10, sizeof(twai_message_t));
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+  }
+
+  tmp += "<h3>ESP-NOW receive ring:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "size = %d, hwm = %u, packets = %lu, dropped = %lu", NET_RX_RING_SIZE, net_rx_stats.hwm, net_rx_stats.packets, net_rx_stats.dropped);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  if (net_rx_stats.packets + net_rx_stats.dropped > 0) {
+    snprintf(tmpbuff, sizeof(tmpbuff), "callback time: avg = %lu us, max = %lu us", net_rx_stats.cb_total_us / (net_rx_stats.packets + net_rx_stats.dropped), net_rx_stats.cb_max_us);
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+  }
+
+  tmp += "<h3>ESP-NOW reliable delivery:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "sent = %lu, retransmits = %lu, abandoned = %lu, window full = %lu, acks sent = %lu, acks received = %lu", net_rel_stats.sent, \
+           net_rel_stats.retransmits, net_rel_stats.abandoned, net_rel_stats.window_full, net_rel_stats.acks_tx, net_rel_stats.acks_rx);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "received: duplicates = %lu, out of order = %lu, lost = %lu, sender restarts = %lu, simulated loss = %lu", \
+           net_rel_stats.duplicates, net_rel_stats.reordered, net_rel_stats.lost, net_rel_stats.restarts, net_rel_stats.sim_dropped);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>Session keepalive:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "satellite: DKEEPs absorbed = %lu, session messages sent = %lu", keepalive_stats.absorbed, keepalive_stats.refresh_tx);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "master: session messages received = %lu, DKEEPs sent = %lu, expired = %lu", keepalive_stats.refresh_rx, keepalive_stats.synthesised, keepalive_stats.expired);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  tmp += "<h3>ESP-NOW messages:</h3>";
+
+  for (byte i = 0; i < NET_MSG_NUM_TYPES; i++) {
+    snprintf(tmpbuff, sizeof(tmpbuff), "%s: tx = %lu, rx = %lu, errors = %lu", net_msg_name(i), net_msg_stats[i].tx, net_msg_stats[i].rx, net_msg_stats[i].errs);
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+  }
 
-  for (byte i = 0; i < MAX_GC_CLIENTS; i++) {
-    if (gc_clients[i].client != NULL) {
-      sprintf(tmpbuff, "[%2d] %s, %d", i, gc_clients[i].addr, gc_clients[i].port);
+  tmp += "<h3>CAN transmit queueing delay:</h3>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "max frames waiting = %u", tx_sched_hwm);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+  snprintf(tmpbuff, sizeof(tmpbuff), "dropped: source full = %lu, too old = %lu, bus not running = %lu", tx_sched_drops.full, \
+           tx_sched_drops.expired, tx_sched_drops.bus_down);
+  tmp += String(tmpbuff);
+  tmp += "<br/>";
+
+  for (byte i = 0; i < TX_SCHED_NUM_PRIORITIES; i++) {
+    if (tx_sched_stats[i].frames > 0) {
+      snprintf(tmpbuff, sizeof(tmpbuff), "priority %d: frames = %lu, avg = %lu us, max = %lu us", i, tx_sched_stats[i].frames, \
+               tx_sched_stats[i].total_us / tx_sched_stats[i].frames, tx_sched_stats[i].max_us);
       tmp += String(tmpbuff);
       tmp += "<br/>";
     }
   }
 
+#if LATENCY_BENCHMARK
+  tmp += "<h3>Forwarding latency:</h3>";
+
+  for (byte i = 0; i < LAT_NUM_HOPS; i++) {
+    if (latency_format(i, tmpbuff, sizeof(tmpbuff))) {
+      tmp += String(tmpbuff);
+      tmp += "<br/>";
+    }
+  }
+#endif
+
+  if (config_data.debug) {
+    tmp += "<h3>Debug log file:</h3>";
+    snprintf(tmpbuff, sizeof(tmpbuff), "bytes written = %lu, pending = %u, dropped = %lu, write errors = %lu, new files = %lu", \
+             logsink_stats.bytes_written, logsink_pending(), logsink_stats.bytes_dropped, logsink_stats.write_errors, logsink_stats.rotations);
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+    snprintf(tmpbuff, sizeof(tmpbuff), "writes = %lu, write time: last = %lu us, max = %lu us, avg = %lu us", logsink_stats.flushes, \
+             logsink_stats.last_flush_us, logsink_stats.max_flush_us, logsink_stats.flushes ? logsink_stats.total_flush_us / logsink_stats.flushes : 0UL);
+    tmp += String(tmpbuff);
+    tmp += "<br/>";
+  }
+
   tmp += "<hr>";
   tmp += "<h3>Task stack sizes:</h3>";
 
@@ -873,9 +1195,119 @@ void handle_stats(void) {
   return;
 }
 
+//
+/// send the recent log messages kept in RAM, as plain text, each preceded by its sequence number
+/// /log?since=N sends only the messages from N onwards; the X-Log-Next header gives the value to use next time
+//
+
+void handle_log(void) {
+
+  String tmp;
+  char msg[DEBUG_MSG_LEN + 16];
+  unsigned long seq = 0, end, missed;
+
+  LOGI(LOG_MOD_WEB, "webserver: handling /log");
+  PULSE_LED(NET_ACT_LED);
+
+  if (webserver.hasArg("since")) {
+    seq = strtoul(webserver.arg("since").c_str(), NULL, 10);
+  }
+
+  // stop at the newest message now, so the header is right
+  end = logtail_next_seq();
+
+  webserver.sendHeader("X-Log-Next", String(end));
+  webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  webserver.send(200, "text/plain", "");
+
+  while (seq < end && logtail_read(&seq, msg, sizeof(msg), &missed)) {
+    if (missed > 0 && webserver.hasArg("since")) {
+      tmp += "*** " + String(missed) + " messages lost ***\n";
+    }
+
+    tmp += String(seq - 1) + " " + msg + "\n";
+
+    // send in chunks
+    if (tmp.length() >= 1024) {
+      webserver.sendContent(tmp);
+      tmp = "";
+    }
+  }
+
+  webserver.sendContent(tmp);
+  webserver.sendContent("");
+  webserver.client().stop();
+
+  return;
+}
+
+//
+/// show and change the runtime log level of each module
+/// changes take effect immediately and are saved with the config data
+/// levels above LOG_LEVEL_MAX are compiled out, so they aren't offered
+//
+
+void handle_log_levels(void) {
+
+  String tmp;
+  byte i, j;
+  bool changed = false;
+
+  LOGI(LOG_MOD_WEB, "webserver: handling /log_levels");
+  PULSE_LED(NET_ACT_LED);
+
+  for (i = 0; i < LOG_NUM_MODULES; i++) {
+    if (webserver.hasArg(log_module_names[i])) {
+      j = webserver.arg(log_module_names[i]).toInt();
+
+      if (j <= LOG_LEVEL_MAX && j != log_levels[i]) {
+        log_levels[i] = j;
+        config_data.log_levels[i] = j;
+        changed = true;
+        VLOG("webserver: log level for %s set to %s", log_module_names[i], log_level_names[j]);
+      }
+    }
+  }
+
+  if (changed) {
+    config_data.log_levels_guard = LOG_LEVELS_GUARD;
+    save_config();
+  }
+
+  tmp = "<h3>Log levels:</h3>";
+  tmp += "<form action = '/log_levels' method = 'post'>";
+
+  for (i = 0; i < LOG_NUM_MODULES; i++) {
+    tmp += String(log_module_names[i]) + ": <select name = '" + log_module_names[i] + "'>";
+
+    for (j = 0; j <= LOG_LEVEL_MAX; j++) {
+      tmp += "<option value = '" + String(j) + "'" + ((j == log_levels[i]) ? " selected" : "") + ">" + log_level_names[j] + "</option>";
+    }
+
+    tmp += "</select><br>";
+  }
+
+  if (LOG_LEVEL_MAX < LOG_NUM_LEVELS - 1) {
+    tmp += "<br>Levels above " + String(log_level_names[LOG_LEVEL_MAX]) + " are not compiled in; see LOG_LEVEL_MAX<br>";
+  }
+
+  tmp += "<br><input type = 'submit' value = 'Apply'></form>";
+
+  webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  webserver.send(200, "text/html", "");
+  webserver.sendContent(htmlHeader);
+  webserver.sendContent(htmlTitle);
+  webserver.sendContent(tmp);
+  webserver.sendContent(htmlFooter);
+  webserver.sendContent("");
+  webserver.client().stop();
+
+  return;
+}
+
 void handle_stop(void) {
 
-  LOG("webserver: handling /stop");
+  LOGI(LOG_MOD_WEB, "webserver: handling /stop");
   PULSE_LED(NET_ACT_LED);
 
   webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -892,7 +1324,7 @@ void handle_stop(void) {
 
 void do_deepsleep(void) {
 
-  LOG("webserver: handling /do_deepsleep");
+  LOGI(LOG_MOD_WEB, "webserver: handling /do_deepsleep");
   PULSE_LED(NET_ACT_LED);
 
   webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -910,7 +1342,7 @@ void do_deepsleep(void) {
 
 void handle_restart(void) {
 
-  LOG("webserver: handling /restart");
+  LOGI(LOG_MOD_WEB, "webserver: handling /restart");
   PULSE_LED(NET_ACT_LED);
 
   webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -929,7 +1361,7 @@ void handle_restart(void) {
 
 void handle_default(void) {
 
-  LOG("webserver: handling /default_config");
+  LOGI(LOG_MOD_WEB, "webserver: handling /default_config");
   PULSE_LED(NET_ACT_LED);
 
   webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -1015,7 +1447,7 @@ void handle_notfound(void) {
 
 void handle_rqnn(void) {
 
-  LOG("webserver: handling /rqnn");
+  LOGI(LOG_MOD_WEB, "webserver: handling /rqnn");
 
   if (config_data.role == ROLE_MASTER) {
     transition_to_flim();
@@ -1036,7 +1468,7 @@ void handle_rqnn(void) {
 
 void handle_enum(void) {
 
-  LOG("webserver: handling /enum");
+  LOGI(LOG_MOD_WEB, "webserver: handling /enum");
 
   if (config_data.role == ROLE_MASTER) {
     enum_required = true;
@@ -1053,7 +1485,7 @@ void handle_enum(void) {
 
 void handle_success() {
 
-  LOG("webserver: handling /success");
+  LOGI(LOG_MOD_WEB, "webserver: handling /success");
   PULSE_LED(NET_ACT_LED);
 
   webserver.setContentLength(CONTENT_LENGTH_UNKNOWN);
@@ -1072,7 +1504,7 @@ void handle_delete_file(void) {
 
   String tmp = "";
 
-  VLOG("webserver: handling /delete_file, filename = %s", webserver.arg("filename").c_str());
+  LOGI(LOG_MOD_WEB, "webserver: handling /delete_file, filename = %s", webserver.arg("filename").c_str());
   PULSE_LED(NET_ACT_LED);
 
   if (SPIFFS.exists(webserver.arg("filename"))) {
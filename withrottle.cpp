@@ -113,10 +113,18 @@ const char default_config_file_data[] = "VN2.0\n"
                                         "PW12080\n"
                                         "*10\n";
 
+//
+/// router enable predicate for the withrottle input queue
+//
+
+bool withrottle_in_enabled(void) {
+  return (num_wi_clients > 0);
+}
+
 void withrottle_task(void *params) {
 
   WiFiServer server;
-  twai_message_t cf;
+  twai_message_t cf = {};
   char tbuff[64], buffer[PROXY_BUF_LEN];
   byte i, j;
   unsigned long hb_timer = millis(), ka_timer = millis(), stimer = millis();
@@ -133,6 +141,12 @@ void withrottle_task(void *params) {
 
   VLOG("withrottle_task: DCC backend = %s", (config_data.dcc_type == DCC_MERG) ? "MERG" : "DCC++");
 
+  // with the MERG backend, we only need the CANCMD responses to loco requests, while there are connected clients
+  if (config_data.dcc_type == DCC_MERG) {
+    static const byte wi_opcodes[] = { OPC_PLOC, OPC_ERR };
+    router_subscribe(QUEUE_WITHROTTLE_IN, wi_opcodes, sizeof(wi_opcodes), ROUTE_FRAME_STD, withrottle_in_enabled);
+  }
+
   if (config_data.dcc_type == DCC_DCCPP && !config_data.ser_on) {
     VLOG("withrottle_task: using DCC++ backend but serial server task is not configured to run, suspending task");
     vTaskSuspend(NULL);
@@ -396,7 +410,7 @@ void withrottle_task(void *params) {
       /// we are only interested in CANCMD opcodes
       //
 
-      if (xQueueReceive(withrottle_queue, &cf, QUEUE_OP_TIMEOUT) == pdTRUE) {
+      if (frame_pool_receive(withrottle_queue, &cf, QUEUE_OP_TIMEOUT) == pdTRUE) {
         // VLOG("withrottle_task: got new frame from output queue: %s", format_CAN_frame(&cf));
 
         // check whether the opcode is something relevant from the CANCMD command station
@@ -443,7 +457,7 @@ void withrottle_task(void *params) {
 
       while (xSemaphoreTake(mtx_wi, QUEUE_OP_TIMEOUT) != pdTRUE);
       if (msgbuf_wi_in.head != msgbuf_wi_in.tail) {
-        VLOG("withrottle_task: got new message from DCC++, buffer = %d, %s", msgbuf_wi_in.tail, msgbuf_wi_in.buffer[msgbuf_wi_in.tail]);
+        LOGD(LOG_MOD_WT, "withrottle_task: got new message from DCC++, buffer = %d, %s", msgbuf_wi_in.tail, msgbuf_wi_in.buffer[msgbuf_wi_in.tail]);
         strncpy(buffer, msgbuf_wi_in.buffer[msgbuf_wi_in.tail], sizeof(buffer));
         msgbuf_wi_in.tail = (msgbuf_wi_in.tail + 1) % NUM_PROXY_CMDS;
         got_message = true;
@@ -452,7 +466,7 @@ void withrottle_task(void *params) {
       xSemaphoreGive(mtx_wi);
 
       if (got_message) {
-        VLOG("withrottle_task: processing incoming DCC++ message = %s", buffer);
+        LOGD(LOG_MOD_WT, "withrottle_task: processing incoming DCC++ message = %s", buffer);
         got_message = false;
 
         // only one message type of interest
@@ -461,7 +475,7 @@ void withrottle_task(void *params) {
         if (buffer[1] == 'T') {
           unsigned int  treg, taddr, tspeed, tdir;
           byte ntokens = sscanf(buffer + 2, "%d %d %d %d", &treg, &taddr, &tspeed, &tdir);
-          VLOG("withrottle_task: parsed %d tokens from DCC++ message = |%s| to %h, %d, %h, %h", ntokens, buffer, treg, taddr, tspeed, tdir);
+          LOGD(LOG_MOD_WT, "withrottle_task: parsed %d tokens from DCC++ message = |%s| to %h, %d, %h, %h", ntokens, buffer, treg, taddr, tspeed, tdir);
 
           if (treg <= MAX_WITHROTTLE_CLIENTS) {
             w_clients[treg - 1].session_id = treg;
@@ -482,12 +496,12 @@ void withrottle_task(void *params) {
     if (millis() - stimer >= 10000) {
       stimer = millis();
 
-      VLOG("withrottle_task: [%d] clients = %d", config_data.CANID, num_wi_clients);
+      LOGI(LOG_MOD_WT, "withrottle_task: [%d] clients = %d", config_data.CANID, num_wi_clients);
 
       for (i = 0; i < MAX_WITHROTTLE_CLIENTS && num_wi_clients > 0; i++) {
 
         if (w_clients[i].client != NULL) {
-          VLOG("withrottle_task: [%d] %s/%d, %d: %d %c, %d %d", i, w_clients[i].ip, w_clients[i].port, w_clients[i].session_id, \
+          LOGD(LOG_MOD_WT, "withrottle_task: [%d] %s/%d, %d: %d %c, %d %d", i, w_clients[i].ip, w_clients[i].port, w_clients[i].session_id, \
                w_clients[i].loco_addr, w_clients[i].loco_addr_type, w_clients[i].speed, w_clients[i].direction);
         }
       }
@@ -506,10 +520,10 @@ bool send_wt_message_to_throttle(int i, char msg[]) {
   ssize_t b;
   bool ret = true;
 
-  VLOG("withrottle_task: send_wt_message_to_throttle: client = %d, message = |%s|", i,  msg);
+  LOGD(LOG_MOD_WT, "withrottle_task: send_wt_message_to_throttle: client = %d, message = |%s|", i,  msg);
 
   if ((b = w_clients[i].client->write(msg, s)) != s) {
-    VLOG("withrottle_task: send_wt_message_to_throttle: = %d, expected = %d, sent = %d", i, s, b);
+    LOGW(LOG_MOD_WT, "withrottle_task: send_wt_message_to_throttle: = %d, expected = %d, sent = %d", i, s, b);
     PULSE_LED(ERR_IND_LED);
     ret = false;
   } else {
@@ -529,7 +543,7 @@ bool send_wt_message_to_throttle(int i, char msg[]) {
 
 bool process_wt_message(int i, char cmd[]) {
 
-  VLOG("withrottle_task: process_wt_message: client = %d, command = |%s|", i, cmd);
+  LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: client = %d, command = |%s|", i, cmd);
 
   char addrbuff[8], tokens[2][16], *ptr;
   byte addridx = 0;
@@ -546,7 +560,7 @@ bool process_wt_message(int i, char cmd[]) {
     ptr = strtok(NULL, "<;>");
   }
 
-  VLOG("withrottle_task: process_wt_message: parsed %d tokens", j);
+  LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: parsed %d tokens", j);
 
   switch (tokens[0][0]) {
     case 'Q':
@@ -567,11 +581,11 @@ bool process_wt_message(int i, char cmd[]) {
       break;
 
     case '*':
-      VLOG("withrottle_task: process_wt_message: client = %d, heartbeat", i);
+      LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: client = %d, heartbeat", i);
 
       if (tokens[0][1] == '+' || tokens[0][1] == '-') {
         w_clients[i].throttle_sends_heartbeat = (tokens[0][1] == '+');
-        VLOG("withrottle_task: process_wt_message: client = %d, will send heartbeats = %d", i, w_clients[i].throttle_sends_heartbeat);
+        LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: client = %d, will send heartbeats = %d", i, w_clients[i].throttle_sends_heartbeat);
       }
 
       return true;
@@ -586,7 +600,7 @@ bool process_wt_message(int i, char cmd[]) {
       break;
 
     case 'M':
-      VLOG("withrottle_task: process_wt_message: client = %d, throttle request = %s", i, cmd);
+      LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: client = %d, throttle request = %s", i, cmd);
 
       // parse the loco address
 
@@ -606,7 +620,7 @@ bool process_wt_message(int i, char cmd[]) {
       addrbuff[addridx] = 0;
       w_clients[i].loco_addr = atoi(addrbuff);
       w_clients[i].loco_addr_type = tokens[0][3];
-      VLOG("withrottle_task: process_wt_message: address = %d, type = %c", w_clients[i].loco_addr, w_clients[i].loco_addr_type);
+      LOGD(LOG_MOD_WT, "withrottle_task: process_wt_message: address = %d, type = %c", w_clients[i].loco_addr, w_clients[i].loco_addr_type);
 
       // parse and dispatch the command
       switch (tokens[0][2]) {
@@ -660,7 +674,7 @@ bool get_wt_session(int i) {
 
   if (config_data.dcc_type == DCC_MERG) {
     // MERG
-    twai_message_t cf;
+    twai_message_t cf = {};
     cf.identifier = make_can_header();
     cf.data_length_code = 3;
     cf.data[0] = OPC_RLOC;
@@ -695,7 +709,7 @@ bool release_wt_session(int i) {
 
   if (config_data.dcc_type == DCC_MERG) {
     // MERG
-    twai_message_t cf;
+    twai_message_t cf = {};
     cf.identifier = make_can_header();
     cf.data_length_code = 2;
     cf.data[0] = OPC_KLOC;
@@ -726,12 +740,12 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
   byte func_num, func_state, fb1, fb2;
   char buffer[PROXY_BUF_LEN], tbuff[16];
 
-  VLOG("withrottle_task: do_wt_action, i = %d, tok0 = %s, tok1 = %s", i, tok0, tok1);
+  LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, i = %d, tok0 = %s, tok1 = %s", i, tok0, tok1);
 
   switch (tok1[0]) {
     case 'V':
       w_clients[i].speed = atoi(&tok1[1]);
-      VLOG("withrottle_task: do_wt_action, setting speed to %d", w_clients[i].speed);
+      LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, setting speed to %d", w_clients[i].speed);
 
       if (config_data.dcc_type == DCC_MERG) {
         send_merg_dspd(i);
@@ -745,7 +759,7 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
 
     case 'R':
       w_clients[i].direction = atoi(&tok1[1]);
-      VLOG("withrottle_task: do_wt_action, changing direction to %d", w_clients[i].direction);
+      LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, changing direction to %d", w_clients[i].direction);
 
       if (config_data.dcc_type == DCC_MERG) {
         send_merg_dspd(i);
@@ -773,7 +787,7 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
 
     case 'I':
       w_clients[i].speed = 0;
-      VLOG("withrottle_task: do_wt_action, idle command, setting speed to %d", w_clients[i].speed);
+      LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, idle command, setting speed to %d", w_clients[i].speed);
 
       if (config_data.dcc_type == DCC_MERG) {
         send_merg_dspd(i);
@@ -788,7 +802,7 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
     case 'F':
       func_state = (tok1[1] == '1');
       func_num = atoi(&tok1[2]);
-      VLOG("withrottle_task: do_wt_action, function command, num = %d, state = %d", func_num, func_state);
+      LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, function command, num = %d, state = %d", func_num, func_state);
 
       switch (func_num) {
         case 0:
@@ -864,7 +878,7 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
       break;
 
     case 'q':
-      VLOG("withrottle_task: do_wt_action, query command = %c", tok1[1]);
+      LOGD(LOG_MOD_WT, "withrottle_task: do_wt_action, query command = %c", tok1[1]);
 
       if (tok1[1] == 'V') {
         snprintf(tbuff, sizeof(tbuff), "M0A%c%d<;>V%d", w_clients[i].loco_addr_type, w_clients[i].loco_addr, w_clients[i].speed);
@@ -877,7 +891,7 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
       break;
 
     default:
-      VLOG("withrottle_task: do_wt_action, unhandled command = %c", tok1[0]);
+      LOGW(LOG_MOD_WT, "withrottle_task: do_wt_action, unhandled command = %c", tok1[0]);
       break;
   }
 
@@ -890,14 +904,14 @@ bool do_wt_action(int i, char tok0[], char tok1[]) {
 
 void send_merg_keepalive(int i) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   if (w_clients[i].state != W_ACTIVE || w_clients[i].session_id == 0) {
-    VLOG("withrottle_task: send_merg_keepalive: client %d has no current session", i);
+    LOGW(LOG_MOD_WT, "withrottle_task: send_merg_keepalive: client %d has no current session", i);
     return;
   }
 
-  VLOG("withrottle_task: sending MERG keepalive");
+  LOGD(LOG_MOD_WT, "withrottle_task: sending MERG keepalive");
 
   cf.identifier = make_can_header();
   cf.data_length_code = 2;
@@ -913,14 +927,14 @@ void send_merg_keepalive(int i) {
 
 void send_merg_dspd(int i) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   if (w_clients[i].state != W_ACTIVE || w_clients[i].session_id == 0) {
-    VLOG("withrottle_task: send_merg_dspd: client %d has no current session", i);
+    LOGW(LOG_MOD_WT, "withrottle_task: send_merg_dspd: client %d has no current session", i);
     return;
   }
 
-  VLOG("withrottle_task: send_merg_dspd: sending speed/dir message to command station, client = %d, speed = %d, dir = %d", i, w_clients[i].speed, w_clients[i].direction);
+  LOGD(LOG_MOD_WT, "withrottle_task: send_merg_dspd: sending speed/dir message to command station, client = %d, speed = %d, dir = %d", i, w_clients[i].speed, w_clients[i].direction);
 
   cf.identifier = make_can_header();
   cf.data_length_code = 3;
@@ -938,14 +952,14 @@ void send_merg_dspd(int i) {
 
 void send_merg_func_dfn(int i, byte func, byte state) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   if (w_clients[i].state != W_ACTIVE || w_clients[i].session_id == 0) {
-    VLOG("withrottle_task: send_merg_func_dfn: client %d has no current session", i);
+    LOGW(LOG_MOD_WT, "withrottle_task: send_merg_func_dfn: client %d has no current session", i);
     return;
   }
 
-  VLOG("withrottle_task: send_merg_func_dfn: sending function command, client = %d, func = %d, state = %d", i, func, state);
+  LOGD(LOG_MOD_WT, "withrottle_task: send_merg_func_dfn: sending function command, client = %d, func = %d, state = %d", i, func, state);
 
   cf.identifier = make_can_header();
   cf.data_length_code = 3;
@@ -962,14 +976,14 @@ void send_merg_func_dfn(int i, byte func, byte state) {
 
 void send_merg_func_dfun(int i, byte fb1, byte fb2) {
 
-  twai_message_t cf;
+  twai_message_t cf = {};
 
   if (w_clients[i].state != W_ACTIVE || w_clients[i].session_id == 0) {
-    VLOG("withrottle_task: send_merg_func_dfun: client %d has no current session", i);
+    LOGW(LOG_MOD_WT, "withrottle_task: send_merg_func_dfun: client %d has no current session", i);
     return;
   }
 
-  VLOG("withrottle_task: send_merg_func_dfun: sending function command, client = %d, fb1 = %d, fb2 = %d", i, fb1, fb2);
+  LOGD(LOG_MOD_WT, "withrottle_task: send_merg_func_dfun: sending function command, client = %d, fb1 = %d, fb2 = %d", i, fb1, fb2);
 
   cf.identifier = make_can_header();
   cf.data_length_code = 3;
@@ -990,7 +1004,7 @@ void send_dccpp_command(const char cmd[]) {
   strncpy(msgbuf_wi_out.buffer[msgbuf_wi_out.head], cmd, PROXY_BUF_LEN);
   msgbuf_wi_out.head = (msgbuf_wi_out.head + 1) % NUM_PROXY_CMDS;
   xSemaphoreGive(mtx_wi);
-  VLOG("withrottle_task: send_dccpp_command, sent cmd to DCC++ command station = %s, h = %d, t = %d", cmd, \
+  LOGD(LOG_MOD_WT, "withrottle_task: send_dccpp_command, sent cmd to DCC++ command station = %s, h = %d, t = %d", cmd, \
        msgbuf_wi_out.head, msgbuf_wi_out.tail);
 
   return;
@@ -1005,7 +1019,7 @@ void send_to_queues(twai_message_t *cf) {
   uint16_t queues = QUEUE_CAN_OUT_FROM_WI | QUEUE_NET_OUT | QUEUE_GC_OUT | QUEUE_CMDPROXY_IN | QUEUE_CBUS_INTERNAL;
 
   if (!send_message_to_queues(queues, cf, "withrottle_task", QUEUE_OP_TIMEOUT_NONE)) {
-    LOG("withrottle_task: error queuing message");
+    LOGE(LOG_MOD_WT, "withrottle_task: error queuing message");
     PULSE_LED(ERR_IND_LED);
   }
 
@@ -42,6 +42,9 @@
 //
 /// experimental websocket server
 /// to publish logger data and CAN messages
+///
+/// a client connecting to ws://<node>:81/log is sent the recent log messages kept in RAM, then new ones as they are
+/// logged; other clients are sent CAN messages in gridconnect format
 //
 
 #include <WiFi.h>
@@ -52,6 +55,8 @@
 typedef struct {
   bool connected;
   uint8_t num;
+  bool log_tail;                  // client wants log messages rather than CAN messages
+  unsigned long log_seq;          // next log message to send
 } ws_client_t;
 
 ws_client_t ws_clients[WEBSOCKETS_SERVER_CLIENT_MAX];
@@ -70,6 +75,8 @@ void wsserver_task(void *params) {
   twai_message_t cf;
   unsigned long stats_timer = 0UL;
   char gcbuff[32];
+  char msg[DEBUG_MSG_LEN + 16];
+  unsigned long missed;
 
   VLOG("wsserver_task: websocket server starting, max clients = %d", WEBSOCKETS_SERVER_CLIENT_MAX);
   wsserver_running = true;
@@ -78,6 +85,7 @@ void wsserver_task(void *params) {
   for (i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
     ws_clients[i].connected = false;
     ws_clients[i].num = 0;
+    ws_clients[i].log_tail = false;
   }
 
   // start websocket server
@@ -100,10 +108,25 @@ void wsserver_task(void *params) {
       }
     }
 
+    // send new log messages to log clients, a few at a time so the server isn't held up
+    for (i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
+      if (ws_clients[i].connected && ws_clients[i].log_tail) {
+        for (byte n = 0; n < LOGTAIL_WS_BURST && logtail_read(&ws_clients[i].log_seq, msg, sizeof(msg), &missed); n++) {
+          // a client that started from 0 wanted whatever there was, so hasn't lost anything
+          if (missed > 0 && ws_clients[i].log_seq > missed + 1) {
+            snprintf(gcbuff, sizeof(gcbuff), "*** %lu messages lost ***", missed);
+            websocket.sendTXT(ws_clients[i].num, gcbuff);
+          }
+
+          websocket.sendTXT(ws_clients[i].num, msg);
+        }
+      }
+    }
+
     // get next CAN frame from incoming queue
-    if (xQueueReceive(wsserver_out_queue, &cf, QUEUE_OP_TIMEOUT_LONG) == pdTRUE) {
+    if (frame_pool_receive(wsserver_out_queue, &cf, QUEUE_OP_TIMEOUT_LONG) == pdTRUE) {
       for (i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
-        if (ws_clients[i].connected) {
+        if (ws_clients[i].connected && !ws_clients[i].log_tail) {
           CANtoGC(&cf, gcbuff);
           websocket.sendTXT(ws_clients[i].num, gcbuff);
         }
@@ -139,6 +162,8 @@ void on_websocket_event(uint8_t num, WStype_t type, uint8_t *payload, size_t len
         if (!ws_clients[i].connected) {
           ws_clients[i].connected = true;
           ws_clients[i].num = num;
+          ws_clients[i].log_tail = (strncmp((const char *)payload, "/log", 4) == 0);
+          ws_clients[i].log_seq = 0;
           break;
         }
       }